@@ -0,0 +1,6685 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+/*** includes ***/
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#ifdef TVIM_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "libtvim.h"
+
+// allocations are counted for :stats, see stats_malloc.
+#define malloc(size) stats_malloc(size)
+#define calloc(n, size) stats_calloc(n, size)
+#define realloc(p, size) stats_realloc(p, size)
+
+/*** data ***/
+
+struct stats tvimStats;
+
+/*** fatal errors ***/
+
+static void (*crash_hook)();
+
+// Have crash() call hook first, to put the terminal back before it reports.
+void crash_set_hook(void (*hook)()) {
+    crash_hook = hook;
+}
+
+// Report what failed with errno and exit.
+void crash(const char* s) {
+    int err = errno;
+    if (crash_hook != NULL) {
+        crash_hook();
+    }
+    errno = err;
+    perror(s);
+    exit(99);
+}
+
+/*** stats ***/
+
+static const char* const stats_timers[STAT_TIMERS] = {
+    [STAT_READ] = "read_key", [STAT_KEY] = "process_key",
+    [STAT_DRAW] = "refresh",  [STAT_LOAD] = "load",
+    [STAT_SAVE] = "save",
+};
+
+void* stats_malloc(size_t size) {
+    if (atomic_load(&tvimStats.on)) {
+        atomic_fetch_add(&tvimStats.mallocs, 1);
+        atomic_fetch_add(&tvimStats.allocBytes, size);
+    }
+    return (malloc)(size);
+}
+
+void* stats_calloc(size_t n, size_t size) {
+    if (atomic_load(&tvimStats.on)) {
+        atomic_fetch_add(&tvimStats.mallocs, 1);
+        atomic_fetch_add(&tvimStats.allocBytes, n * size);
+    }
+    return (calloc)(n, size);
+}
+
+void* stats_realloc(void* p, size_t size) {
+    if (atomic_load(&tvimStats.on)) {
+        atomic_fetch_add(&tvimStats.reallocs, 1);
+        atomic_fetch_add(&tvimStats.allocBytes, size);
+    }
+    return (realloc)(p, size);
+}
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int stats_bucket(long long v) {
+    if (v < 8) {
+        return MAX(v, 0);
+    }
+    int top = 63 - __builtin_clzll(v);
+    return (top - 1) * 4 + (int)((v >> (top - 2)) & 3);
+}
+
+// Largest value that lands in bucket b.
+static long long stats_bucket_max(int b) {
+    if (b < 8) {
+        return b;
+    }
+    return (long long)(((unsigned long long)(5 + b % 4) << (b / 4 - 1)) - 1);
+}
+
+static void stats_add(struct stathist* h, long long v) {
+    h->n++;
+    h->total += v;
+    h->max = MAX(h->max, v);
+    h->buckets[stats_bucket(v)]++;
+}
+
+// The pct-th percentile, rounded up to the end of its bucket, so at most a
+// quarter over.
+static long long stats_pct(struct stathist* h, int pct) {
+    long long rank = MAX((h->n * pct + 99) / 100, 1);
+    long long seen = 0;
+    for (int b = 0; b < TVIM_STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            return MIN(stats_bucket_max(b), h->max);
+        }
+    }
+    return h->max;
+}
+
+// Start collecting from scratch.
+void stats_enable() {
+    struct stats* st = &tvimStats;
+    memset(st->timers, 0, sizeof(st->timers));
+    memset(&st->frameBytes, 0, sizeof(st->frameBytes));
+    atomic_store(&st->mallocs, 0);
+    atomic_store(&st->reallocs, 0);
+    atomic_store(&st->allocBytes, 0);
+    st->since = now_ns();
+    st->until = 0;
+    atomic_store(&st->on, true);
+}
+
+// Clock reading to hand to stats_stop, 0 while the stats are off.
+long long stats_start() {
+    return atomic_load(&tvimStats.on) ? now_ns() : 0;
+}
+
+void stats_stop(int timer, long long start) {
+    if (start != 0 && atomic_load(&tvimStats.on)) {
+        stats_add(&tvimStats.timers[timer], now_ns() - start);
+    }
+}
+
+// A frame drawn since start, bytes long.
+void stats_frame(long long start, int bytes) {
+    if (start != 0 && atomic_load(&tvimStats.on)) {
+        stats_add(&tvimStats.timers[STAT_DRAW], now_ns() - start);
+        stats_add(&tvimStats.frameBytes, bytes);
+    }
+}
+
+static void stats_row(FILE* out, const char* name, struct stathist* h,
+                      double unit) {
+    fprintf(out, "%-12s %10lld %10.1f %10.1f %10.1f %10.1f\n", name, h->n,
+            h->n ? h->total / unit / h->n : 0, stats_pct(h, 50) / unit,
+            stats_pct(h, 99) / unit, h->max / unit);
+}
+
+void stats_report(FILE* out) {
+    struct stats* st = &tvimStats;
+    if (st->since == 0) {
+        fprintf(out, "no stats collected\n");
+        return;
+    }
+    long long until = atomic_load(&st->on) ? now_ns() : st->until;
+    fprintf(out, "tvim stats over %.1f s\n\n", (until - st->since) / 1e9);
+    fprintf(out, "%-12s %10s %10s %10s %10s %10s\n", "timer", "n", "mean_us",
+            "p50_us", "p99_us", "max_us");
+    for (int t = 0; t < STAT_TIMERS; t++) {
+        stats_row(out, stats_timers[t], &st->timers[t], 1e3);
+    }
+    fprintf(out, "\n%-12s %10s %10s %10s %10s %10s\n", "output", "n", "mean_B",
+            "p50_B", "p99_B", "max_B");
+    stats_row(out, "frame", &st->frameBytes, 1);
+    fprintf(out, "\nallocations  %lld malloc, %lld realloc, %lld bytes\n",
+            (long long)atomic_load(&st->mallocs),
+            (long long)atomic_load(&st->reallocs),
+            (long long)atomic_load(&st->allocBytes));
+}
+
+// :stats shows the key and redraw times in the status bar, and starts
+// collecting afresh if that was off. :stats file writes the whole report
+// to file, :stats off stops collecting and keeps what there is.
+void stats_command(struct editor* ed, const char* s, int len) {
+    struct stats* st = &tvimStats;
+    while (len > 0 && *s == ' ') {
+        s++;
+        len--;
+    }
+    if (len == 3 && memcmp(s, "off", 3) == 0) {
+        if (atomic_load(&st->on)) {
+            st->until = now_ns();
+        }
+        atomic_store(&st->on, false);
+        tvim_set_status(ed, "stats off");
+        return;
+    }
+    if (!atomic_load(&st->on)) {
+        stats_enable();
+        tvim_set_status(ed, "collecting stats, :stats again to see them");
+        return;
+    }
+
+    if (len > 0) {
+        char* path = strndup(s, len);
+        if (path == NULL) {
+            crash("strndup");
+        }
+        FILE* f = fopen(path, "w");
+        if (f == NULL) {
+            tvim_set_status(ed, "stats: %s: %s", path, strerror(errno));
+        } else {
+            stats_report(f);
+            fclose(f);
+            tvim_set_status(ed, "stats written to %s", path);
+        }
+        free(path);
+        return;
+    }
+
+    struct stathist* key = &st->timers[STAT_KEY];
+    struct stathist* draw = &st->timers[STAT_DRAW];
+    struct stathist* bytes = &st->frameBytes;
+    tvim_set_status(ed,
+                    "p50/p99 key %.0f/%.0fus draw %.0f/%.0fus, %lldB/frame, "
+                    "%lld allocs",
+                    stats_pct(key, 50) / 1e3, stats_pct(key, 99) / 1e3,
+                    stats_pct(draw, 50) / 1e3, stats_pct(draw, 99) / 1e3,
+                    bytes->n ? bytes->total / bytes->n : 0,
+                    (long long)(atomic_load(&st->mallocs) +
+                                atomic_load(&st->reallocs)));
+}
+
+// Write the report to the TVIM_STATS file, if there is one.
+void stats_exit() {
+    struct stats* st = &tvimStats;
+    if (st->dump == NULL) {
+        return;
+    }
+    FILE* f = fopen(st->dump, "w");
+    if (f != NULL) {
+        stats_report(f);
+        fclose(f);
+    }
+    free(st->dump);
+    st->dump = NULL;
+}
+
+/*** append buffer ***/
+
+struct abuf ab_init() {
+    // initial size 8, randomly selected can change.
+    int initial_capacity = 8;
+    struct abuf ab = {0};
+
+    // malloc() causes an error in realloc for ab_append? unsure why. calloc
+    // seems to fix this issue.
+
+    /*ab.buf = (char*)malloc(sizeof(char) * initial_capacity);*/
+    ab.buf = (char*)calloc(sizeof(char), sizeof(char) * initial_capacity);
+    ab.capacity = 8;
+    ab.len = 0;
+
+    return ab;
+}
+
+void ab_append(struct abuf* ab, const char* s, int len) {
+    // Realloc memory, keep increasing until enough memory allocated.
+    if (ab->len + len >= ab->capacity) {
+        int new_capacity = ab->capacity;
+        while (ab->len + len > new_capacity) {
+            new_capacity *= 2;
+        }
+        ab->buf = (char*)realloc(ab->buf, new_capacity * sizeof(char));
+        if (ab->buf == NULL) {
+            crash("Realloc");
+        }
+        ab->capacity = new_capacity;
+    }
+
+    // copy new string into buffer.
+    memcpy(&ab->buf[ab->len], s, len);
+    ab->len += len;
+}
+
+void ab_free(struct abuf* ab) {
+    if (ab->buf != NULL) {
+        free(ab->buf);
+    }
+}
+
+/*** frame ***/
+
+// Bring screen line y up to date with line, sending only the bytes that
+// differ from the shadow copy: everything after the common prefix, minus
+// the common suffix when the length did not change. sgr, if given, is
+// the attribute the whole line is drawn with.
+void frame_put(struct editor* ed, struct abuf* ab, int y, struct abuf* line,
+               const char* sgr) {
+    struct frame* f = &ed->frame;
+    struct abuf* old = &f->lines[y];
+    int sgrLen = sgr ? strlen(sgr) : 0;
+
+    // what the line costs when the screen is redrawn from scratch.
+    f->cost += line->len + 5 + (sgr ? sgrLen + 3 : 0);
+
+    int start = 0;
+    while (start < line->len && start < old->len &&
+           line->buf[start] == old->buf[start]) {
+        start++;
+    }
+    if (start == line->len && start == old->len) {
+        return;
+    }
+
+    // with anything but ASCII a byte is no longer a column: go back to the
+    // char the difference is in, in either version, and count the columns
+    // up to it. Colour escapes take none, the last one before the start is
+    // sent again. The two versions can differ in width, so the rest of the
+    // line goes out.
+    bool plain = utf8_ascii(line->buf, line->len) &&
+                 utf8_ascii(old->buf, old->len) &&
+                 memchr(line->buf, '\x1b', line->len) == NULL &&
+                 memchr(old->buf, '\x1b', old->len) == NULL;
+    int col = start;
+    int esc = 0;
+    int escLen = 0;
+    if (!plain) {
+        int p = 0;
+        col = 0;
+        while (p < start) {
+            int n;
+            if (line->buf[p] == '\x1b') {
+                n = 1;
+                while (p + n < line->len && line->buf[p + n - 1] != 'm') {
+                    n++;
+                }
+                if (p + n > start) {
+                    break;
+                }
+                esc = p;
+                escLen = n;
+            } else {
+                n = utf8_next(&line->buf[p], line->len - p);
+                if (p + MAX(n, utf8_next(&old->buf[p], old->len - p)) >
+                    start) {
+                    break;
+                }
+                col += utf8_cols(&line->buf[p], n);
+            }
+            p += n;
+        }
+        start = p;
+    }
+    int end = line->len;
+    if (plain && line->len == old->len) {
+        while (end > start && line->buf[end - 1] == old->buf[end - 1]) {
+            end--;
+        }
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, col + 1);
+    ab_append(ab, buf, strlen(buf));
+    if (sgr) {
+        ab_append(ab, sgr, sgrLen);
+    }
+    ab_append(ab, &line->buf[esc], escLen);
+    ab_append(ab, &line->buf[start], end - start);
+    if (sgr) {
+        ab_append(ab, "\x1b[m", 3);
+    }
+    if (line->len < old->len || !plain) {
+        ab_append(ab, "\x1b[K", 3);
+    }
+
+    old->len = 0;
+    ab_append(old, line->buf, line->len);
+}
+
+// Follow a change of rowOff by scrolling the text area on the terminal,
+// which is cheaper than resending the lines that are still visible.
+void frame_scroll(struct editor* ed, struct abuf* ab, int rowOff) {
+    struct frame* f = &ed->frame;
+    int n = ed->screenRows;
+    int d = rowOff - f->rowOff;
+    f->rowOff = rowOff;
+    if (d == 0 || d >= n || -d >= n) {
+        return;
+    }
+
+    char buf[48];
+    snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", n, abs(d),
+             d > 0 ? 'S' : 'T');
+    ab_append(ab, buf, strlen(buf));
+
+    // rotate the shadow the same way, the lines scrolled in are blank.
+    struct abuf tmp[abs(d)];
+    if (d > 0) {
+        memcpy(tmp, f->lines, sizeof(struct abuf) * d);
+        memmove(f->lines, &f->lines[d], sizeof(struct abuf) * (n - d));
+        memcpy(&f->lines[n - d], tmp, sizeof(struct abuf) * d);
+        for (int y = n - d; y < n; y++) {
+            f->lines[y].len = 0;
+        }
+    } else {
+        d = -d;
+        memcpy(tmp, &f->lines[n - d], sizeof(struct abuf) * d);
+        memmove(&f->lines[d], f->lines, sizeof(struct abuf) * (n - d));
+        memcpy(f->lines, tmp, sizeof(struct abuf) * d);
+        for (int y = 0; y < d; y++) {
+            f->lines[y].len = 0;
+        }
+    }
+}
+
+// Forget what is on screen so the next refresh clears and redraws it all.
+void frame_invalidate(struct editor* ed) {
+    ed->frame.valid = false;
+}
+
+void frame_free(struct editor* ed) {
+    struct frame* f = &ed->frame;
+    for (int i = 0; i < f->nLines; i++) {
+        ab_free(&f->lines[i]);
+    }
+    free(f->lines);
+    f->lines = NULL;
+    f->nLines = 0;
+    f->valid = false;
+}
+
+/*** arena ***/
+
+void* arena_alloc(struct arena* a, size_t size) {
+    // keep chunks pointer aligned so the arena can hold more than chars.
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    arenachunk_t* chunk = a->head;
+    if (chunk == NULL || chunk->used + size > chunk->cap) {
+        size_t cap = MAX(size, (size_t)TVIM_ARENA_CHUNK);
+        chunk = (arenachunk_t*)malloc(sizeof(arenachunk_t) + cap);
+        if (chunk == NULL) {
+            crash("malloc");
+        }
+        chunk->used = 0;
+        chunk->cap = cap;
+
+        // an oversized one-off goes behind the current chunk so the space
+        // left in that chunk is not thrown away.
+        if (a->head != NULL && cap > TVIM_ARENA_CHUNK) {
+            chunk->next = a->head->next;
+            a->head->next = chunk;
+        } else {
+            chunk->next = a->head;
+            a->head = chunk;
+        }
+    }
+
+    void* p = &chunk->data[chunk->used];
+    chunk->used += size;
+    return p;
+}
+
+// Take over every chunk of from. They go behind a's current chunk so a
+// keeps filling that one.
+void arena_adopt(struct arena* a, struct arena* from) {
+    arenachunk_t* last = from->head;
+    if (last == NULL) {
+        return;
+    }
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    if (a->head == NULL) {
+        a->head = from->head;
+    } else {
+        last->next = a->head->next;
+        a->head->next = from->head;
+    }
+    from->head = NULL;
+}
+
+void arena_release(struct arena* a) {
+    arenachunk_t* chunk = a->head;
+    while (chunk != NULL) {
+        arenachunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    a->head = NULL;
+}
+
+/*** render cache ***/
+
+static void rcache_unlink(struct editor* ed, int slot) {
+    struct rendercache* rc = &ed->render;
+    rslot_t* s = &rc->slots[slot];
+    if (s->prev != -1) {
+        rc->slots[s->prev].next = s->next;
+    } else {
+        rc->head = s->next;
+    }
+    if (s->next != -1) {
+        rc->slots[s->next].prev = s->prev;
+    } else {
+        rc->tail = s->prev;
+    }
+}
+
+static void rcache_push(struct editor* ed, int slot) {
+    struct rendercache* rc = &ed->render;
+    rslot_t* s = &rc->slots[slot];
+    s->prev = -1;
+    s->next = rc->head;
+    if (rc->head != -1) {
+        rc->slots[rc->head].prev = slot;
+    } else {
+        rc->tail = slot;
+    }
+    rc->head = slot;
+}
+
+static void rcache_drop(struct editor* ed, int slot) {
+    struct rendercache* rc = &ed->render;
+    rslot_t* s = &rc->slots[slot];
+    rcache_unlink(ed, slot);
+    free(s->cols);
+    s->cols = NULL;
+    rc->bytes -= s->size;
+    s->gen++;
+    s->next = rc->freeSlot;
+    rc->freeSlot = slot;
+}
+
+// Hand out a slot with size bytes of index, evicting the least recently
+// used renders to stay inside the budget.
+static int rcache_take(struct editor* ed, int size) {
+    struct rendercache* rc = &ed->render;
+    if (rc->slots == NULL) {
+        rc->head = rc->tail = rc->freeSlot = -1;
+    }
+    while (rc->tail != -1 && rc->bytes + size > TVIM_RENDER_BUDGET) {
+        rcache_drop(ed, rc->tail);
+    }
+
+    if (rc->freeSlot == -1) {
+        int cap = rc->cap ? rc->cap * 2 : 64;
+        rc->slots = (rslot_t*)realloc(rc->slots, sizeof(rslot_t) * cap);
+        if (rc->slots == NULL) {
+            crash("realloc");
+        }
+        for (int i = cap - 1; i >= rc->cap; i--) {
+            rc->slots[i].cols = NULL;
+            rc->slots[i].gen = 0;
+            rc->slots[i].next = rc->freeSlot;
+            rc->freeSlot = i;
+        }
+        rc->cap = cap;
+    }
+
+    int slot = rc->freeSlot;
+    rslot_t* s = &rc->slots[slot];
+    rc->freeSlot = s->next;
+    s->cols = (int*)malloc(size);
+    if (s->cols == NULL) {
+        crash("malloc");
+    }
+    s->size = size;
+    rc->bytes += size;
+    rcache_push(ed, slot);
+    return slot;
+}
+
+static bool rcache_valid(struct editor* ed, row_t* row) {
+    return row->rstate == RENDER_CACHED &&
+           ed->render.slots[row->rslot].gen == row->rgen;
+}
+
+void rcache_free(struct editor* ed) {
+    struct rendercache* rc = &ed->render;
+    for (int i = 0; i < rc->cap; i++) {
+        free(rc->slots[i].cols);
+    }
+    free(rc->slots);
+    memset(rc, 0, sizeof(*rc));
+}
+
+/*** row storage ***/
+
+static rownode_t* rownode_new(bool leaf) {
+    rownode_t* node = (rownode_t*)malloc(sizeof(rownode_t));
+    if (node == NULL) {
+        crash("malloc");
+    }
+    node->leaf = leaf;
+    node->n = 0;
+    node->count = 0;
+    return node;
+}
+
+static void rownode_free(struct editor* ed, rownode_t* node) {
+    for (int i = 0; i < node->n; i++) {
+        if (node->leaf) {
+            row_free(ed, &node->rows[i]);
+        } else {
+            rownode_free(ed, node->child[i]);
+        }
+    }
+    free(node);
+}
+
+// Pick the child of an inner node that holds row *at and make *at relative
+// to that child. An index one past the end lands in the last child.
+static int rownode_find(rownode_t* node, int* at) {
+    int i = 0;
+    while (i < node->n - 1 && *at >= node->child[i]->count) {
+        *at -= node->child[i]->count;
+        i++;
+    }
+    return i;
+}
+
+// Inline rows point into themselves, so after rows are moved around a
+// leaf their chars have to be pointed back at their own inl.
+static void rows_relink(row_t* rows, int n) {
+    for (int r = 0; r < n; r++) {
+        if (rows[r].store == ROW_INLINE) {
+            rows[r].chars = rows[r].inl;
+        }
+    }
+}
+
+static row_t* rowleaf_insert(rownode_t* leaf, int at) {
+    memmove(&leaf->rows[at + 1], &leaf->rows[at],
+            sizeof(row_t) * (leaf->n - at));
+    rows_relink(&leaf->rows[at + 1], leaf->n - at);
+    leaf->n++;
+    leaf->count++;
+    return &leaf->rows[at];
+}
+
+// Insert an empty slot at `at` below node. Returns the new right sibling if
+// node had to split, NULL otherwise. Splitting at the insert point when it
+// is the end of the node keeps appends packing nodes full.
+static rownode_t* rownode_insert(rownode_t* node, int at, row_t** slot) {
+    if (node->leaf) {
+        if (node->n < TVIM_ROW_FANOUT) {
+            *slot = rowleaf_insert(node, at);
+            return NULL;
+        }
+
+        rownode_t* right = rownode_new(true);
+        int split = (at == node->n) ? node->n : node->n / 2;
+        right->n = node->n - split;
+        right->count = right->n;
+        memcpy(right->rows, &node->rows[split], sizeof(row_t) * right->n);
+        rows_relink(right->rows, right->n);
+        node->n = split;
+        node->count = split;
+
+        if (at >= split) {
+            *slot = rowleaf_insert(right, at - split);
+        } else {
+            *slot = rowleaf_insert(node, at);
+        }
+        return right;
+    }
+
+    int i = rownode_find(node, &at);
+    rownode_t* split = rownode_insert(node->child[i], at, slot);
+    node->count++;
+    if (split == NULL) {
+        return NULL;
+    }
+
+    rownode_t* dst = node;
+    int pos = i + 1;
+    rownode_t* right = NULL;
+    if (node->n == TVIM_ROW_FANOUT) {
+        right = rownode_new(false);
+        int half = (pos == node->n) ? node->n : node->n / 2;
+        right->n = node->n - half;
+        memcpy(right->child, &node->child[half],
+               sizeof(rownode_t*) * right->n);
+        node->n = half;
+        for (int c = 0; c < right->n; c++) {
+            right->count += right->child[c]->count;
+        }
+        node->count -= right->count;
+
+        if (pos >= half) {
+            dst = right;
+            pos -= half;
+        }
+    }
+
+    memmove(&dst->child[pos + 1], &dst->child[pos],
+            sizeof(rownode_t*) * (dst->n - pos));
+    dst->child[pos] = split;
+    dst->n++;
+    if (dst == right) {
+        // split's rows were counted in node when the recursion returned.
+        node->count -= split->count;
+        right->count += split->count;
+    }
+    return right;
+}
+
+// Merge child i with a neighbour once it gets sparse, and drop it entirely
+// when it is empty.
+static void rownode_rebalance(struct editor* ed, rownode_t* node, int i) {
+    rownode_t* c = node->child[i];
+    if (c->n >= TVIM_ROW_FANOUT / 4 || node->n == 1) {
+        return;
+    }
+
+    int l, r;
+    if (c->count == 0) {
+        rownode_free(ed, c);
+        r = i;
+    } else {
+        l = (i > 0) ? i - 1 : i;
+        r = l + 1;
+        rownode_t* a = node->child[l];
+        rownode_t* b = node->child[r];
+        if (a->n + b->n > TVIM_ROW_FANOUT) {
+            return;
+        }
+
+        if (a->leaf) {
+            memcpy(&a->rows[a->n], b->rows, sizeof(row_t) * b->n);
+            rows_relink(&a->rows[a->n], b->n);
+        } else {
+            memcpy(&a->child[a->n], b->child, sizeof(rownode_t*) * b->n);
+        }
+        a->n += b->n;
+        a->count += b->count;
+        free(b);
+    }
+
+    memmove(&node->child[r], &node->child[r + 1],
+            sizeof(rownode_t*) * (node->n - r - 1));
+    node->n--;
+}
+
+// Remove the row at `at` below node. The row itself is not freed.
+static void rownode_delete(struct editor* ed, rownode_t* node, int at) {
+    node->count--;
+    if (node->leaf) {
+        memmove(&node->rows[at], &node->rows[at + 1],
+                sizeof(row_t) * (node->n - at - 1));
+        rows_relink(&node->rows[at], node->n - at - 1);
+        node->n--;
+        return;
+    }
+
+    int i = rownode_find(node, &at);
+    rownode_delete(ed, node->child[i], at);
+    rownode_rebalance(ed, node, i);
+}
+
+// Open a slot for a new row at `at` and return it. The returned row is
+// uninitialised and, like every row_t*, only valid until the next insert
+// or delete.
+static row_t* rows_insert(struct editor* ed, int at) {
+    if (ed->rows == NULL) {
+        ed->rows = rownode_new(true);
+    }
+
+    row_t* slot = NULL;
+    rownode_t* split = rownode_insert(ed->rows, at, &slot);
+    if (split != NULL) {
+        rownode_t* root = rownode_new(false);
+        root->child[0] = ed->rows;
+        root->child[1] = split;
+        root->n = 2;
+        root->count = ed->rows->count + split->count;
+        ed->rows = root;
+    }
+    ed->nRows++;
+    ed->version++;
+    syntax_insert(ed, at, slot);
+    return slot;
+}
+
+static void rows_delete(struct editor* ed, int at) {
+    rownode_delete(ed, ed->rows, at);
+    while (!ed->rows->leaf && ed->rows->n == 1) {
+        rownode_t* root = ed->rows;
+        ed->rows = root->child[0];
+        free(root);
+    }
+    ed->nRows--;
+    ed->version++;
+    syntax_delete(ed, at);
+}
+
+// Row at `at`, with *run set to how many rows sit contiguously in memory
+// from it. Walking the buffer a run at a time avoids a lookup per row.
+row_t* row_run(struct editor* ed, int at, int* run) {
+    if (at < 0 || at >= ed->nRows) {
+        return NULL;
+    }
+
+    rownode_t* node = ed->rows;
+    while (!node->leaf) {
+        node = node->child[rownode_find(node, &at)];
+    }
+    if (run != NULL) {
+        *run = node->n - at;
+    }
+    return &node->rows[at];
+}
+
+row_t* row_at(struct editor* ed, int at) {
+    return row_run(ed, at, NULL);
+}
+
+void rows_free(struct editor* ed) {
+    // the gap buffer is the edited row's chars, it goes with the row.
+    ed->gap.active = false;
+    if (ed->rows != NULL) {
+        rownode_free(ed, ed->rows);
+        ed->rows = NULL;
+    }
+    ed->nRows = 0;
+}
+
+/*** utf-8 ***/
+
+// Rows hold bytes and cX is a byte index. A valid UTF-8 sequence is one
+// char as wide as its code point; a byte that is not part of one is a char
+// of its own and shows as U+FFFD. The cursor moves over a char together
+// with the zero-width chars (combining marks and the like) that follow it.
+
+// Render column just past a tab that starts at col.
+static int tab_end(int col) {
+    return col + TVIM_TAB_STOP - (col % TVIM_TAB_STOP);
+}
+
+// Code points that take no column, sorted. Both tables follow the
+// widths glibc's wcwidth() gives for Unicode 15, which is what terminals
+// lay text out by.
+static const unsigned utf8_zero[][2] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489},   {0x0591, 0x05BD},
+    {0x05BF, 0x05BF},   {0x05C1, 0x05C2},   {0x05C4, 0x05C5},
+    {0x05C7, 0x05C7},   {0x0610, 0x061A},   {0x061C, 0x061C},
+    {0x064B, 0x065F},   {0x0670, 0x0670},   {0x06D6, 0x06DC},
+    {0x06DF, 0x06E4},   {0x06E7, 0x06E8},   {0x06EA, 0x06ED},
+    {0x0711, 0x0711},   {0x0730, 0x074A},   {0x07A6, 0x07B0},
+    {0x07EB, 0x07F3},   {0x07FD, 0x07FD},   {0x0816, 0x0819},
+    {0x081B, 0x0823},   {0x0825, 0x0827},   {0x0829, 0x082D},
+    {0x0859, 0x085B},   {0x0898, 0x089F},   {0x08CA, 0x08E1},
+    {0x08E3, 0x0902},   {0x093A, 0x093A},   {0x093C, 0x093C},
+    {0x0941, 0x0948},   {0x094D, 0x094D},   {0x0951, 0x0957},
+    {0x0962, 0x0963},   {0x0981, 0x0981},   {0x09BC, 0x09BC},
+    {0x09C1, 0x09C4},   {0x09CD, 0x09CD},   {0x09E2, 0x09E3},
+    {0x09FE, 0x0A02},   {0x0A3C, 0x0A3C},   {0x0A41, 0x0A51},
+    {0x0A70, 0x0A71},   {0x0A75, 0x0A75},   {0x0A81, 0x0A82},
+    {0x0ABC, 0x0ABC},   {0x0AC1, 0x0AC8},   {0x0ACD, 0x0ACD},
+    {0x0AE2, 0x0AE3},   {0x0AFA, 0x0B01},   {0x0B3C, 0x0B3C},
+    {0x0B3F, 0x0B3F},   {0x0B41, 0x0B44},   {0x0B4D, 0x0B56},
+    {0x0B62, 0x0B63},   {0x0B82, 0x0B82},   {0x0BC0, 0x0BC0},
+    {0x0BCD, 0x0BCD},   {0x0C00, 0x0C00},   {0x0C04, 0x0C04},
+    {0x0C3C, 0x0C3C},   {0x0C3E, 0x0C40},   {0x0C46, 0x0C56},
+    {0x0C62, 0x0C63},   {0x0C81, 0x0C81},   {0x0CBC, 0x0CBC},
+    {0x0CBF, 0x0CBF},   {0x0CC6, 0x0CC6},   {0x0CCC, 0x0CCD},
+    {0x0CE2, 0x0CE3},   {0x0D00, 0x0D01},   {0x0D3B, 0x0D3C},
+    {0x0D41, 0x0D44},   {0x0D4D, 0x0D4D},   {0x0D62, 0x0D63},
+    {0x0D81, 0x0D81},   {0x0DCA, 0x0DCA},   {0x0DD2, 0x0DD6},
+    {0x0E31, 0x0E31},   {0x0E34, 0x0E3A},   {0x0E47, 0x0E4E},
+    {0x0EB1, 0x0EB1},   {0x0EB4, 0x0EBC},   {0x0EC8, 0x0ECD},
+    {0x0F18, 0x0F19},   {0x0F35, 0x0F35},   {0x0F37, 0x0F37},
+    {0x0F39, 0x0F39},   {0x0F71, 0x0F7E},   {0x0F80, 0x0F84},
+    {0x0F86, 0x0F87},   {0x0F8D, 0x0FBC},   {0x0FC6, 0x0FC6},
+    {0x102D, 0x1030},   {0x1032, 0x1037},   {0x1039, 0x103A},
+    {0x103D, 0x103E},   {0x1058, 0x1059},   {0x105E, 0x1060},
+    {0x1071, 0x1074},   {0x1082, 0x1082},   {0x1085, 0x1086},
+    {0x108D, 0x108D},   {0x109D, 0x109D},   {0x1160, 0x11FF},
+    {0x135D, 0x135F},   {0x1712, 0x1714},   {0x1732, 0x1733},
+    {0x1752, 0x1753},   {0x1772, 0x1773},   {0x17B4, 0x17B5},
+    {0x17B7, 0x17BD},   {0x17C6, 0x17C6},   {0x17C9, 0x17D3},
+    {0x17DD, 0x17DD},   {0x180B, 0x180F},   {0x1885, 0x1886},
+    {0x18A9, 0x18A9},   {0x1920, 0x1922},   {0x1927, 0x1928},
+    {0x1932, 0x1932},   {0x1939, 0x193B},   {0x1A17, 0x1A18},
+    {0x1A1B, 0x1A1B},   {0x1A56, 0x1A56},   {0x1A58, 0x1A60},
+    {0x1A62, 0x1A62},   {0x1A65, 0x1A6C},   {0x1A73, 0x1A7F},
+    {0x1AB0, 0x1B03},   {0x1B34, 0x1B34},   {0x1B36, 0x1B3A},
+    {0x1B3C, 0x1B3C},   {0x1B42, 0x1B42},   {0x1B6B, 0x1B73},
+    {0x1B80, 0x1B81},   {0x1BA2, 0x1BA5},   {0x1BA8, 0x1BA9},
+    {0x1BAB, 0x1BAD},   {0x1BE6, 0x1BE6},   {0x1BE8, 0x1BE9},
+    {0x1BED, 0x1BED},   {0x1BEF, 0x1BF1},   {0x1C2C, 0x1C33},
+    {0x1C36, 0x1C37},   {0x1CD0, 0x1CD2},   {0x1CD4, 0x1CE0},
+    {0x1CE2, 0x1CE8},   {0x1CED, 0x1CED},   {0x1CF4, 0x1CF4},
+    {0x1CF8, 0x1CF9},   {0x1DC0, 0x1DFF},   {0x200B, 0x200F},
+    {0x202A, 0x202E},   {0x2060, 0x206F},   {0x20D0, 0x20F0},
+    {0x2CEF, 0x2CF1},   {0x2D7F, 0x2D7F},   {0x2DE0, 0x2DFF},
+    {0x302A, 0x302D},   {0x3099, 0x309A},   {0xA66F, 0xA672},
+    {0xA674, 0xA67D},   {0xA69E, 0xA69F},   {0xA6F0, 0xA6F1},
+    {0xA802, 0xA802},   {0xA806, 0xA806},   {0xA80B, 0xA80B},
+    {0xA825, 0xA826},   {0xA82C, 0xA82C},   {0xA8C4, 0xA8C5},
+    {0xA8E0, 0xA8F1},   {0xA8FF, 0xA8FF},   {0xA926, 0xA92D},
+    {0xA947, 0xA951},   {0xA980, 0xA982},   {0xA9B3, 0xA9B3},
+    {0xA9B6, 0xA9B9},   {0xA9BC, 0xA9BD},   {0xA9E5, 0xA9E5},
+    {0xAA29, 0xAA2E},   {0xAA31, 0xAA32},   {0xAA35, 0xAA36},
+    {0xAA43, 0xAA43},   {0xAA4C, 0xAA4C},   {0xAA7C, 0xAA7C},
+    {0xAAB0, 0xAAB0},   {0xAAB2, 0xAAB4},   {0xAAB7, 0xAAB8},
+    {0xAABE, 0xAABF},   {0xAAC1, 0xAAC1},   {0xAAEC, 0xAAED},
+    {0xAAF6, 0xAAF6},   {0xABE5, 0xABE5},   {0xABE8, 0xABE8},
+    {0xABED, 0xABED},   {0xD7B0, 0xD7FB},   {0xFB1E, 0xFB1E},
+    {0xFE00, 0xFE0F},   {0xFE20, 0xFE2F},   {0xFEFF, 0xFEFF},
+    {0xFFF9, 0xFFFB},   {0x101FD, 0x101FD}, {0x102E0, 0x102E0},
+    {0x10376, 0x1037A}, {0x10A01, 0x10A0F}, {0x10A38, 0x10A3F},
+    {0x10AE5, 0x10AE6}, {0x10D24, 0x10D27}, {0x10EAB, 0x10EAC},
+    {0x10F46, 0x10F50}, {0x10F82, 0x10F85}, {0x11001, 0x11001},
+    {0x11038, 0x11046}, {0x11070, 0x11070}, {0x11073, 0x11074},
+    {0x1107F, 0x11081}, {0x110B3, 0x110B6}, {0x110B9, 0x110BA},
+    {0x110C2, 0x110C2}, {0x11100, 0x11102}, {0x11127, 0x1112B},
+    {0x1112D, 0x11134}, {0x11173, 0x11173}, {0x11180, 0x11181},
+    {0x111B6, 0x111BE}, {0x111C9, 0x111CC}, {0x111CF, 0x111CF},
+    {0x1122F, 0x11231}, {0x11234, 0x11234}, {0x11236, 0x11237},
+    {0x1123E, 0x1123E}, {0x112DF, 0x112DF}, {0x112E3, 0x112EA},
+    {0x11300, 0x11301}, {0x1133B, 0x1133C}, {0x11340, 0x11340},
+    {0x11366, 0x11374}, {0x11438, 0x1143F}, {0x11442, 0x11444},
+    {0x11446, 0x11446}, {0x1145E, 0x1145E}, {0x114B3, 0x114B8},
+    {0x114BA, 0x114BA}, {0x114BF, 0x114C0}, {0x114C2, 0x114C3},
+    {0x115B2, 0x115B5}, {0x115BC, 0x115BD}, {0x115BF, 0x115C0},
+    {0x115DC, 0x115DD}, {0x11633, 0x1163A}, {0x1163D, 0x1163D},
+    {0x1163F, 0x11640}, {0x116AB, 0x116AB}, {0x116AD, 0x116AD},
+    {0x116B0, 0x116B5}, {0x116B7, 0x116B7}, {0x1171D, 0x1171F},
+    {0x11722, 0x11725}, {0x11727, 0x1172B}, {0x1182F, 0x11837},
+    {0x11839, 0x1183A}, {0x1193B, 0x1193C}, {0x1193E, 0x1193E},
+    {0x11943, 0x11943}, {0x119D4, 0x119DB}, {0x119E0, 0x119E0},
+    {0x11A01, 0x11A0A}, {0x11A33, 0x11A38}, {0x11A3B, 0x11A3E},
+    {0x11A47, 0x11A47}, {0x11A51, 0x11A56}, {0x11A59, 0x11A5B},
+    {0x11A8A, 0x11A96}, {0x11A98, 0x11A99}, {0x11C30, 0x11C3D},
+    {0x11C3F, 0x11C3F}, {0x11C92, 0x11CA7}, {0x11CAA, 0x11CB0},
+    {0x11CB2, 0x11CB3}, {0x11CB5, 0x11CB6}, {0x11D31, 0x11D45},
+    {0x11D47, 0x11D47}, {0x11D90, 0x11D91}, {0x11D95, 0x11D95},
+    {0x11D97, 0x11D97}, {0x11EF3, 0x11EF4}, {0x13430, 0x13438},
+    {0x16AF0, 0x16AF4}, {0x16B30, 0x16B36}, {0x16F4F, 0x16F4F},
+    {0x16F8F, 0x16F92}, {0x16FE4, 0x16FE4}, {0x1BC9D, 0x1BC9E},
+    {0x1BCA0, 0x1CF46}, {0x1D167, 0x1D169}, {0x1D173, 0x1D182},
+    {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD}, {0x1D242, 0x1D244},
+    {0x1DA00, 0x1DA36}, {0x1DA3B, 0x1DA6C}, {0x1DA75, 0x1DA75},
+    {0x1DA84, 0x1DA84}, {0x1DA9B, 0x1DAAF}, {0x1E000, 0x1E02A},
+    {0x1E130, 0x1E136}, {0x1E2AE, 0x1E2AE}, {0x1E2EC, 0x1E2EF},
+    {0x1E8D0, 0x1E8D6}, {0x1E944, 0x1E94A}, {0xE0001, 0xE01EF},
+};
+
+// Code points that take two columns (East Asian wide and emoji), sorted.
+static const unsigned utf8_wide[][2] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x3029},
+    {0x302E, 0x303E},   {0x3041, 0x3096},   {0x309B, 0xA4C6},
+    {0xA960, 0xA97C},   {0xAC00, 0xD7A3},   {0xF900, 0xFAD9},
+    {0xFE10, 0xFE19},   {0xFE30, 0xFE6B},   {0xFF01, 0xFF60},
+    {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE3}, {0x16FF0, 0x1B2FB},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E},
+    {0x1F191, 0x1F19A}, {0x1F200, 0x1F320}, {0x1F32D, 0x1F335},
+    {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+    {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4},
+    {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC},
+    {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567},
+    {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4},
+    {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC},
+    {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6DF}, {0x1F6EB, 0x1F6EC},
+    {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7F0}, {0x1F90C, 0x1F93A},
+    {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAF6},
+    {0x20000, 0x3134A},
+};
+
+static bool utf8_in(const unsigned (*r)[2], int n, unsigned cp) {
+    if (cp < r[0][0] || cp > r[n - 1][1]) {
+        return false;
+    }
+    int lo = 0;
+    int hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp > r[mid][1]) {
+            lo = mid + 1;
+        } else if (cp < r[mid][0]) {
+            hi = mid - 1;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int utf8_lookup(unsigned cp) {
+    if (utf8_in(utf8_zero, sizeof(utf8_zero) / sizeof(utf8_zero[0]), cp)) {
+        return 0;
+    }
+    if (utf8_in(utf8_wide, sizeof(utf8_wide) / sizeof(utf8_wide[0]), cp)) {
+        return 2;
+    }
+    return 1;
+}
+
+// Widths of the BMP, two bits a code point, spread out of the range tables
+// once so a char of a line costs a load rather than two binary searches.
+static unsigned char utf8_bmp[0x10000 / 4];
+static pthread_once_t utf8_bmpOnce = PTHREAD_ONCE_INIT;
+
+static void utf8_bmp_init() {
+    for (unsigned cp = 0; cp < 0x10000; cp++) {
+        utf8_bmp[cp / 4] |= utf8_lookup(cp) << (cp % 4 * 2);
+    }
+}
+
+// Columns code point cp takes on screen.
+int utf8_width(unsigned cp) {
+    if (cp < 0x300) {
+        return 1;
+    }
+    if (cp >= 0x10000) {
+        return utf8_lookup(cp);
+    }
+    pthread_once(&utf8_bmpOnce, utf8_bmp_init);
+    return (utf8_bmp[cp / 4] >> (cp % 4 * 2)) & 3;
+}
+
+static bool utf8_cont(char c) {
+    return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+// Length of the valid UTF-8 sequence s starts with, its code point in *cp,
+// or 0 when s does not start with one. Overlong forms, surrogates and code
+// points past U+10FFFF are not valid.
+int utf8_decode(const char* s, int len, unsigned* cp) {
+    unsigned char c = s[0];
+    int n;
+    unsigned min;
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+        min = 0x80;
+        *cp = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        min = 0x800;
+        *cp = c & 0x0F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        min = 0x10000;
+        *cp = c & 0x07;
+    } else {
+        return 0;
+    }
+    if (len < n) {
+        return 0;
+    }
+    for (int i = 1; i < n; i++) {
+        if (!utf8_cont(s[i])) {
+            return 0;
+        }
+        *cp = (*cp << 6) | (s[i] & 0x3F);
+    }
+    if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)) {
+        return 0;
+    }
+    return n;
+}
+
+// Byte j of s[0..len) is inside a valid sequence that starts before it.
+static bool utf8_inside(const char* s, int len, int j) {
+    if (!utf8_cont(s[j])) {
+        return false;
+    }
+    for (int b = j - 1; b >= 0 && b >= j - 3; b--) {
+        if (!utf8_cont(s[b])) {
+            unsigned cp;
+            return utf8_decode(&s[b], len - b, &cp) > j - b;
+        }
+    }
+    return false;
+}
+
+// Bytes of the char at s[j] and, in *width, the columns it takes when it
+// starts at column col.
+static int utf8_char(const char* s, int len, int j, int col, int* width) {
+    unsigned char c = s[j];
+    if (c == '\t') {
+        *width = tab_end(col) - col;
+        return 1;
+    }
+    if (c < 0x80) {
+        *width = 1;
+        return 1;
+    }
+    unsigned cp;
+    int n = utf8_decode(&s[j], len - j, &cp);
+    if (n == 0) {
+        *width = 1;
+        return 1;
+    }
+    *width = utf8_width(cp);
+    return n;
+}
+
+// Render columns s[0..len) takes from column 0.
+int utf8_cols(const char* s, int len) {
+    int col = 0;
+    int j = 0;
+    while (j < len) {
+        int w;
+        j += utf8_char(s, len, j, col, &w);
+        col += w;
+    }
+    return col;
+}
+
+// Bytes of the first char of s[0..len) and the zero-width chars after it.
+int utf8_next(const char* s, int len) {
+    if (len == 0) {
+        return 0;
+    }
+    int w;
+    int j = utf8_char(s, len, 0, 0, &w);
+    while (j < len && (unsigned char)s[j] >= 0x80) {
+        int n = utf8_char(s, len, j, 0, &w);
+        if (w != 0) {
+            break;
+        }
+        j += n;
+    }
+    return j;
+}
+
+// Where the last char of s[0..len) starts, zero-width chars going with
+// the char before them.
+int utf8_prev(const char* s, int len) {
+    int j = len;
+    while (j > 0) {
+        j--;
+        while (j > 0 && utf8_inside(s, len, j)) {
+            j--;
+        }
+        int w;
+        utf8_char(s, len, j, 0, &w);
+        if (w != 0) {
+            break;
+        }
+    }
+    return j;
+}
+
+#if defined(__x86_64__)
+// Any byte of s[0..len) with its top bit set, 64 bytes per round.
+static bool utf8_ascii_sse2(const char* s, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)&s[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&s[i + 16]);
+        __m128i c = _mm_loadu_si128((const __m128i*)&s[i + 32]);
+        __m128i d = _mm_loadu_si128((const __m128i*)&s[i + 48]);
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(any) != 0) {
+            return false;
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)&s[i]);
+        if (_mm_movemask_epi8(a) != 0) {
+            return false;
+        }
+    }
+    for (; i < len; i++) {
+        if ((unsigned char)s[i] >= 0x80) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// s[0..len) is plain ASCII, every byte a char of its own.
+bool utf8_ascii(const char* s, size_t len) {
+#if defined(__x86_64__)
+    return utf8_ascii_sse2(s, len);
+#else
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long w;
+        memcpy(&w, &s[i], 8);
+        if (w & 0x8080808080808080ULL) {
+            return false;
+        }
+    }
+    for (; i < len; i++) {
+        if ((unsigned char)s[i] >= 0x80) {
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+/*** row operations ***/
+
+// Render column char cX starts at. Only the chars since the checkpoint
+// before cX are walked.
+int row_cX_to_rX(struct editor* ed, row_t* row, int cX) {
+    int* cols = row_render(ed, row);
+    if (cols == NULL) {
+        return cX;
+    }
+    int past = MAX(cX - row->len, 0);
+    cX -= past;
+    // a byte inside a char is at the column the char starts at.
+    while (cX < row->len && utf8_inside(row->chars, row->len, cX)) {
+        cX--;
+    }
+    int j = cX - cX % TVIM_WIDTH_STEP;
+    int rX = cols[j / TVIM_WIDTH_STEP];
+    while (j < cX && utf8_inside(row->chars, row->len, j)) {
+        j++;
+    }
+    while (j < cX) {
+        int w;
+        int n = utf8_char(row->chars, row->len, j, rX, &w);
+        if (j + n > cX) {
+            break;
+        }
+        rX += w;
+        j += n;
+    }
+    return rX + past;
+}
+
+// Char shown at render column rX, or row->len past the end of the row. A
+// char is shown at every column it spans, zero-width chars at none.
+int row_rX_to_cX(struct editor* ed, row_t* row, int rX) {
+    int* cols = row_render(ed, row);
+    if (cols == NULL) {
+        return MIN(rX, row->len);
+    }
+    int lo = 0;
+    int hi = row->len / TVIM_WIDTH_STEP;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (cols[mid] <= rX) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    int col = cols[lo];
+    int j = lo * TVIM_WIDTH_STEP;
+    while (j < row->len && utf8_inside(row->chars, row->len, j)) {
+        j++;
+    }
+    while (j < row->len) {
+        int w;
+        int n = utf8_char(row->chars, row->len, j, col, &w);
+        if (col + w > rX) {
+            return j;
+        }
+        col += w;
+        j += n;
+    }
+    return row->len;
+}
+
+// The row changed: forget its render, row_render() rebuilds it the next
+// time the row is on screen.
+void row_update(struct editor* ed, row_t* row) {
+    if (rcache_valid(ed, row)) {
+        rcache_drop(ed, row->rslot);
+    }
+    row->rstate = RENDER_STALE;
+    ed->version++;
+}
+
+// Column index of the row: the render column of every TVIM_WIDTH_STEP-th
+// byte, where a char's columns count from its first byte. NULL for a row
+// of plain ASCII without tabs, whose bytes are its columns. Only valid
+// until the next row_render() call.
+int* row_render(struct editor* ed, row_t* row) {
+    if (row->rstate == RENDER_SHARED) {
+        return NULL;
+    }
+    if (rcache_valid(ed, row)) {
+        rcache_unlink(ed, row->rslot);
+        rcache_push(ed, row->rslot);
+        return ed->render.slots[row->rslot].cols;
+    }
+
+    if (utf8_ascii(row->chars, row->len) &&
+        memchr(row->chars, '\t', row->len) == NULL) {
+        row->rstate = RENDER_SHARED;
+        row->rlen = row->len;
+        return NULL;
+    }
+
+    int nCols = row->len / TVIM_WIDTH_STEP + 1;
+    int slot = rcache_take(ed, nCols * sizeof(int));
+    int* cols = ed->render.slots[slot].cols;
+
+    int col = 0;
+    int j = 0;
+    while (j < row->len) {
+        int w;
+        int n = utf8_char(row->chars, row->len, j, col, &w);
+        for (int b = j; b < j + n; b++) {
+            if (b % TVIM_WIDTH_STEP == 0) {
+                cols[b / TVIM_WIDTH_STEP] = b == j ? col : col + w;
+            }
+        }
+        col += w;
+        j += n;
+    }
+    if (row->len % TVIM_WIDTH_STEP == 0) {
+        cols[row->len / TVIM_WIDTH_STEP] = col;
+    }
+
+    row->rlen = col;
+    row->rslot = slot;
+    row->rgen = ed->render.slots[slot].gen;
+    row->rstate = RENDER_CACHED;
+    return cols;
+}
+
+// Append the chars of s[j..len), which start at render column col, as far
+// as they fall in columns [colOff, end). Tabs become spaces, bytes that are
+// not valid UTF-8 U+FFFD and wide chars cut by an edge spaces. With hl, the
+// classes of s, each char goes out in its class's colour and *cur follows
+// the one in effect; blanks take whatever is. Returns the column the walk
+// stopped at.
+static int draw_text(struct abuf* ab, const char* s, int len, int j, int col,
+                     int colOff, int end, const unsigned char* hl, int* cur) {
+    bool shown = false; // the last char went out as itself
+    while (j < len) {
+        int w;
+        int n = utf8_char(s, len, j, col, &w);
+        if (w == 0) {
+            // a zero-width char goes with the char it follows.
+            if (shown) {
+                ab_append(ab, &s[j], n);
+            }
+            j += n;
+            continue;
+        }
+        if (col >= end) {
+            break;
+        }
+        shown = false;
+        if (s[j] == '\t' || col < colOff || col + w > end) {
+            for (int c = MAX(col, colOff); c < MIN(col + w, end); c++) {
+                ab_append(ab, " ", 1);
+            }
+        } else if (n == 1 && (unsigned char)s[j] >= 0x80) {
+            if (hl != NULL) {
+                syntax_put(ab, cur, hl[j]);
+            }
+            ab_append(ab, "\xEF\xBF\xBD", 3);
+            shown = true;
+        } else {
+            if (hl != NULL && s[j] != ' ') {
+                syntax_put(ab, cur, hl[j]);
+            }
+            ab_append(ab, &s[j], n);
+            shown = true;
+        }
+        col += w;
+        j += n;
+    }
+    return col;
+}
+
+// Append render columns [colOff, colOff + width) of the row, coloured by
+// the classes in hl if there are any.
+void row_draw(struct editor* ed, struct abuf* ab, row_t* row, int colOff,
+              int width, const unsigned char* hl) {
+    int cur = HL_NORMAL;
+    if (row_render(ed, row) == NULL) {
+        int len = MIN(row->len - colOff, width);
+        const char* s = &row->chars[colOff];
+        // a byte is a column, so only the colour changes split the copy.
+        int from = 0;
+        for (int i = 0; hl != NULL && i < len; i++) {
+            if (s[i] != ' ' && hl[colOff + i] != cur) {
+                ab_append(ab, &s[from], i - from);
+                syntax_put(ab, &cur, hl[colOff + i]);
+                from = i;
+            }
+        }
+        if (len > from) {
+            ab_append(ab, &s[from], len - from);
+        }
+    } else {
+        int j = row_rX_to_cX(ed, row, colOff);
+        int col = row_cX_to_rX(ed, row, j);
+        draw_text(ab, row->chars, row->len, j, col, colOff, colOff + width, hl,
+                  &cur);
+    }
+    syntax_put(ab, &cur, HL_NORMAL);
+}
+
+// Point row->chars at a copy of s, inline when it is short enough and
+// otherwise in the arena (bulk) or on the heap.
+static void row_place(struct editor* ed, row_t* row, char* s, size_t len,
+                      bool bulk) {
+    char* chars;
+    if (len < TVIM_ROW_INLINE) {
+        chars = row->inl;
+        row->store = ROW_INLINE;
+    } else if (bulk) {
+        chars = (char*)arena_alloc(&ed->arena, len + 1);
+        row->store = ROW_ARENA;
+    } else {
+        chars = (char*)malloc(len + 1);
+        row->store = ROW_HEAP;
+        if (chars == NULL) {
+            crash("malloc");
+        }
+    }
+    memmove(chars, s, len);
+    chars[len] = '\0';
+    row->chars = chars;
+    row->len = len;
+}
+
+static void row_init(struct editor* ed, row_t* row, char* s, size_t len,
+                     bool bulk) {
+    row->rlen = 0;
+    row->rstate = RENDER_STALE;
+    row->cr = ed->crlf;
+    row_place(ed, row, s, len, bulk);
+}
+
+row_t* row_append(struct editor* ed, char* s, size_t len) {
+    if (s == NULL) {
+        return NULL;
+    }
+
+    row_t* row = rows_insert(ed, ed->nRows);
+    row_init(ed, row, s, len, true);
+    return row;
+}
+
+// Same as row_append but the row borrows s instead of copying it. s must
+// live in ed->map and is not '\0' terminated.
+row_t* row_append_mapped(struct editor* ed, char* s, size_t len) {
+    row_t* row = rows_insert(ed, ed->nRows);
+    row->len = len;
+    row->chars = s;
+    row->store = ROW_MAPPED;
+    row->rlen = 0;
+    row->rstate = RENDER_STALE;
+    row->cr = ed->crlf;
+    return row;
+}
+
+// Make row->chars writable in place. Anything that writes to row->chars
+// without growing it must call this first. Arena chars are never written
+// after row_place, so a save in flight can keep borrowing them.
+void row_own(struct editor* ed, row_t* row) {
+    if (row->store != ROW_MAPPED && row->store != ROW_ARENA) {
+        return;
+    }
+    row_place(ed, row, row->chars, row->len, false);
+}
+
+// Make room for size bytes ('\0' included) in row->chars. Rows that cannot
+// grow where they are move to the heap.
+void row_reserve(row_t* row, size_t size) {
+    if (row->store == ROW_HEAP) {
+        row->chars = (char*)realloc(row->chars, size);
+        if (row->chars == NULL) {
+            crash("realloc");
+        }
+        return;
+    }
+    if (row->store == ROW_INLINE && size <= TVIM_ROW_INLINE) {
+        return;
+    }
+
+    char* chars = (char*)malloc(size);
+    if (chars == NULL) {
+        crash("malloc");
+    }
+    memcpy(chars, row->chars, row->len);
+    chars[row->len] = '\0';
+    row->chars = chars;
+    row->store = ROW_HEAP;
+}
+
+void row_insert(struct editor* ed, int at, char* s, size_t len) {
+    if (at < 0 || at > ed->nRows)
+        return;
+    gap_flush(ed);
+
+    // s may live in an inline row that rows_insert is about to move.
+    char tmp[TVIM_ROW_INLINE];
+    if (len < TVIM_ROW_INLINE) {
+        memcpy(tmp, s, len);
+        s = tmp;
+    }
+
+    row_t* row = rows_insert(ed, at);
+    row_init(ed, row, s, len, false);
+
+    ed->unsaved++;
+}
+
+void row_free(struct editor* ed, row_t* row) {
+    // arena, inline and mapped storage goes away in bulk on exit.
+    if (row->chars != NULL && row->store == ROW_HEAP) {
+        free(row->chars);
+    }
+    row->chars = NULL;
+
+    row_update(ed, row);
+
+    // cannot free row since it is part of an array. Duh (I think)
+    /*if (row != NULL) {*/
+    /*    free(row);*/
+    /*    row = NULL;*/
+    /*}*/
+
+    return;
+}
+
+void row_delete(struct editor* ed, int at) {
+    if (at < 0 || at >= ed->nRows) {
+        return;
+    }
+    gap_flush(ed);
+
+    row_free(ed, row_at(ed, at));
+    rows_delete(ed, at);
+    ed->unsaved++;
+
+    return;
+}
+
+void row_join(struct editor* ed, row_t* row, char* s, int len) {
+    gap_flush(ed);
+    row_reserve(row, row->len + len + 1);
+    memcpy(&row->chars[row->len], s, len);
+    row->len += len;
+    row->chars[row->len] = '\0';
+    row_update(ed, row);
+    ed->unsaved++;
+
+    return;
+}
+
+/*** gap buffer ***/
+
+static void gap_push_mark(struct editor* ed, int idx, int endCol) {
+    struct gapline* g = &ed->gap;
+    if (g->nMarks == g->markCap) {
+        g->markCap = g->markCap ? g->markCap * 2 : 16;
+        g->marks = (struct gapmark*)realloc(
+            g->marks, sizeof(struct gapmark) * g->markCap);
+        if (g->marks == NULL) {
+            crash("realloc");
+        }
+    }
+    g->marks[g->nMarks].idx = idx;
+    g->marks[g->nMarks].endCol = endCol;
+    g->nMarks++;
+}
+
+// Render column the byte of the k-th mark before the gap starts at.
+static int gap_mark_start(struct editor* ed, int k) {
+    struct gapline* g = &ed->gap;
+    if (k == 0) {
+        return g->marks[0].idx;
+    }
+    return g->marks[k - 1].endCol +
+           (g->marks[k].idx - g->marks[k - 1].idx - 1);
+}
+
+// Count the chars in buf[from..gapStart) into rX, marking the bytes of
+// every char that is not one byte and one column.
+static void gap_advance(struct editor* ed, int from) {
+    struct gapline* g = &ed->gap;
+    int j = from;
+    while (j < g->gapStart) {
+        int w;
+        int n = utf8_char(g->buf, g->gapStart, j, g->rX, &w);
+        if (n > 1 || w != 1) {
+            for (int b = j; b < j + n; b++) {
+                gap_push_mark(ed, b, g->rX + w);
+            }
+        }
+        g->rX += w;
+        j += n;
+    }
+}
+
+// Take buf[to..gapStart) back out of rX and the marks.
+static void gap_rewind(struct editor* ed, int to) {
+    struct gapline* g = &ed->gap;
+    for (int i = g->gapStart - 1; i >= to; i--) {
+        if (g->nMarks > 0 && g->marks[g->nMarks - 1].idx == i) {
+            g->rX = gap_mark_start(ed, g->nMarks - 1);
+            g->nMarks--;
+        } else {
+            g->rX--;
+        }
+    }
+}
+
+// A byte that continues a UTF-8 sequence came or went at the gap, which
+// can change how the bytes just before it read. Count the last three
+// again, from the start of the char they begin in.
+static void gap_recount(struct editor* ed) {
+    struct gapline* g = &ed->gap;
+    int b = MAX(g->gapStart - 3, 0);
+    while (b > 0 && utf8_inside(g->buf, g->gapStart, b)) {
+        b--;
+    }
+    gap_rewind(ed, b);
+    gap_advance(ed, b);
+}
+
+// Start editing row y in the gap buffer, flushing whichever row was being
+// edited before.
+void gap_begin(struct editor* ed, int y) {
+    struct gapline* g = &ed->gap;
+    if (g->active && g->y == y) {
+        return;
+    }
+    gap_flush(ed);
+
+    // at least 64 bytes of gap, so the buffer is never an inline row.
+    row_t* row = row_at(ed, y);
+    int gap = MAX(64, row->len / 16);
+    row_reserve(row, row->len + gap);
+    row_update(ed, row);
+
+    g->buf = row->chars;
+    g->cap = row->len + gap;
+    g->gapStart = row->len;
+    g->gapEnd = g->cap;
+    g->y = y;
+    g->active = true;
+
+    g->nMarks = 0;
+    g->rX = 0;
+    gap_advance(ed, 0);
+}
+
+// Put the gap at index at of the row, costing the distance it moves.
+void gap_move(struct editor* ed, int at) {
+    struct gapline* g = &ed->gap;
+    if (at < g->gapStart) {
+        gap_rewind(ed, at);
+        int n = g->gapStart - at;
+        memmove(&g->buf[g->gapEnd - n], &g->buf[at], n);
+        g->gapStart = at;
+        g->gapEnd -= n;
+    } else if (at > g->gapStart) {
+        int from = g->gapStart;
+        int n = at - g->gapStart;
+        memmove(&g->buf[g->gapStart], &g->buf[g->gapEnd], n);
+        // the bytes coming over can finish a char left open before the gap.
+        while (from > 0 && utf8_inside(g->buf, at, from)) {
+            from--;
+        }
+        gap_rewind(ed, from);
+        g->gapStart += n;
+        g->gapEnd += n;
+        gap_advance(ed, from);
+    }
+}
+
+static void gap_insert(struct editor* ed, char c) {
+    struct gapline* g = &ed->gap;
+    row_t* row = row_at(ed, g->y);
+
+    // keep a byte spare so gap_flush has room for the '\0'.
+    if (g->gapEnd - g->gapStart <= 1) {
+        int after = g->cap - g->gapEnd;
+        int cap = g->cap + MAX(64, g->cap / 2);
+        g->buf = (char*)realloc(g->buf, cap);
+        if (g->buf == NULL) {
+            crash("realloc");
+        }
+        memmove(&g->buf[cap - after], &g->buf[g->gapEnd], after);
+        g->gapEnd = cap - after;
+        g->cap = cap;
+        row->chars = g->buf;
+    }
+
+    g->buf[g->gapStart++] = c;
+    gap_advance(ed, g->gapStart - 1);
+    if (utf8_cont(c)) {
+        gap_recount(ed);
+    }
+    row->len++;
+    ed->version++;
+    syntax_edit(ed, g->y);
+}
+
+// Delete the byte just before the gap.
+static void gap_delete(struct editor* ed) {
+    struct gapline* g = &ed->gap;
+    gap_rewind(ed, g->gapStart - 1);
+    if (utf8_cont(g->buf[--g->gapStart])) {
+        gap_recount(ed);
+    }
+    row_at(ed, g->y)->len--;
+    ed->version++;
+    syntax_edit(ed, g->y);
+}
+
+// Close the gap and hand the text back to the row as plain chars.
+void gap_flush(struct editor* ed) {
+    struct gapline* g = &ed->gap;
+    if (!g->active) {
+        return;
+    }
+
+    row_t* row = row_at(ed, g->y);
+    int after = g->cap - g->gapEnd;
+    memmove(&g->buf[g->gapStart], &g->buf[g->gapEnd], after);
+    row->chars = g->buf;
+    row->len = g->gapStart + after;
+    row->chars[row->len] = '\0';
+    row_update(ed, row);
+    g->active = false;
+}
+
+// Append columns [colOff, colOff + width) of the row being edited, hl
+// being the classes of the whole line if it is highlighted. Only the part
+// of the line between the gap and the screen edges is looked at.
+void gap_draw(struct editor* ed, struct abuf* ab, int colOff, int width,
+              const unsigned char* hl) {
+    struct gapline* g = &ed->gap;
+
+    // walk back from the gap to the char that covers colOff.
+    int i = g->gapStart;
+    int col = g->rX;
+    int k = g->nMarks;
+    while (i > 0 && col > colOff) {
+        i--;
+        if (k > 0 && g->marks[k - 1].idx == i) {
+            col = gap_mark_start(ed, --k);
+        } else {
+            col--;
+        }
+    }
+
+    // the text either side of the gap is contiguous, draw one then the
+    // other. A char is never read across the gap, as with rX, so stray
+    // bytes that only join up once it closes show as U+FFFD until then.
+    int end = colOff + width;
+    int cur = HL_NORMAL;
+    col = draw_text(ab, g->buf, g->gapStart, i, col, colOff, end, hl, &cur);
+    draw_text(ab, &g->buf[g->gapEnd], g->cap - g->gapEnd, 0, col, colOff, end,
+              hl != NULL ? &hl[g->gapStart] : NULL, &cur);
+    syntax_put(ab, &cur, HL_NORMAL);
+}
+
+/*** compression ***/
+
+static int file_writev(int fd, struct iovec* iov, int n);
+
+// The codec of a file starting with the bytes at magic.
+static enum codec codec_detect(const unsigned char* magic, size_t len) {
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return CODEC_GZIP;
+    }
+    if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+        magic[3] == 0xfd) {
+        return CODEC_ZSTD;
+    }
+    return CODEC_NONE;
+}
+
+// The codec a file saved as name gets, by its extension.
+static enum codec codec_for_name(const char* name) {
+    size_t len = strlen(name);
+    if (len > 3 && strcmp(&name[len - 3], ".gz") == 0) {
+        return CODEC_GZIP;
+    }
+#ifdef TVIM_ZSTD
+    if (len > 4 && strcmp(&name[len - 4], ".zst") == 0) {
+        return CODEC_ZSTD;
+    }
+#endif
+    return CODEC_NONE;
+}
+
+// Hand len bytes of decompressed text to the line parser. Fails once the
+// main loop has closed its end.
+static int unzip_put(struct unzipjob* u, char* s, size_t len) {
+    struct iovec iov = {s, len};
+    return len == 0 ? 0 : file_writev(u->out, &iov, 1);
+}
+
+// Every member of a gzip file, one after the other like gunzip does. What
+// follows the last member without a gzip header of its own, such as the
+// zero padding of archive tools, is left out as gunzip does.
+static const char* unzip_gzip(struct unzipjob* u, char* in, char* out) {
+    z_stream z;
+    gz_header head;
+    memset(&z, 0, sizeof(z));
+    memset(&head, 0, sizeof(head));
+    // 32 takes a gzip or zlib header.
+    if (inflateInit2(&z, 15 + 32) != Z_OK) {
+        return "inflateInit2 failed";
+    }
+    inflateGetHeader(&z, &head);
+    const char* result = NULL;
+    bool whole = false; // a member came out complete
+    int ret = Z_OK;
+    ssize_t n;
+    while ((n = read(u->src, in, TVIM_READ_CHUNK)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return_defer("read failed");
+        }
+        z.next_in = (Bytef*)in;
+        z.avail_in = n;
+        do {
+            if (ret == Z_STREAM_END) {
+                if (z.avail_in == 0) {
+                    break;
+                }
+                whole = true;
+                inflateReset(&z);
+                memset(&head, 0, sizeof(head));
+                inflateGetHeader(&z, &head);
+            }
+            z.next_out = (Bytef*)out;
+            z.avail_out = TVIM_READ_CHUNK;
+            ret = inflate(&z, Z_NO_FLUSH);
+            // what came out before any damage is good.
+            if (unzip_put(u, out, TVIM_READ_CHUNK - z.avail_out) == -1) {
+                return_defer(NULL);
+            }
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                if (whole && head.done != 1) {
+                    u->note = "trailing garbage ignored";
+                    return_defer(NULL);
+                }
+                return_defer("bad gzip data");
+            }
+        } while (z.avail_out == 0 || z.avail_in > 0);
+    }
+    if (ret != Z_STREAM_END) {
+        if (whole && head.done != 1) {
+            u->note = "trailing garbage ignored";
+        } else {
+            result = "gzip data cut short";
+        }
+    }
+
+defer:
+    inflateEnd(&z);
+    return result;
+}
+
+#ifdef TVIM_ZSTD
+// Every frame of a zstd file.
+static const char* unzip_zstd(struct unzipjob* u, char* in, char* out) {
+    ZSTD_DCtx* d = ZSTD_createDCtx();
+    if (d == NULL) {
+        return "ZSTD_createDCtx failed";
+    }
+    const char* result = NULL;
+    size_t ret = 0;
+    ssize_t n;
+    while ((n = read(u->src, in, TVIM_READ_CHUNK)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return_defer("read failed");
+        }
+        ZSTD_inBuffer ib = {in, n, 0};
+        ZSTD_outBuffer ob;
+        do {
+            ob = (ZSTD_outBuffer){out, TVIM_READ_CHUNK, 0};
+            ret = ZSTD_decompressStream(d, &ob, &ib);
+            if (ZSTD_isError(ret)) {
+                return_defer(ZSTD_getErrorName(ret));
+            }
+            if (unzip_put(u, out, ob.pos) == -1) {
+                return_defer(NULL);
+            }
+        } while (ib.pos < ib.size || ob.pos == ob.size);
+    }
+    // 0 is the end of a frame, anything else wants more of it.
+    if (ret != 0) {
+        result = "zstd data cut short";
+    }
+
+defer:
+    ZSTD_freeDCtx(d);
+    return result;
+}
+#endif
+
+static void* unzip_worker(void* arg) {
+    struct unzipjob* u = (struct unzipjob*)arg;
+    // a closed pipe is an EPIPE from write, not a signal for the process.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    char* in = (char*)malloc(TVIM_READ_CHUNK);
+    char* out = (char*)malloc(TVIM_READ_CHUNK);
+    if (in == NULL || out == NULL) {
+        u->err = "out of memory";
+#ifdef TVIM_ZSTD
+    } else if (u->codec == CODEC_ZSTD) {
+        u->err = unzip_zstd(u, in, out);
+#endif
+    } else {
+        u->err = unzip_gzip(u, in, out);
+    }
+    free(in);
+    free(out);
+    // end of the stream for stream_ready.
+    close(u->out);
+    return NULL;
+}
+
+// Decompress fd, which is in codec, into a pipe and stream the lines from
+// it. False when that cannot be started, fd is left as it was then.
+static bool unzip_start(struct editor* ed, int fd, enum codec codec) {
+    struct unzipjob* u = &ed->unzip;
+    int wake[2];
+    if (pipe2(wake, O_CLOEXEC) == -1) {
+        return false;
+    }
+    // fewer, bigger hand-overs. The default size does too if this fails.
+    fcntl(wake[1], F_SETPIPE_SZ, TVIM_UNZIP_PIPE);
+    u->codec = codec;
+    u->src = fd;
+    u->out = wake[1];
+    u->err = NULL;
+    u->note = NULL;
+    if (pthread_create(&u->thread, NULL, unzip_worker, u) != 0) {
+        close(wake[0]);
+        close(wake[1]);
+        return false;
+    }
+    u->running = true;
+    ed->codec = codec;
+    file_stream(ed, wake[0]);
+    return true;
+}
+
+// The stream is done with, join the thread and say if the file was bad.
+static void unzip_finish(struct editor* ed) {
+    struct unzipjob* u = &ed->unzip;
+    pthread_join(u->thread, NULL);
+    close(u->src);
+    u->running = false;
+    if (u->err != NULL) {
+        tvim_set_status(ed, "\"%s\": %s", ed->filename, u->err);
+    } else if (u->note != NULL) {
+        tvim_set_status(ed, "\"%s\": %s", ed->filename, u->note);
+    }
+}
+
+// Compresses what a save writes, on the save thread.
+struct zipper {
+    enum codec codec;
+    int fd;
+    z_stream z;
+#ifdef TVIM_ZSTD
+    ZSTD_CCtx* zs;
+#endif
+    char out[TVIM_READ_CHUNK];
+};
+
+static int zip_init(struct zipper* zp, enum codec codec, int fd) {
+    zp->codec = codec;
+    zp->fd = fd;
+#ifdef TVIM_ZSTD
+    if (codec == CODEC_ZSTD) {
+        zp->zs = ZSTD_createCCtx();
+        if (zp->zs == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ZSTD_CCtx_setParameter(zp->zs, ZSTD_c_compressionLevel,
+                               TVIM_ZSTD_LEVEL);
+        return 0;
+    }
+#endif
+    memset(&zp->z, 0, sizeof(zp->z));
+    // 16 writes a gzip header and trailer around the deflate data.
+    if (deflateInit2(&zp->z, TVIM_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+// Compress len bytes at s, or with end set the last of them, and write out
+// what comes of it.
+static int zip_write(struct zipper* zp, char* s, size_t len, bool end) {
+#ifdef TVIM_ZSTD
+    if (zp->codec == CODEC_ZSTD) {
+        ZSTD_inBuffer ib = {s, len, 0};
+        size_t left;
+        do {
+            ZSTD_outBuffer ob = {zp->out, sizeof(zp->out), 0};
+            left = ZSTD_compressStream2(zp->zs, &ob, &ib,
+                                        end ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(left)) {
+                errno = EIO;
+                return -1;
+            }
+            struct iovec iov = {zp->out, ob.pos};
+            if (ob.pos > 0 && file_writev(zp->fd, &iov, 1) == -1) {
+                return -1;
+            }
+        } while (ib.pos < ib.size || (end && left != 0));
+        return 0;
+    }
+#endif
+    zp->z.next_in = (Bytef*)s;
+    zp->z.avail_in = len;
+    int ret;
+    do {
+        zp->z.next_out = (Bytef*)zp->out;
+        zp->z.avail_out = sizeof(zp->out);
+        ret = deflate(&zp->z, end ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR) {
+            errno = EIO;
+            return -1;
+        }
+        struct iovec iov = {zp->out, sizeof(zp->out) - zp->z.avail_out};
+        if (iov.iov_len > 0 && file_writev(zp->fd, &iov, 1) == -1) {
+            return -1;
+        }
+    } while (zp->z.avail_out == 0 || (end && ret != Z_STREAM_END));
+    return 0;
+}
+
+static void zip_free(struct zipper* zp) {
+#ifdef TVIM_ZSTD
+    if (zp->codec == CODEC_ZSTD) {
+        ZSTD_freeCCtx(zp->zs);
+        return;
+    }
+#endif
+    deflateEnd(&zp->z);
+}
+
+/*** file i/o ***/
+
+// Add the line from p to eol, which is its '\n' or the end of the file.
+// Each row keeps its own line ending, so a mixed file saves unchanged.
+static void load_line(struct editor* ed, char* p, char* eol) {
+    size_t rowLen = eol - p;
+    bool cr = rowLen > 0 && p[rowLen - 1] == '\r';
+    if (cr) {
+        rowLen--;
+        if (ed->nRows == 0) {
+            ed->crlf = true;
+        }
+    }
+    row_append_mapped(ed, p, rowLen)->cr = cr;
+}
+
+// Add up to max lines from p, returning where the next one starts.
+static char* load_lines(struct editor* ed, char* p, char* end, int max) {
+    for (int i = 0; i < max && p < end; i++) {
+        char* nl = (char*)memchr(p, '\n', end - p);
+        char* eol = nl ? nl : end;
+        load_line(ed, p, eol);
+        p = eol + 1;
+    }
+    return MIN(p, end);
+}
+
+// Split the mapped file into rows. Every row borrows its chars from buf,
+// nothing is copied until the row is edited. memchr() is the vectorised
+// (SSE2/AVX2) newline scan, glibc picks the best one for the cpu.
+void file_get_lines(struct editor* ed, char* buf, size_t len) {
+    long long start = stats_start();
+    load_lines(ed, buf, buf + len, INT_MAX);
+    stats_stop(STAT_LOAD, start);
+}
+
+// Add the lines in s after the last row, or onto it while *partial says it
+// still waits for its '\n'. Rows past the end leave the rows a search is
+// scanning where they were, so only finishing a row changes the version.
+// With borrow the rows keep pointing into s, which has to be in the arena,
+// else each gets a copy that can be freed on its own.
+static void load_append(struct editor* ed, char* s, size_t len,
+                        bool* partial, bool borrow) {
+    char* end = s + len;
+    char* p = s;
+    if (*partial && ed->nRows > 0) {
+        char* nl = (char*)memchr(p, '\n', end - p);
+        char* eol = nl ? nl : end;
+        int y = ed->nRows - 1;
+        gap_flush(ed);
+        row_t* row = row_at(ed, y);
+        row_reserve(row, row->len + (eol - p) + 1);
+        memcpy(&row->chars[row->len], p, eol - p);
+        row->len += eol - p;
+        row->cr = nl != NULL && row->len > 0 &&
+                  row->chars[row->len - 1] == '\r';
+        row->len -= row->cr;
+        row->chars[row->len] = '\0';
+        row_update(ed, row);
+        syntax_edit(ed, y);
+        *partial = nl == NULL;
+        p = MIN(eol + 1, end);
+    }
+
+    unsigned version = ed->version;
+    while (p < end) {
+        char* nl = (char*)memchr(p, '\n', end - p);
+        char* eol = nl ? nl : end;
+        size_t n = eol - p;
+        bool cr = nl != NULL && n > 0 && p[n - 1] == '\r';
+        if (cr) {
+            n--;
+            if (ed->nRows == 0) {
+                ed->crlf = true;
+            }
+        }
+        row_t* row = rows_insert(ed, ed->nRows);
+        if (borrow) {
+            row->len = n;
+            row->chars = p;
+            row->store = ROW_ARENA;
+            row->rlen = 0;
+            row->rstate = RENDER_STALE;
+        } else {
+            row_init(ed, row, p, n, false);
+        }
+        row->cr = cr;
+        *partial = nl == NULL;
+        p = eol + 1;
+    }
+    ed->version = version;
+}
+
+static void stream_finish(struct editor* ed) {
+    struct streamjob* st = &ed->stream;
+    watch_remove(ed, st->fd);
+    close(st->fd);
+    st->active = false;
+    stats_stop(STAT_LOAD, st->started);
+    if (ed->unzip.running) {
+        unzip_finish(ed);
+    }
+}
+
+// Lines from the stream, at most TVIM_STREAM_READ bytes of them so keys
+// get in between. They are read into the arena and the rows borrow them
+// there, like the rows of a mapped file.
+static void stream_ready(struct editor* ed, int fd) {
+    struct streamjob* st = &ed->stream;
+    for (size_t total = 0; total < TVIM_STREAM_READ;) {
+        if (st->left < TVIM_READ_CHUNK) {
+            st->buf = (char*)arena_alloc(&ed->arena, TVIM_STREAM_READ);
+            st->left = TVIM_STREAM_READ;
+        }
+        ssize_t n = read(fd, st->buf, st->left);
+        if (n > 0) {
+            load_append(ed, st->buf, n, &st->partial, true);
+            st->buf += n;
+            st->left -= n;
+            st->bytes += n;
+            total += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            return;
+        } else {
+            // the end of the stream, or a read error that ends it too.
+            stream_finish(ed);
+            return;
+        }
+    }
+}
+
+// Read the lines of fd, a pipe or anything else that cannot be mapped, as
+// they come. The main loop takes them in through stream_ready, the file
+// has no name until it is saved as one.
+void file_stream(struct editor* ed, int fd) {
+    struct streamjob* st = &ed->stream;
+    st->started = stats_start();
+    st->fd = fd;
+    st->active = true;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    watch_add(ed, fd, stream_ready);
+}
+
+static void load_send(struct loadjob* j, struct loadbatch* b) {
+    if (write(j->wake[1], &b, sizeof(b)) != sizeof(b)) {
+        free(b);
+    }
+}
+
+// Find the line ends of the rest of the file, TVIM_LOAD_BATCH at a time.
+// The pipe holds the batches the main loop has not got to yet, a full one
+// holds this thread up.
+static void* load_worker(void* arg) {
+    struct loadjob* j = (struct loadjob*)arg;
+    struct loadbatch* b = NULL;
+    char* p = j->scan;
+    while (p < j->end && !atomic_load(&j->cancel)) {
+        if (b == NULL) {
+            b = (struct loadbatch*)malloc(sizeof(struct loadbatch));
+            if (b == NULL) {
+                crash("malloc");
+            }
+            b->n = 0;
+        }
+        char* nl = (char*)memchr(p, '\n', j->end - p);
+        char* eol = nl ? nl : j->end;
+        b->ends[b->n++] = eol;
+        p = eol + 1;
+        if (b->n == TVIM_LOAD_BATCH) {
+            load_send(j, b);
+            b = NULL;
+        }
+    }
+    if (b != NULL) {
+        load_send(j, b);
+    }
+    // end of file for load_ready.
+    close(j->wake[1]);
+    return NULL;
+}
+
+// Rows of a batch go past the end, which leaves the rows a search is
+// scanning where they were, so the version stays as it is.
+static void load_add(struct editor* ed, struct loadbatch* b) {
+    struct loadjob* j = &ed->load;
+    unsigned version = ed->version;
+    for (int i = 0; i < b->n; i++) {
+        load_line(ed, j->at, b->ends[i]);
+        j->at = b->ends[i] + 1;
+    }
+    ed->version = version;
+    free(b);
+}
+
+static void load_finish(struct editor* ed) {
+    struct loadjob* j = &ed->load;
+    pthread_join(j->thread, NULL);
+    watch_remove(ed, j->wake[0]);
+    close(j->wake[0]);
+    j->running = false;
+}
+
+// One batch from the load thread, so keys get in between batches.
+static void load_ready(struct editor* ed, int fd) {
+    struct loadbatch* b;
+    ssize_t n = read(fd, &b, sizeof(b));
+    if (n == sizeof(b)) {
+        load_add(ed, b);
+    } else if (n == 0) {
+        load_finish(ed);
+        stats_stop(STAT_LOAD, ed->load.started);
+    }
+}
+
+// Block until every line of the file is in.
+void file_load_wait(struct editor* ed) {
+    struct loadjob* j = &ed->load;
+    // a decompressed file ends, unlike a pipe tvim was started on.
+    struct streamjob* st = &ed->stream;
+    if (ed->unzip.running && st->active) {
+        fcntl(st->fd, F_SETFL, fcntl(st->fd, F_GETFL) & ~O_NONBLOCK);
+        while (st->active) {
+            stream_ready(ed, st->fd);
+        }
+    }
+    if (!j->running) {
+        return;
+    }
+    fcntl(j->wake[0], F_SETFL, fcntl(j->wake[0], F_GETFL) & ~O_NONBLOCK);
+    struct loadbatch* b;
+    while (read(j->wake[0], &b, sizeof(b)) == sizeof(b)) {
+        load_add(ed, b);
+    }
+    load_finish(ed);
+    stats_stop(STAT_LOAD, j->started);
+}
+
+// Stop the load thread, dropping the lines it found.
+static void load_cancel(struct editor* ed) {
+    struct loadjob* j = &ed->load;
+    if (!j->running) {
+        return;
+    }
+    atomic_store(&j->cancel, true);
+    fcntl(j->wake[0], F_SETFL, fcntl(j->wake[0], F_GETFL) & ~O_NONBLOCK);
+    struct loadbatch* b;
+    while (read(j->wake[0], &b, sizeof(b)) == sizeof(b)) {
+        free(b);
+    }
+    load_finish(ed);
+}
+
+// Add the first screen of a big file here and the rest on a thread, which
+// the main loop takes in through load_ready. Small files are split here.
+static void load_start(struct editor* ed, char* buf, size_t len) {
+    struct loadjob* j = &ed->load;
+    j->started = stats_start();
+    j->end = buf + len;
+    j->at = load_lines(ed, buf, j->end, ed->screenRows);
+    j->scan = j->at;
+    if (j->at == j->end) {
+        stats_stop(STAT_LOAD, j->started);
+        return;
+    }
+
+    if (pipe2(j->wake, O_CLOEXEC) == -1) {
+        j->at = load_lines(ed, j->at, j->end, INT_MAX);
+        stats_stop(STAT_LOAD, j->started);
+        return;
+    }
+    fcntl(j->wake[0], F_SETFL, O_NONBLOCK);
+    atomic_store(&j->cancel, false);
+    if (pthread_create(&j->thread, NULL, load_worker, j) != 0) {
+        close(j->wake[0]);
+        close(j->wake[1]);
+        j->at = load_lines(ed, j->at, j->end, INT_MAX);
+        stats_stop(STAT_LOAD, j->started);
+        return;
+    }
+    j->running = true;
+    watch_add(ed, j->wake[0], load_ready);
+}
+
+void file_open(struct editor* ed, const char* filename) {
+    ed->filename = strdup(filename);
+    syntax_select(ed, filename);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        crash("open");
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        crash("fstat");
+
+    // compressed files stream in through a decompressing thread, which
+    // keeps fd.
+    unsigned char magic[4];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    enum codec codec = codec_detect(magic, MAX(n, 0));
+#ifndef TVIM_ZSTD
+    if (codec == CODEC_ZSTD) {
+        tvim_set_status(ed, "built without zstd, opened as it is");
+        codec = CODEC_NONE;
+    }
+#endif
+    if (codec != CODEC_NONE && unzip_start(ed, fd, codec)) {
+        return;
+    }
+
+    // the huge file keeps fd to map chunks from.
+    if ((size_t)st.st_size > ed->hugeSize) {
+        huge_open(ed, fd, &st);
+        return;
+    }
+    if (st.st_size > 0) {
+        char* map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                                0);
+        if (map == MAP_FAILED)
+            crash("mmap");
+
+        ed->map = map;
+        ed->mapLen = st.st_size;
+        if (st.st_size <= TVIM_LOAD_SYNC) {
+            file_get_lines(ed, map, st.st_size);
+        } else {
+            load_start(ed, map, st.st_size);
+        }
+    }
+
+    close(fd);
+}
+
+// writes out all of iov, picking up after short writes.
+static int file_writev(int fd, struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// Add len bytes at s to the spans j writes out, extending the last span
+// when s follows right after it.
+static void save_span(struct savejob* j, char* s, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (j->nSpans > 0 && s != NULL) {
+        struct iovec* last = &j->spans[j->nSpans - 1];
+        if ((char*)last->iov_base + last->iov_len == s &&
+            last->iov_len + len <= TVIM_SAVE_CHUNK) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    if (j->nSpans == j->spanCap) {
+        j->spanCap = MAX(64, j->spanCap * 2);
+        j->spans = (struct iovec*)realloc(j->spans,
+                                          j->spanCap * sizeof(struct iovec));
+        if (j->spans == NULL) {
+            crash("realloc");
+        }
+    }
+    j->spans[j->nSpans++] = (struct iovec){s, len};
+}
+
+// Add len bytes of the huge file from off to the spans j writes out.
+static void save_range(struct savejob* j, size_t off, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (j->nSpans > 0 && j->spans[j->nSpans - 1].iov_base == NULL &&
+        j->srcOffs[j->nSrc - 1] + j->spans[j->nSpans - 1].iov_len == off) {
+        j->spans[j->nSpans - 1].iov_len += len;
+        return;
+    }
+    if (j->nSrc == j->srcCap) {
+        j->srcCap = MAX(64, j->srcCap * 2);
+        j->srcOffs = (size_t*)realloc(j->srcOffs,
+                                      j->srcCap * sizeof(size_t));
+        if (j->srcOffs == NULL) {
+            crash("realloc");
+        }
+    }
+    j->srcOffs[j->nSrc++] = off;
+    save_span(j, NULL, len);
+}
+
+// Copy s into the job, right behind the previous copy when it fits so runs
+// of copied rows still make one span.
+static char* save_copy(struct savejob* j, const char* s, size_t len) {
+    if (j->copyLeft < len) {
+        size_t cap = MAX(len, (size_t)TVIM_ARENA_CHUNK);
+        j->copyAt = (char*)arena_alloc(&j->copies, cap);
+        j->copyLeft = cap;
+    }
+    char* p = j->copyAt;
+    memcpy(p, s, len);
+    j->copyAt += len;
+    j->copyLeft -= len;
+    return p;
+}
+
+// Take down what the buffer looks like now as spans to write. Mapped and
+// arena chars never change, so they are borrowed, and unedited mapped rows
+// still have their line ending after them in the mapping, so a run of them
+// is one span. Heap and inline chars are copied. Each row ends the way it
+// did in the file.
+static void save_snapshot(struct editor* ed, struct savejob* j) {
+    static char eolBuf[] = "\r\n";
+    char* mapEnd = ed->map + ed->mapLen;
+
+    j->started = stats_start();
+    gap_flush(ed);
+    j->nSpans = 0;
+    j->nSrc = 0;
+    j->total = 0;
+    j->nRows = ed->nRows;
+    j->unsaved = ed->unsaved;
+    j->err = 0;
+    j->codec = ed->codec;
+    atomic_store(&j->done, 0);
+    atomic_store(&j->finished, false);
+
+    // save through a symlink to the file it points at, not over the link.
+    j->path = realpath(ed->filename, NULL);
+    if (j->path == NULL) {
+        j->path = strdup(ed->filename);
+    }
+    if (ed->huge != NULL) {
+        huge_snapshot(ed, j);
+        return;
+    }
+
+    int run;
+    for (int i = 0; i < ed->nRows; i += run) {
+        row_t* rows = row_run(ed, i, &run);
+        for (int r = 0; r < run; r++) {
+            row_t* row = &rows[r];
+            char* end = row->chars + row->len;
+            char* eol = eolBuf + !row->cr;
+            size_t eolLen = 1 + row->cr;
+            j->total += row->len + eolLen;
+            if (row->store == ROW_MAPPED && end + eolLen <= mapEnd &&
+                memcmp(end, eol, eolLen) == 0) {
+                save_span(j, row->chars, row->len + eolLen);
+            } else if (row->store == ROW_MAPPED ||
+                       row->store == ROW_ARENA) {
+                save_span(j, row->chars, row->len);
+                save_span(j, eol, eolLen);
+            } else {
+                save_span(j, save_copy(j, row->chars, row->len), row->len);
+                save_span(j, save_copy(j, eol, eolLen), eolLen);
+            }
+        }
+    }
+}
+
+// makes the rename in path's directory durable.
+static void file_sync_dir(const char* path) {
+    char* slash = strrchr(path, '/');
+    char* dir = slash ? strndup(path, MAX(slash - path, 1)) : strdup(".");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+static void save_wake(struct savejob* j) {
+    if (j->running) {
+        write(j->wake[1], "", 1);
+    }
+}
+
+// Copy len bytes from off in j->src to fd, or through zp when the file is
+// compressed. The kernel copies them without them passing through here
+// where it can.
+static int save_copy_range(struct savejob* j, int fd, struct zipper* zp,
+                           size_t off, size_t len) {
+    off_t in = off;
+    bool kernel = zp == NULL;
+    char buf[1 << 16];
+    while (len > 0) {
+        ssize_t w;
+        if (kernel) {
+            w = copy_file_range(j->src, &in, fd, NULL,
+                                MIN(len, TVIM_SAVE_CHUNK), 0);
+            // not between these two files, copy them by hand.
+            if (w == -1 && (errno == EXDEV || errno == EINVAL ||
+                            errno == ENOSYS || errno == EOPNOTSUPP)) {
+                kernel = false;
+                continue;
+            }
+        } else {
+            w = pread(j->src, buf, MIN(len, sizeof(buf)), in);
+            struct iovec iov = {buf, MAX(w, 0)};
+            if (w > 0 && (zp != NULL ? zip_write(zp, buf, w, false)
+                                     : file_writev(fd, &iov, 1)) == -1) {
+                return -1;
+            }
+            in += MAX(w, 0);
+        }
+        if (w == -1 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            // the file got shorter under us.
+            errno = w == 0 ? EIO : errno;
+            return -1;
+        }
+        len -= w;
+        atomic_fetch_add(&j->done, w);
+        save_wake(j);
+    }
+    return 0;
+}
+
+// Write the snapshot to a temporary next to the file and rename it over
+// the file, so a failed save leaves the old file whole. The old inode lives
+// on under the mapping, rows borrowing from it stay valid. Runs on the
+// save thread, so it only touches j.
+static int save_write(struct savejob* j) {
+    size_t pathLen = strlen(j->path);
+    char* tmp = malloc(pathLen + sizeof(".tvimXXXXXX"));
+    if (tmp == NULL) {
+        j->err = errno;
+        return -1;
+    }
+    memcpy(tmp, j->path, pathLen);
+    memcpy(tmp + pathLen, ".tvimXXXXXX", sizeof(".tvimXXXXXX"));
+
+    int result = 0;
+    struct zipper zp;
+    bool zipping = false;
+    int fd = mkstemp(tmp);
+    bool made = fd != -1;
+    if (!made) {
+        return_defer(-1);
+    }
+
+    // keep the old file's permissions, a new one gets the usual 0666 & ~umask.
+    struct stat st;
+    mode_t mode;
+    if (stat(j->path, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    if (fchmod(fd, mode) == -1) {
+        return_defer(-1);
+    }
+    if (j->codec != CODEC_NONE) {
+        if (zip_init(&zp, j->codec, fd) == -1) {
+            return_defer(-1);
+        }
+        zipping = true;
+    }
+
+    // a batch at a time, so progress shows between them.
+    int i = 0;
+    int src = 0;
+    while (i < j->nSpans) {
+        if (j->spans[i].iov_base == NULL) {
+            if (save_copy_range(j, fd, zipping ? &zp : NULL,
+                                j->srcOffs[src++],
+                                j->spans[i].iov_len) == -1) {
+                return_defer(-1);
+            }
+            i++;
+            continue;
+        }
+        int n = 0;
+        size_t bytes = 0;
+        while (i + n < j->nSpans && n < TVIM_SAVE_IOV &&
+               bytes < TVIM_SAVE_CHUNK && j->spans[i + n].iov_base != NULL) {
+            bytes += j->spans[i + n].iov_len;
+            n++;
+        }
+        if (zipping) {
+            for (int k = 0; k < n; k++) {
+                if (zip_write(&zp, j->spans[i + k].iov_base,
+                              j->spans[i + k].iov_len, false) == -1) {
+                    return_defer(-1);
+                }
+            }
+        } else if (file_writev(fd, &j->spans[i], n) == -1) {
+            return_defer(-1);
+        }
+        i += n;
+        atomic_fetch_add(&j->done, bytes);
+        save_wake(j);
+    }
+    if (zipping && zip_write(&zp, NULL, 0, true) == -1) {
+        return_defer(-1);
+    }
+
+    if (fsync(fd) == -1) {
+        return_defer(-1);
+    }
+    int closed = close(fd);
+    fd = -1;
+    if (closed == -1 || rename(tmp, j->path) == -1) {
+        return_defer(-1);
+    }
+    made = false;
+    file_sync_dir(j->path);
+
+defer:
+    if (result == -1) {
+        j->err = errno;
+    }
+    if (zipping) {
+        zip_free(&zp);
+    }
+    if (result == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        if (made) {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    return result;
+}
+
+// Report how the save went and drop the snapshot. Edits made while it was
+// in flight stay unsaved.
+static void save_finish(struct editor* ed, struct savejob* j) {
+    stats_stop(STAT_SAVE, j->started);
+    if (j->err == 0) {
+        ed->unsaved -= j->unsaved;
+        if (j->nRows >= 0) {
+            tvim_set_status(ed, "\"%s\" %lldL, %zuB written", ed->filename,
+                            j->nRows, j->total);
+        } else {
+            tvim_set_status(ed, "\"%s\" %zuB written", ed->filename,
+                            j->total);
+        }
+    } else {
+        tvim_set_status(ed, "save failed: %s", strerror(j->err));
+    }
+    free(j->path);
+    j->path = NULL;
+    free(j->spans);
+    j->spans = NULL;
+    j->nSpans = 0;
+    j->spanCap = 0;
+    free(j->srcOffs);
+    j->srcOffs = NULL;
+    j->nSrc = 0;
+    j->srcCap = 0;
+    arena_release(&j->copies);
+    j->copyAt = NULL;
+    j->copyLeft = 0;
+}
+
+static void* save_worker(void* arg) {
+    struct savejob* j = (struct savejob*)arg;
+    save_write(j);
+    atomic_store(&j->finished, true);
+    save_wake(j);
+    return NULL;
+}
+
+// Progress or completion from the save thread.
+static void save_ready(struct editor* ed, int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+
+    struct savejob* j = &ed->save;
+    if (!atomic_load(&j->finished)) {
+        tvim_set_status(ed, "saving \"%s\" %d%%", ed->filename,
+                        (int)(atomic_load(&j->done) * 100 / MAX(j->total, 1)));
+        return;
+    }
+    file_save_wait(ed);
+    if (j->again) {
+        j->again = false;
+        file_save_async(ed);
+    }
+}
+
+// Whether the rows can go where a save would put them. Only call once the
+// file is all in.
+static bool save_allowed(struct editor* ed) {
+    if (ed->filename == NULL) {
+        tvim_set_status(ed, "No file name");
+        return false;
+    }
+    // only the part of a damaged file before the damage came in.
+    if (ed->unzip.err != NULL) {
+        tvim_set_status(ed, "\"%s\" was not read whole, use :w name",
+                        ed->filename);
+        return false;
+    }
+    // only its last lines are in rows, and its writer would go on writing
+    // the file the save renamed over.
+    if (ed->follow.active) {
+        tvim_set_status(ed, "\"%s\" is being followed, use :w name",
+                        ed->filename);
+        return false;
+    }
+    return true;
+}
+
+// Save on the calling thread. Waits out a save in flight first.
+int file_save(struct editor* ed) {
+    struct savejob* j = &ed->save;
+    file_load_wait(ed);
+    if (!save_allowed(ed)) {
+        return -1;
+    }
+    file_save_wait(ed);
+    save_snapshot(ed, j);
+    int result = save_write(j);
+    save_finish(ed, j);
+    return result;
+}
+
+// Save on a thread of its own while editing goes on. A save asked for while
+// one is running starts once that one is done.
+void file_save_async(struct editor* ed) {
+    struct savejob* j = &ed->save;
+    // half a file would be written over the whole of it.
+    file_load_wait(ed);
+    if (!save_allowed(ed)) {
+        return;
+    }
+    if (j->running) {
+        j->again = true;
+        return;
+    }
+    if (pipe2(j->wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+        file_save(ed);
+        return;
+    }
+    save_snapshot(ed, j);
+    j->running = true;
+    if (pthread_create(&j->thread, NULL, save_worker, j) != 0) {
+        j->running = false;
+        close(j->wake[0]);
+        close(j->wake[1]);
+        save_write(j);
+        save_finish(ed, j);
+        return;
+    }
+    watch_add(ed, j->wake[0], save_ready);
+    tvim_set_status(ed, "saving \"%s\"", ed->filename);
+}
+
+// Block until a save in flight is done and report it.
+void file_save_wait(struct editor* ed) {
+    struct savejob* j = &ed->save;
+    if (!j->running) {
+        return;
+    }
+    pthread_join(j->thread, NULL);
+    watch_remove(ed, j->wake[0]);
+    close(j->wake[0]);
+    close(j->wake[1]);
+    j->running = false;
+    save_finish(ed, j);
+}
+
+/*** huge files ***/
+
+// The mapping holding off, with *avail set to how many bytes of the file
+// it has from off on. Only good until the next call, which can unmap it.
+static char* huge_chunk(struct hugefile* h, size_t off, size_t* avail) {
+    size_t base = off - off % TVIM_HUGE_CHUNK;
+    struct hugechunk* c = NULL;
+    for (int i = 0; i < TVIM_HUGE_CHUNKS; i++) {
+        struct hugechunk* k = &h->chunks[i];
+        if (k->map != NULL && k->off == base) {
+            c = k;
+            break;
+        }
+        // a free slot, or else the one looked at longest ago.
+        if (c == NULL || (c->map != NULL && k->used < c->used)) {
+            c = k;
+        }
+    }
+
+    if (c->map == NULL || c->off != base) {
+        if (c->map != NULL) {
+            munmap(c->map, c->len);
+        }
+        c->off = base;
+        c->len = MIN(h->size - base, (size_t)TVIM_HUGE_CHUNK);
+        c->map = (char*)mmap(NULL, c->len, PROT_READ, MAP_PRIVATE, h->fd,
+                             base);
+        if (c->map == MAP_FAILED) {
+            crash("mmap");
+        }
+    }
+    c->used = ++h->tick;
+    *avail = c->len - (off - base);
+    return c->map + (off - base);
+}
+
+// Offset of the '\n' ending the line at off, or of the end of the file.
+static size_t huge_line_end(struct hugefile* h, size_t off) {
+    while (off < h->size) {
+        size_t avail;
+        char* p = huge_chunk(h, off, &avail);
+        char* nl = (char*)memchr(p, '\n', avail);
+        if (nl != NULL) {
+            return off + (nl - p);
+        }
+        off += avail;
+    }
+    return h->size;
+}
+
+// Start of the line before the one at off.
+static size_t huge_line_start(struct hugefile* h, size_t off) {
+    // step over the '\n' ending that line, the last one can lack it.
+    size_t end = off;
+    size_t avail;
+    if (end > 0 && *huge_chunk(h, end - 1, &avail) == '\n') {
+        end--;
+    }
+    while (end > 0) {
+        size_t base = end - 1 - (end - 1) % TVIM_HUGE_CHUNK;
+        char* p = huge_chunk(h, base, &avail);
+        char* nl = (char*)memrchr(p, '\n', end - base);
+        if (nl != NULL) {
+            return base + (nl - p) + 1;
+        }
+        end = base;
+    }
+    return 0;
+}
+
+// The line at off without its line ending, put together in tmp when it
+// runs over two chunks. Only good until the next huge_chunk. *cr says if
+// the ending was \r\n and *next is set to where the line after it starts.
+static char* huge_line(struct hugefile* h, size_t off, struct abuf* tmp,
+                       int* len, bool* cr, size_t* next) {
+    size_t end = huge_line_end(h, off);
+    size_t n = end - off;
+    *next = MIN(end + 1, h->size);
+    *cr = false;
+    if (n == 0) {
+        *len = 0;
+        return "";
+    }
+
+    size_t avail;
+    char* p = huge_chunk(h, off, &avail);
+    if (avail < n) {
+        tmp->len = 0;
+        for (size_t at = off; at < end; at += avail) {
+            char* q = huge_chunk(h, at, &avail);
+            avail = MIN(avail, end - at);
+            ab_append(tmp, q, avail);
+        }
+        p = tmp->buf;
+    }
+    if (p[n - 1] == '\r') {
+        n--;
+        *cr = true;
+    }
+    *len = n;
+    return p;
+}
+
+static void huge_wake(struct hugefile* h) {
+    write(h->wake[1], "", 1);
+}
+
+// Newline kernels. They count the '\n' in a piece and take a mark at the
+// first one and every TVIM_HUGE_STRIDE-th after it, a vector of bytes at a
+// time; only vectors holding a mark are looked at a '\n' at a time.
+
+struct nlscan {
+    struct hugepiece* piece;
+    size_t base;     // offset of the bytes in the file
+    long long count; // '\n' so far
+    long long next;  // count of the '\n' the next mark goes after
+};
+
+static void nl_mark(struct nlscan* sc, size_t at) {
+    struct hugepiece* pc = sc->piece;
+    if (pc->nMarks == pc->markCap) {
+        pc->markCap = MAX(64, pc->markCap * 2);
+        pc->marks = (struct hugemark*)realloc(
+            pc->marks, pc->markCap * sizeof(struct hugemark));
+        if (pc->marks == NULL) {
+            crash("realloc");
+        }
+    }
+    pc->marks[pc->nMarks++] = (struct hugemark){sc->count, sc->base + at + 1};
+    sc->next += TVIM_HUGE_STRIDE;
+}
+
+static void nl_scan_scalar(const char* s, size_t len, struct nlscan* sc) {
+    const char* p = s;
+    const char* end = s + len;
+    const char* nl;
+    while ((nl = (const char*)memchr(p, '\n', end - p)) != NULL) {
+        if (++sc->count == sc->next) {
+            nl_mark(sc, nl - s);
+        }
+        p = nl + 1;
+    }
+}
+
+#if defined(__x86_64__)
+// the '\n' of 64 bytes at s + at, one bit each.
+static inline void nl_bits(struct nlscan* sc, unsigned long long bits,
+                           size_t at) {
+    if (sc->count + __builtin_popcountll(bits) < sc->next) {
+        sc->count += __builtin_popcountll(bits);
+        return;
+    }
+    while (bits != 0) {
+        if (++sc->count == sc->next) {
+            nl_mark(sc, at + __builtin_ctzll(bits));
+        }
+        bits &= bits - 1;
+    }
+}
+
+static void nl_scan_sse2(const char* s, size_t len, struct nlscan* sc) {
+    __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        unsigned long long bits = 0;
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&s[i + 16 * k]);
+            unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+            bits |= (unsigned long long)m << (16 * k);
+        }
+        nl_bits(sc, bits, i);
+    }
+    sc->base += i;
+    nl_scan_scalar(s + i, len - i, sc);
+    sc->base -= i;
+}
+
+__attribute__((target("avx2,popcnt"))) static void
+nl_scan_avx2(const char* s, size_t len, struct nlscan* sc) {
+    __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&s[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&s[i + 32]);
+        unsigned lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl));
+        unsigned hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl));
+        nl_bits(sc, (unsigned long long)hi << 32 | lo, i);
+    }
+    sc->base += i;
+    nl_scan_scalar(s + i, len - i, sc);
+    sc->base -= i;
+}
+#endif
+
+static void (*nl_kernel)(const char*, size_t, struct nlscan*);
+
+// Use the widest kernel the CPU has. Done before any index thread starts.
+static void nl_pick_kernel() {
+    if (nl_kernel != NULL) {
+        return;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    nl_kernel = __builtin_cpu_supports("avx2") ? nl_scan_avx2 : nl_scan_sse2;
+#else
+    nl_kernel = nl_scan_scalar;
+#endif
+}
+
+// Count the lines of pieces of the file until there are none left. Each
+// piece is mapped on its own and dropped when done, so only the page cache
+// grows.
+static void* huge_index_worker(void* arg) {
+    struct hugefile* h = (struct hugefile*)arg;
+    while (!atomic_load(&h->cancel)) {
+        int k = atomic_fetch_add(&h->nextPiece, 1);
+        if (k >= h->nPieces) {
+            break;
+        }
+        struct hugepiece* pc = &h->pieces[k];
+        size_t off = (size_t)k * TVIM_INDEX_PIECE;
+        size_t len = MIN(h->size - off, (size_t)TVIM_INDEX_PIECE);
+        char* map = (char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, h->fd, off);
+        if (map != MAP_FAILED) {
+            madvise(map, len, MADV_SEQUENTIAL);
+            struct nlscan sc = {pc, off, 0, 1};
+            nl_kernel(map, len, &sc);
+            pc->lines = sc.count;
+            pc->last = map[len - 1];
+            munmap(map, len);
+        } else {
+            pc->lines = -1;
+        }
+
+        pthread_mutex_lock(&h->mu);
+        pc->done = true;
+        pthread_cond_broadcast(&h->cv);
+        pthread_mutex_unlock(&h->mu);
+    }
+    return NULL;
+}
+
+// Keep the index next to the file for the next time it is opened. Written
+// under another name and renamed, so a sidecar is whole or not there.
+static void huge_index_save(struct hugefile* h) {
+    size_t len = strlen(h->sidecar);
+    char* tmp = malloc(len + sizeof(".XXXXXX"));
+    if (tmp == NULL) {
+        return;
+    }
+    memcpy(tmp, h->sidecar, len);
+    memcpy(tmp + len, ".XXXXXX", sizeof(".XXXXXX"));
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        return;
+    }
+
+    struct hugeindex head = h->key;
+    head.lines = atomic_load(&h->lines);
+    head.nMarks = atomic_load(&h->nMarks);
+    struct iovec iov[2] = {
+        {&head, sizeof(head)},
+        {h->marks, head.nMarks * sizeof(struct hugemark)},
+    };
+    bool ok = file_writev(fd, iov, 2) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp, h->sidecar) == -1) {
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+// Take the index from the sidecar if it is there and still matches the
+// file.
+static bool huge_index_load(struct hugefile* h, long long cap) {
+    int fd = open(h->sidecar, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    struct hugeindex head;
+    bool ok = read(fd, &head, sizeof(head)) == sizeof(head) &&
+              memcmp(&head, &h->key, offsetof(struct hugeindex, lines)) == 0 &&
+              head.nMarks > 0 && head.nMarks <= cap;
+    if (ok) {
+        size_t bytes = head.nMarks * sizeof(struct hugemark);
+        ok = read(fd, h->marks, bytes) == (ssize_t)bytes &&
+             h->marks[0].line == 0 && h->marks[0].off == 0;
+    }
+    close(fd);
+    if (!ok) {
+        return false;
+    }
+    atomic_store(&h->nMarks, head.nMarks);
+    atomic_store(&h->lines, head.lines);
+    atomic_store(&h->scanned, h->size);
+    atomic_store(&h->indexed, true);
+    return true;
+}
+
+// Hand out the pieces to the workers and add their marks to the index in
+// file order as they come in, so jumps work in the part already counted.
+static void* huge_index_main(void* arg) {
+    struct hugefile* h = (struct hugefile*)arg;
+    pthread_t workers[TVIM_SEARCH_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = MIN(MIN(MAX(cpus, 1), TVIM_SEARCH_THREADS), h->nPieces);
+    int started = 0;
+    while (started < n && pthread_create(&workers[started], NULL,
+                                         huge_index_worker, h) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        huge_index_worker(h);
+    }
+
+    long long lines = 0;
+    long long nMarks = 1;
+    char last = '\n';
+    int shown = 0;
+    int k = 0;
+    for (; k < h->nPieces; k++) {
+        struct hugepiece* pc = &h->pieces[k];
+        pthread_mutex_lock(&h->mu);
+        while (!pc->done && !atomic_load(&h->cancel)) {
+            pthread_cond_wait(&h->cv, &h->mu);
+        }
+        bool done = pc->done;
+        pthread_mutex_unlock(&h->mu);
+        if (!done || pc->lines < 0) {
+            break;
+        }
+
+        for (int i = 0; i < pc->nMarks; i++) {
+            h->marks[nMarks] = (struct hugemark){lines + pc->marks[i].line,
+                                                 pc->marks[i].off};
+            atomic_store(&h->nMarks, ++nMarks);
+        }
+        free(pc->marks);
+        pc->marks = NULL;
+        lines += pc->lines;
+        last = pc->last;
+
+        size_t scanned = MIN((size_t)(k + 1) * TVIM_INDEX_PIECE, h->size);
+        atomic_store(&h->scanned, scanned);
+        int pct = scanned * 100 / h->size;
+        if (pct != shown) {
+            shown = pct;
+            huge_wake(h);
+        }
+    }
+    // a failed piece stops the others too.
+    atomic_store(&h->cancel, true);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    if (k == h->nPieces) {
+        // a last line without a '\n' is a line too.
+        atomic_store(&h->lines, lines + (last != '\n'));
+        atomic_store(&h->indexed, true);
+        huge_index_save(h);
+    }
+    atomic_store(&h->finished, true);
+    huge_wake(h);
+    return NULL;
+}
+
+static void huge_join(struct editor* ed) {
+    struct hugefile* h = ed->huge;
+    pthread_join(h->thread, NULL);
+    watch_remove(ed, h->wake[0]);
+    close(h->wake[0]);
+    close(h->wake[1]);
+    h->running = false;
+}
+
+// Progress from the index thread, the status bar shows it.
+static void huge_index_ready(struct editor* ed, int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    if (atomic_load(&ed->huge->finished)) {
+        huge_join(ed);
+    }
+}
+
+// Block until the index thread is done.
+void huge_wait(struct editor* ed) {
+    if (ed->huge != NULL && ed->huge->running) {
+        huge_join(ed);
+    }
+}
+
+// Line count of the edited file, -1 until the index is done.
+static long long huge_lines(struct editor* ed) {
+    struct hugefile* h = ed->huge;
+    if (!atomic_load(&h->indexed)) {
+        return -1;
+    }
+    // the window's rows count as they are, edited or not.
+    long long n = atomic_load(&h->lines) + ed->nRows;
+    n -= h->origTo - h->origFrom;
+    for (int i = 0; i < h->nPatches; i++) {
+        if (i < h->patchFrom || i >= h->patchTo) {
+            n += h->patches[i].nLines - h->patches[i].count;
+        }
+    }
+    return n;
+}
+
+// Find where line y of the file starts from the nearest line before it
+// whose offset is known: an index mark or an end of the window. False when
+// none of them is close enough or y is past the end.
+static bool huge_offset(struct hugefile* h, long long y, size_t* off) {
+    long long at = -1;
+    size_t atOff = 0;
+    // the last mark at or before y, if y is not too far past it.
+    long long lo = 0;
+    long long hi = atomic_load(&h->nMarks);
+    while (hi - lo > 1) {
+        long long mid = lo + (hi - lo) / 2;
+        if (h->marks[mid].line <= y) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (y - h->marks[lo].line <= TVIM_HUGE_STRIDE) {
+        at = h->marks[lo].line;
+        atOff = h->marks[lo].off;
+    }
+    // the ends of the window, for lines in it or not far past it.
+    if (y >= h->origFrom && y <= h->origTo && h->origFrom > at) {
+        at = h->origFrom;
+        atOff = h->fromOff;
+    }
+    if (y >= h->origTo && y - h->origTo <= TVIM_HUGE_WINDOW &&
+        h->origTo > at) {
+        at = h->origTo;
+        atOff = h->toOff;
+    }
+    if (at < 0) {
+        return false;
+    }
+
+    for (; at < y; at++) {
+        if (atOff >= h->size) {
+            return false;
+        }
+        atOff = MIN(huge_line_end(h, atOff) + 1, h->size);
+    }
+    *off = atOff;
+    return true;
+}
+
+// Make the rows lines y on of the file, with the patches from k on put in
+// where they go, stopping past want rows or at the end of the file. off is
+// where line y starts.
+static void huge_load(struct editor* ed, long long y, size_t off, int k,
+                      long long want) {
+    struct hugefile* h = ed->huge;
+    rows_free(ed);
+    arena_release(&ed->arena);
+    ed->hl.valid = 0;
+    ed->hl.dirty = 0;
+    ed->hl.known = 0;
+
+    h->origFrom = y;
+    h->fromOff = off;
+    h->patchFrom = k;
+    struct abuf tmp = ab_init();
+    while (true) {
+        if (k < h->nPatches && h->patches[k].from == y) {
+            struct hugepatch* pt = &h->patches[k];
+            char* p = pt->text;
+            for (long long i = 0; i < pt->nLines; i++) {
+                char* nl = (char*)memchr(p, '\n', pt->text + pt->len - p);
+                bool cr = nl > p && nl[-1] == '\r';
+                row_append(ed, p, nl - p - cr)->cr = cr;
+                p = nl + 1;
+            }
+            y += pt->count;
+            off = pt->toOff;
+            k++;
+            continue;
+        }
+        if (ed->nRows >= want || off >= h->size) {
+            break;
+        }
+        int len;
+        bool cr;
+        size_t next;
+        char* s = huge_line(h, off, &tmp, &len, &cr, &next);
+        row_append(ed, s, len)->cr = cr;
+        off = next;
+        y++;
+    }
+    ab_free(&tmp);
+
+    h->origTo = y;
+    h->toOff = off;
+    h->patchTo = k;
+    h->eof = off >= h->size;
+    h->version = ed->version;
+}
+
+static bool huge_same(row_t* row, const char* s, int len, bool cr) {
+    return row->len == len && row->cr == cr && memcmp(row->chars, s, len) == 0;
+}
+
+// Put the edits made to the rows since the window was loaded into the
+// patches. The rows and the lines of the file they stand for are compared
+// from both ends, and what differs in between replaces the patches that
+// went into the window.
+static void huge_commit(struct editor* ed) {
+    struct hugefile* h = ed->huge;
+    gap_flush(ed);
+    if (ed->version == h->version) {
+        return;
+    }
+
+    struct abuf tmp = ab_init();
+    long long orig = h->origTo - h->origFrom;
+    long long lead = 0;
+    size_t from = h->fromOff;
+    while (lead < ed->nRows && lead < orig) {
+        int len;
+        bool cr;
+        size_t next;
+        char* s = huge_line(h, from, &tmp, &len, &cr, &next);
+        if (!huge_same(row_at(ed, lead), s, len, cr)) {
+            break;
+        }
+        from = next;
+        lead++;
+    }
+    long long trail = 0;
+    size_t to = h->toOff;
+    while (trail < ed->nRows - lead && trail < orig - lead) {
+        size_t start = huge_line_start(h, to);
+        int len;
+        bool cr;
+        size_t next;
+        char* s = huge_line(h, start, &tmp, &len, &cr, &next);
+        if (!huge_same(row_at(ed, ed->nRows - 1 - trail), s, len, cr)) {
+            break;
+        }
+        to = start;
+        trail++;
+    }
+
+    struct hugepatch pt = {h->origFrom + lead, orig - lead - trail, from, to,
+                           NULL, 0, ed->nRows - lead - trail};
+    tmp.len = 0;
+    for (long long i = lead; i < ed->nRows - trail; i++) {
+        row_t* row = row_at(ed, i);
+        ab_append(&tmp, row->chars, row->len);
+        ab_append(&tmp, "\r\n" + !row->cr, 1 + row->cr);
+    }
+    pt.text = tmp.buf;
+    pt.len = tmp.len;
+
+    for (int i = h->patchFrom; i < h->patchTo; i++) {
+        free(h->patches[i].text);
+    }
+    int keep = pt.count > 0 || pt.nLines > 0;
+    if (h->nPatches - (h->patchTo - h->patchFrom) + keep > h->patchCap) {
+        h->patchCap = MAX(16, h->patchCap * 2);
+        h->patches = (struct hugepatch*)realloc(
+            h->patches, h->patchCap * sizeof(struct hugepatch));
+        if (h->patches == NULL) {
+            crash("realloc");
+        }
+    }
+    memmove(&h->patches[h->patchFrom + keep], &h->patches[h->patchTo],
+            (h->nPatches - h->patchTo) * sizeof(struct hugepatch));
+    h->nPatches += h->patchFrom + keep - h->patchTo;
+    h->patchTo = h->patchFrom + keep;
+    if (keep) {
+        h->patches[h->patchFrom] = pt;
+    } else {
+        ab_free(&tmp);
+    }
+    h->version = ed->version;
+}
+
+// Load the window around line y of the edited file. False, leaving the
+// window where it is, when the index has not got that far yet.
+static bool huge_window(struct editor* ed, long long y) {
+    struct hugefile* h = ed->huge;
+    huge_commit(ed);
+
+    // a window starting inside a patch starts at the patch.
+    long long start = MAX(y - TVIM_HUGE_WINDOW / 2, 0);
+    long long delta = 0;
+    int k = 0;
+    for (; k < h->nPatches; k++) {
+        struct hugepatch* pt = &h->patches[k];
+        long long at = pt->from + delta;
+        if (start < at) {
+            break;
+        }
+        if (start < at + pt->nLines) {
+            start = at;
+            break;
+        }
+        delta += pt->nLines - pt->count;
+    }
+
+    long long line = start - delta;
+    size_t off;
+    if (k < h->nPatches && h->patches[k].from + delta == start) {
+        line = h->patches[k].from;
+        off = h->patches[k].fromOff;
+    } else if (!huge_offset(h, line, &off)) {
+        return false;
+    }
+    // half a window past y, however much of it a patch took up.
+    huge_load(ed, line, off, k, y - start + TVIM_HUGE_WINDOW / 2);
+    h->winFrom = start;
+    return true;
+}
+
+// The sidecar index of the file at path: .<name>.tvimidx next to it.
+static char* huge_sidecar(const char* path) {
+    const char* slash = strrchr(path, '/');
+    int dir = slash == NULL ? 0 : slash - path + 1;
+    size_t len = strlen(path) + sizeof("..tvimidx");
+    char* s = malloc(len);
+    if (s == NULL) {
+        crash("malloc");
+    }
+    snprintf(s, len, "%.*s.%s.tvimidx", dir, path, path + dir);
+    return s;
+}
+
+// Open fd, which st describes, as a huge file and load the window at its
+// start. fd is the huge file's from now on. The line index comes from the
+// sidecar when it matches the file, else it is built in the background.
+void huge_open(struct editor* ed, int fd, const struct stat* st) {
+    long long start = stats_start();
+    struct hugefile* h = (struct hugefile*)calloc(1, sizeof(struct hugefile));
+    if (h == NULL) {
+        crash("calloc");
+    }
+    ed->huge = h;
+    h->fd = fd;
+    h->size = st->st_size;
+    pthread_mutex_init(&h->mu, NULL);
+    pthread_cond_init(&h->cv, NULL);
+
+    memcpy(h->key.magic, "tvimidx1", 8);
+    h->key.size = h->size;
+    h->key.dev = st->st_dev;
+    h->key.ino = st->st_ino;
+    h->key.mtimeSec = st->st_mtim.tv_sec;
+    h->key.mtimeNsec = st->st_mtim.tv_nsec;
+    h->key.stride = TVIM_HUGE_STRIDE;
+    h->sidecar = huge_sidecar(ed->filename);
+
+    h->nPieces = (h->size + TVIM_INDEX_PIECE - 1) / TVIM_INDEX_PIECE;
+    h->pieces = (struct hugepiece*)calloc(h->nPieces,
+                                          sizeof(struct hugepiece));
+    // every line could be a byte, but only the pages written to are real.
+    long long cap = h->size / TVIM_HUGE_STRIDE + h->nPieces + 2;
+    h->marks = (struct hugemark*)calloc(cap, sizeof(struct hugemark));
+    if (h->pieces == NULL || h->marks == NULL) {
+        crash("calloc");
+    }
+    atomic_store(&h->nMarks, 1);
+
+    if (!huge_index_load(h, cap)) {
+        nl_pick_kernel();
+        if (pipe2(h->wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+            crash("pipe2");
+        }
+        if (pthread_create(&h->thread, NULL, huge_index_main, h) != 0) {
+            crash("pthread_create");
+        }
+        h->running = true;
+        watch_add(ed, h->wake[0], huge_index_ready);
+    }
+
+    size_t avail;
+    char* p = huge_chunk(h, 0, &avail);
+    char* nl = (char*)memchr(p, '\n', avail);
+    ed->crlf = nl != NULL && nl > p && nl[-1] == '\r';
+    huge_load(ed, 0, 0, 0, TVIM_HUGE_WINDOW);
+    stats_stop(STAT_LOAD, start);
+}
+
+// Move the window along when the cursor gets within a screen of one of its
+// ends, so there are always rows to show and to move into.
+void huge_follow(struct editor* ed) {
+    struct hugefile* h = ed->huge;
+    if (h == NULL) {
+        return;
+    }
+    bool top = ed->cY < ed->screenRows && h->winFrom > 0;
+    bool bottom = ed->cY + ed->screenRows >= ed->nRows && !h->eof;
+    if (!top && !bottom) {
+        return;
+    }
+
+    long long y = h->winFrom + ed->cY;
+    long long rowOff = h->winFrom + ed->rowOff;
+    if (huge_window(ed, y)) {
+        ed->cY = MIN(y - h->winFrom, ed->nRows);
+        ed->rowOff = MAX(rowOff - h->winFrom, 0);
+    }
+}
+
+// Put the cursor on line y of the edited file.
+bool huge_goto(struct editor* ed, long long y) {
+    struct hugefile* h = ed->huge;
+    long long n = huge_lines(ed);
+    if (y < 0 && n < 0) {
+        tvim_set_status(ed, "the end is not indexed yet (%d%%)",
+                        (int)(atomic_load(&h->scanned) * 100 / h->size));
+        return false;
+    }
+    if (y < 0) {
+        y = MAX(n - 1, 0);
+    } else if (n >= 0) {
+        y = MIN(y, MAX(n - 1, 0));
+    }
+    if (y < h->winFrom || y >= h->winFrom + ed->nRows) {
+        if (!huge_window(ed, y)) {
+            tvim_set_status(ed, "line %lld is not indexed yet (%d%%)", y + 1,
+                            (int)(atomic_load(&h->scanned) * 100 / h->size));
+            return false;
+        }
+    }
+    ed->cY = MIN(y - h->winFrom, ed->nRows);
+    return true;
+}
+
+// Spans for the save: the file where it is unedited, the patches where it
+// is.
+void huge_snapshot(struct editor* ed, struct savejob* j) {
+    static char eolBuf[] = "\r\n";
+    struct hugefile* h = ed->huge;
+    huge_commit(ed);
+    j->src = h->fd;
+    j->nRows = huge_lines(ed);
+
+    size_t avail;
+    size_t at = 0;
+    for (int i = 0; i < h->nPatches; i++) {
+        struct hugepatch* pt = &h->patches[i];
+        save_range(j, at, pt->fromOff - at);
+        j->total += pt->fromOff - at;
+        // lines added after a last line that has no '\n'.
+        if (pt->fromOff == h->size &&
+            *huge_chunk(h, h->size - 1, &avail) != '\n') {
+            save_span(j, eolBuf + !ed->crlf, 1 + ed->crlf);
+            j->total += 1 + ed->crlf;
+        }
+        if (pt->len > 0) {
+            save_span(j, save_copy(j, pt->text, pt->len), pt->len);
+            j->total += pt->len;
+        }
+        at = pt->toOff;
+    }
+    save_range(j, at, h->size - at);
+    j->total += h->size - at;
+}
+
+void huge_free(struct editor* ed) {
+    struct hugefile* h = ed->huge;
+    if (h == NULL) {
+        return;
+    }
+    if (h->running) {
+        pthread_mutex_lock(&h->mu);
+        atomic_store(&h->cancel, true);
+        pthread_cond_broadcast(&h->cv);
+        pthread_mutex_unlock(&h->mu);
+        huge_join(ed);
+    }
+    for (int i = 0; i < TVIM_HUGE_CHUNKS; i++) {
+        if (h->chunks[i].map != NULL) {
+            munmap(h->chunks[i].map, h->chunks[i].len);
+        }
+    }
+    for (int i = 0; i < h->nPatches; i++) {
+        free(h->patches[i].text);
+    }
+    free(h->patches);
+    for (int i = 0; i < h->nPieces; i++) {
+        free(h->pieces[i].marks);
+    }
+    free(h->pieces);
+    free(h->marks);
+    free(h->sidecar);
+    pthread_mutex_destroy(&h->mu);
+    pthread_cond_destroy(&h->cv);
+    close(h->fd);
+    free(h);
+    ed->huge = NULL;
+}
+
+/*** follow ***/
+
+// Offset of the first of the last max lines of fd, read back from its end.
+static off_t follow_tail(int fd, off_t size, int max) {
+    char buf[TVIM_READ_CHUNK];
+    int lines = 0;
+    for (off_t end = size; end > 0;) {
+        size_t n = MIN(end, (off_t)sizeof(buf));
+        off_t base = end - n;
+        if (pread(fd, buf, n, base) != (ssize_t)n) {
+            return 0;
+        }
+        char* p = buf + n;
+        while ((p = (char*)memrchr(buf, '\n', p - buf)) != NULL) {
+            off_t next = base + (p - buf) + 1;
+            // the '\n' that ends the file starts no line.
+            if (next < size && ++lines == max) {
+                return next;
+            }
+        }
+        end = base;
+    }
+    return 0;
+}
+
+// Read fd from off on, watching it in place of the file before it.
+static void follow_switch(struct editor* ed, int fd, off_t off) {
+    struct followjob* f = &ed->follow;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        crash("fstat");
+    }
+    if (f->active) {
+        inotify_rm_watch(f->inotify, f->wdFile);
+        close(f->fd);
+    }
+    f->fd = fd;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->off = off;
+    f->partial = false;
+    f->wdFile = inotify_add_watch(f->inotify, ed->filename,
+                                  IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+// Drop rows off the top down to max, keeping the cursor and the view on
+// the lines they were on.
+static void follow_trim(struct editor* ed) {
+    int n = ed->nRows - ed->follow.max;
+    if (n <= 0) {
+        return;
+    }
+    gap_flush(ed);
+    for (int i = 0; i < n; i++) {
+        row_free(ed, row_at(ed, 0));
+        rows_delete(ed, 0);
+    }
+    ed->cY = MAX(ed->cY - n, 0);
+    ed->rowOff = MAX(ed->rowOff - n, 0);
+}
+
+// Read what was appended, at most TVIM_STREAM_READ bytes of it so keys get
+// in between. Whether that got to the end of the file.
+static bool follow_read(struct editor* ed) {
+    struct followjob* f = &ed->follow;
+    char buf[TVIM_READ_CHUNK];
+    for (size_t total = 0; total < TVIM_STREAM_READ;) {
+        ssize_t n = pread(f->fd, buf, sizeof(buf), f->off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return true;
+        }
+        load_append(ed, buf, n, &f->partial, false);
+        f->off += n;
+        total += n;
+    }
+    return false;
+}
+
+// Catch up with the file: start over when it was truncated, read what was
+// appended, and once the old file is read to the end go on with a new one
+// that took its name. A file that grows faster than one read takes is read
+// on in later rounds, trimmed in between.
+static void follow_check(struct editor* ed) {
+    struct followjob* f = &ed->follow;
+    bool atEnd = ed->cY >= ed->nRows - 1;
+
+    struct stat st;
+    if (fstat(f->fd, &st) == 0 && st.st_size < f->off) {
+        f->off = 0;
+        f->partial = false;
+        tvim_set_status(ed, "\"%s\" truncated", ed->filename);
+    }
+    bool done = follow_read(ed);
+    if (done && stat(ed->filename, &st) == 0 &&
+        (st.st_dev != f->dev || st.st_ino != f->ino)) {
+        int fd = open(ed->filename, O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            follow_switch(ed, fd, 0);
+            tvim_set_status(ed, "\"%s\" replaced", ed->filename);
+            done = follow_read(ed);
+        }
+    }
+    follow_trim(ed);
+    if (!done) {
+        write(f->wake[1], "", 1);
+    }
+
+    if (atEnd && ed->tvimMode == NORMAL) {
+        ed->cY = MAX(ed->nRows - 1, 0);
+        ed->cX = 0;
+    }
+}
+
+// inotify saw the file or its directory change, or the last round left
+// some of it unread.
+static void follow_ready(struct editor* ed, int fd) {
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    follow_check(ed);
+}
+
+// Open filename and follow it as it grows, like file_open but keeping only
+// its last follow.max lines. The lines are copied, not mapped: a mapping
+// of a file that gets truncated faults.
+void follow_open(struct editor* ed, const char* filename) {
+    struct followjob* f = &ed->follow;
+    ed->filename = strdup(filename);
+    syntax_select(ed, filename);
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        crash("open");
+    }
+    f->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->inotify == -1) {
+        crash("inotify_init1");
+    }
+    const char* slash = strrchr(filename, '/');
+    char* dir = slash == NULL ? strdup(".")
+                              : strndup(filename, MAX(slash - filename, 1));
+    if (dir == NULL) {
+        crash("strdup");
+    }
+    f->wdDir = inotify_add_watch(f->inotify, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+    if (pipe2(f->wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+        crash("pipe2");
+    }
+    // watched before its size is taken, so no write goes unseen.
+    follow_switch(ed, fd, 0);
+    f->active = true;
+    watch_add(ed, f->inotify, follow_ready);
+    watch_add(ed, f->wake[0], follow_ready);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        crash("fstat");
+    }
+    f->off = follow_tail(fd, st.st_size, f->max);
+    size_t len = st.st_size - f->off;
+    if (len == 0) {
+        return;
+    }
+    char* map = (char*)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        crash("mmap");
+    }
+    size_t got = 0;
+    ssize_t n;
+    while (got < len && (n = pread(fd, map + got, len - got,
+                                   f->off + got)) > 0) {
+        got += n;
+    }
+    ed->map = map;
+    ed->mapLen = len;
+    f->off += got;
+    f->partial = got > 0 && map[got - 1] != '\n';
+    // at most max lines, and the cursor starts on the last of them.
+    file_get_lines(ed, map, got);
+    ed->cY = MAX(ed->nRows - 1, 0);
+}
+
+void follow_free(struct editor* ed) {
+    struct followjob* f = &ed->follow;
+    if (!f->active) {
+        return;
+    }
+    watch_remove(ed, f->inotify);
+    watch_remove(ed, f->wake[0]);
+    close(f->inotify);
+    close(f->wake[0]);
+    close(f->wake[1]);
+    close(f->fd);
+    f->active = false;
+}
+
+/*** regex ***/
+
+// Patterns are POSIX ERE-like: . [] [^] * + ? {m,n} | () ^ $, the escapes
+// \d \w \s and \D \W \S, and any other escaped byte stands for itself.
+// Matching is leftmost-longest, a line at a time and linear in the line: a
+// DFA of the reversed pattern runs backwards over the line and marks where
+// matches start, the forward DFA finds the longest end from a start. DFA
+// states are built lazily as bytes call for them.
+
+enum { RN_EMPTY, RN_BYTES, RN_CAT, RN_ALT, RN_REPEAT, RN_BOL, RN_EOL };
+
+struct renode {
+    int type;
+    int a; // child, or the byte set of RN_BYTES
+    int b;
+    int min;
+    int max; // -1 for no limit
+};
+
+struct reparse {
+    const char* s;
+    int len;
+    int at;
+    struct renode* nodes;
+    int n;
+    int cap;
+    struct regex* re;
+    const char* err;
+};
+
+static int re_node(struct reparse* p, int type, int a, int b) {
+    if (p->n == p->cap) {
+        p->cap = MAX(32, p->cap * 2);
+        p->nodes = (struct renode*)realloc(p->nodes,
+                                           p->cap * sizeof(struct renode));
+        if (p->nodes == NULL) {
+            crash("realloc");
+        }
+    }
+    p->nodes[p->n] = (struct renode){type, a, b, 0, 0};
+    return p->n++;
+}
+
+static int re_set(struct regex* re) {
+    re->sets = (unsigned char(*)[32])realloc(re->sets, (re->nSets + 1) * 32);
+    if (re->sets == NULL) {
+        crash("realloc");
+    }
+    memset(re->sets[re->nSets], 0, 32);
+    return re->nSets++;
+}
+
+static void re_set_add(unsigned char* set, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) {
+        set[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+static bool re_set_has(const unsigned char* set, unsigned char c) {
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+// \d \w \s and their negations into set, false for any other escape.
+static bool re_set_class(unsigned char* set, char c) {
+    unsigned char cls[32] = {0};
+    switch (tolower((unsigned char)c)) {
+    case 'd':
+        re_set_add(cls, '0', '9');
+        break;
+    case 'w':
+        re_set_add(cls, '0', '9');
+        re_set_add(cls, 'a', 'z');
+        re_set_add(cls, 'A', 'Z');
+        re_set_add(cls, '_', '_');
+        break;
+    case 's':
+        re_set_add(cls, ' ', ' ');
+        re_set_add(cls, '\t', '\r');
+        break;
+    default:
+        return false;
+    }
+    for (int i = 0; i < 32; i++) {
+        set[i] |= isupper((unsigned char)c) ? ~cls[i] : cls[i];
+    }
+    return true;
+}
+
+static int re_alt(struct reparse* p);
+
+static int re_class(struct reparse* p) {
+    int set = re_set(p->re);
+    bool negate = p->at < p->len && p->s[p->at] == '^';
+    if (negate) {
+        p->at++;
+    }
+    bool first = true;
+    while (p->at < p->len && (p->s[p->at] != ']' || first)) {
+        first = false;
+        unsigned char lo = p->s[p->at++];
+        if (lo == '\\' && p->at < p->len) {
+            lo = p->s[p->at++];
+            if (re_set_class(p->re->sets[set], lo)) {
+                continue;
+            }
+        }
+        unsigned char hi = lo;
+        if (p->at + 1 < p->len && p->s[p->at] == '-' &&
+            p->s[p->at + 1] != ']') {
+            hi = p->s[p->at + 1];
+            p->at += 2;
+            if (hi == '\\' && p->at < p->len) {
+                hi = p->s[p->at++];
+            }
+            if (hi < lo) {
+                p->err = "bad range in []";
+                return -1;
+            }
+        }
+        re_set_add(p->re->sets[set], lo, hi);
+    }
+    if (p->at == p->len) {
+        p->err = "missing ]";
+        return -1;
+    }
+    p->at++;
+    if (negate) {
+        for (int i = 0; i < 32; i++) {
+            p->re->sets[set][i] = ~p->re->sets[set][i];
+        }
+    }
+    return re_node(p, RN_BYTES, set, 0);
+}
+
+static int re_atom(struct reparse* p) {
+    char c = p->s[p->at++];
+    int set;
+    switch (c) {
+    case '(': {
+        int n = re_alt(p);
+        if (n < 0) {
+            return -1;
+        }
+        if (p->at == p->len || p->s[p->at] != ')') {
+            p->err = "missing )";
+            return -1;
+        }
+        p->at++;
+        return n;
+    }
+    case '[':
+        return re_class(p);
+    case '^':
+        return re_node(p, RN_BOL, 0, 0);
+    case '$':
+        return re_node(p, RN_EOL, 0, 0);
+    case '.':
+        set = re_set(p->re);
+        re_set_add(p->re->sets[set], 0, 255);
+        return re_node(p, RN_BYTES, set, 0);
+    case '*':
+    case '+':
+    case '?':
+        p->err = "nothing to repeat";
+        return -1;
+    case '\\':
+        if (p->at == p->len) {
+            p->err = "trailing \\";
+            return -1;
+        }
+        c = p->s[p->at++];
+        set = re_set(p->re);
+        if (!re_set_class(p->re->sets[set], c)) {
+            re_set_add(p->re->sets[set], (unsigned char)c, (unsigned char)c);
+        }
+        return re_node(p, RN_BYTES, set, 0);
+    default:
+        set = re_set(p->re);
+        re_set_add(p->re->sets[set], (unsigned char)c, (unsigned char)c);
+        return re_node(p, RN_BYTES, set, 0);
+    }
+}
+
+static int re_number(struct reparse* p) {
+    int n = -1;
+    while (p->at < p->len && isdigit((unsigned char)p->s[p->at]) && n < 1000) {
+        n = MAX(n, 0) * 10 + (p->s[p->at++] - '0');
+    }
+    return n;
+}
+
+static int re_repeat(struct reparse* p) {
+    int n = re_atom(p);
+    while (n >= 0 && p->at < p->len) {
+        int min, max;
+        char c = p->s[p->at];
+        if (c == '*') {
+            min = 0, max = -1;
+        } else if (c == '+') {
+            min = 1, max = -1;
+        } else if (c == '?') {
+            min = 0, max = 1;
+        } else if (c == '{') {
+            p->at++;
+            min = re_number(p);
+            max = min;
+            if (p->at < p->len && p->s[p->at] == ',') {
+                p->at++;
+                max = re_number(p);
+            }
+            if (min < 0 || p->at == p->len || p->s[p->at] != '}' ||
+                (max >= 0 && max < min) || MAX(min, max) > 255) {
+                p->err = "bad {m,n}";
+                return -1;
+            }
+        } else {
+            break;
+        }
+        p->at++;
+        int r = re_node(p, RN_REPEAT, n, 0);
+        p->nodes[r].min = min;
+        p->nodes[r].max = max;
+        n = r;
+    }
+    return n;
+}
+
+static int re_cat(struct reparse* p) {
+    int n = re_node(p, RN_EMPTY, 0, 0);
+    while (p->at < p->len && p->s[p->at] != '|' && p->s[p->at] != ')') {
+        int r = re_repeat(p);
+        if (r < 0) {
+            return -1;
+        }
+        n = p->nodes[n].type == RN_EMPTY ? r : re_node(p, RN_CAT, n, r);
+    }
+    return n;
+}
+
+static int re_alt(struct reparse* p) {
+    int n = re_cat(p);
+    while (n >= 0 && p->at < p->len && p->s[p->at] == '|') {
+        p->at++;
+        int r = re_cat(p);
+        if (r < 0) {
+            return -1;
+        }
+        n = re_node(p, RN_ALT, n, r);
+    }
+    return n;
+}
+
+static int re_emit(struct regex* re, struct reprog* prog, int op, int x,
+                   int y) {
+    if (prog->n == TVIM_REGEX_INSTS) {
+        re->tooBig = true;
+        return prog->n - 1;
+    }
+    if (prog->n == prog->cap) {
+        prog->cap = MAX(64, prog->cap * 2);
+        prog->inst = (struct reinst*)realloc(prog->inst,
+                                             prog->cap * sizeof(struct reinst));
+        if (prog->inst == NULL) {
+            crash("realloc");
+        }
+    }
+    prog->inst[prog->n] = (struct reinst){op, x, y};
+    return prog->n++;
+}
+
+// Thompson construction of node into prog, back to front when rev.
+static void re_compile(struct reparse* p, struct reprog* prog, int node,
+                       bool rev) {
+    struct renode* n = &p->nodes[node];
+    struct regex* re = p->re;
+    int split, jmp;
+    switch (n->type) {
+    case RN_BYTES:
+        re_emit(re, prog, RE_BYTES, n->a, 0);
+        break;
+    case RN_BOL:
+        re_emit(re, prog, rev ? RE_EOL : RE_BOL, 0, 0);
+        break;
+    case RN_EOL:
+        re_emit(re, prog, rev ? RE_BOL : RE_EOL, 0, 0);
+        break;
+    case RN_CAT:
+        re_compile(p, prog, rev ? n->b : n->a, rev);
+        re_compile(p, prog, rev ? n->a : n->b, rev);
+        break;
+    case RN_ALT:
+        split = re_emit(re, prog, RE_SPLIT, prog->n + 1, 0);
+        re_compile(p, prog, n->a, rev);
+        jmp = re_emit(re, prog, RE_JMP, 0, 0);
+        prog->inst[split].y = prog->n;
+        re_compile(p, prog, n->b, rev);
+        prog->inst[jmp].x = prog->n;
+        break;
+    case RN_REPEAT: {
+        int min = n->min, max = n->max, a = n->a;
+        for (int i = 0; i < min && !re->tooBig; i++) {
+            re_compile(p, prog, a, rev);
+        }
+        if (max < 0) {
+            split = re_emit(re, prog, RE_SPLIT, prog->n + 1, 0);
+            re_compile(p, prog, a, rev);
+            re_emit(re, prog, RE_JMP, split, 0);
+            prog->inst[split].y = prog->n;
+        }
+        for (int i = min; i < max && !re->tooBig; i++) {
+            split = re_emit(re, prog, RE_SPLIT, prog->n + 1, 0);
+            re_compile(p, prog, a, rev);
+            prog->inst[split].y = prog->n;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Append the literal every match of node starts with to re->prefix.
+// Returns whether the literal runs to the end of node, clearing *literal
+// when node holds more than the literal.
+static bool re_prefix(struct reparse* p, int node, bool* literal) {
+    struct renode* n = &p->nodes[node];
+    struct regex* re = p->re;
+    if (n->type == RN_CAT) {
+        return re_prefix(p, n->a, literal) && re_prefix(p, n->b, literal);
+    }
+    if (n->type == RN_EMPTY) {
+        return true;
+    }
+    if (n->type == RN_BOL || n->type == RN_EOL) {
+        *literal = false;
+        return true;
+    }
+    if (n->type != RN_BYTES) {
+        *literal = false;
+        return false;
+    }
+    int only = -1;
+    for (int c = 0; c < 256; c++) {
+        if (re_set_has(re->sets[n->a], c)) {
+            if (only >= 0) {
+                *literal = false;
+                return false;
+            }
+            only = c;
+        }
+    }
+    re->prefix[re->prefixLen++] = only;
+    return true;
+}
+
+// Compile s[0..len). On a bad pattern returns NULL with *err saying why.
+struct regex* regex_compile(const char* s, int len, const char** err) {
+    struct regex* re = (struct regex*)calloc(1, sizeof(struct regex));
+    if (re == NULL) {
+        crash("calloc");
+    }
+    struct reparse p = {s, len, 0, NULL, 0, 0, re, NULL};
+    int root = re_alt(&p);
+    if (root >= 0 && p.at < len) {
+        p.err = "unmatched )";
+    }
+    if (p.err != NULL) {
+        free(p.nodes);
+        regex_free(re);
+        *err = p.err;
+        return NULL;
+    }
+
+    re->prefix = (char*)malloc(len + 1);
+    if (re->prefix == NULL) {
+        crash("malloc");
+    }
+    bool literal = true;
+    re_prefix(&p, root, &literal);
+    re->literal = literal && re->prefixLen > 0;
+
+    re_compile(&p, &re->fwd, root, false);
+    re_emit(re, &re->fwd, RE_MATCH, 0, 0);
+    re_compile(&p, &re->rev, root, true);
+    re_emit(re, &re->rev, RE_MATCH, 0, 0);
+    free(p.nodes);
+    if (re->tooBig) {
+        regex_free(re);
+        *err = "pattern too big";
+        return NULL;
+    }
+    return re;
+}
+
+void regex_free(struct regex* re) {
+    if (re == NULL) {
+        return;
+    }
+    free(re->fwd.inst);
+    free(re->rev.inst);
+    free(re->sets);
+    free(re->prefix);
+    free(re);
+}
+
+// Add what pc leads to without reading a byte to d->set: byte reads, the
+// match and, unless eol, pending end-of-line checks.
+static void dfa_closure(struct dfa* d, int pc, bool bol, bool eol) {
+    int top = 0;
+    d->stack[top++] = pc;
+    while (top > 0) {
+        pc = d->stack[--top];
+        if (d->mark[pc] == d->gen) {
+            continue;
+        }
+        d->mark[pc] = d->gen;
+        struct reinst* in = &d->prog->inst[pc];
+        switch (in->op) {
+        case RE_SPLIT:
+            d->stack[top++] = in->y;
+            d->stack[top++] = in->x;
+            break;
+        case RE_JMP:
+            d->stack[top++] = in->x;
+            break;
+        case RE_BOL:
+            if (bol) {
+                d->stack[top++] = pc + 1;
+            }
+            break;
+        case RE_EOL:
+            if (eol) {
+                d->stack[top++] = pc + 1;
+            } else {
+                d->set[d->nSet++] = pc;
+            }
+            break;
+        default:
+            d->set[d->nSet++] = pc;
+            break;
+        }
+    }
+}
+
+static int dfa_cmp(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+static void dfa_flush(struct dfa* d) {
+    for (int i = 0; i < d->tableCap; i++) {
+        dstate_t* s = d->table[i];
+        while (s != NULL) {
+            dstate_t* next = s->chain;
+            free(s);
+            s = next;
+        }
+        d->table[i] = NULL;
+    }
+    d->nStates = 0;
+    d->start[0] = d->start[1] = NULL;
+}
+
+// The state for the pcs in d->set, made if it is new. A full cache is
+// thrown away first, which leaves every other state pointer dangling.
+static dstate_t* dfa_state(struct dfa* d, bool* flushed) {
+    qsort(d->set, d->nSet, sizeof(int), dfa_cmp);
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < d->nSet; i++) {
+        hash = (hash ^ d->set[i]) * 16777619u;
+    }
+
+    dstate_t** bucket = &d->table[hash & (d->tableCap - 1)];
+    for (dstate_t* s = *bucket; s != NULL; s = s->chain) {
+        if (s->hash == hash && s->n == d->nSet &&
+            memcmp(s->pcs, d->set, d->nSet * sizeof(int)) == 0) {
+            return s;
+        }
+    }
+
+    if (d->nStates == TVIM_REGEX_STATES) {
+        dfa_flush(d);
+        *flushed = true;
+    }
+    dstate_t* s =
+        (dstate_t*)calloc(1, sizeof(dstate_t) + d->nSet * sizeof(int));
+    if (s == NULL) {
+        crash("calloc");
+    }
+    s->hash = hash;
+    s->n = d->nSet;
+    memcpy(s->pcs, d->set, d->nSet * sizeof(int));
+    s->chain = *bucket;
+    *bucket = s;
+    d->nStates++;
+
+    // d->set is reused below to follow the end-of-line checks.
+    d->gen++;
+    d->nSet = 0;
+    for (int i = 0; i < s->n; i++) {
+        int op = d->prog->inst[s->pcs[i]].op;
+        s->match |= op == RE_MATCH;
+        if (op == RE_EOL) {
+            dfa_closure(d, s->pcs[i] + 1, false, true);
+        }
+    }
+    for (int i = 0; i < d->nSet; i++) {
+        s->eolMatch |= d->prog->inst[d->set[i]].op == RE_MATCH;
+    }
+    s->eolMatch |= s->match;
+    return s;
+}
+
+// Whether the pattern matches an empty line, where both ^ and $ hold.
+static bool dfa_empty_line(struct dfa* d) {
+    d->gen++;
+    d->nSet = 0;
+    dfa_closure(d, 0, true, true);
+    for (int i = 0; i < d->nSet; i++) {
+        if (d->prog->inst[d->set[i]].op == RE_MATCH) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static dstate_t* dfa_start(struct dfa* d, bool bol) {
+    if (d->start[bol] == NULL) {
+        bool flushed = false;
+        d->gen++;
+        d->nSet = 0;
+        dfa_closure(d, 0, bol, false);
+        dstate_t* s = dfa_state(d, &flushed);
+        d->start[bol] = s;
+    }
+    return d->start[bol];
+}
+
+static dstate_t* dfa_step(struct dfa* d, dstate_t* s, unsigned char c) {
+    if (s->next[c] != NULL) {
+        return s->next[c];
+    }
+    d->gen++;
+    d->nSet = 0;
+    for (int i = 0; i < s->n; i++) {
+        struct reinst* in = &d->prog->inst[s->pcs[i]];
+        if (in->op == RE_BYTES && re_set_has(d->re->sets[in->x], c)) {
+            dfa_closure(d, s->pcs[i] + 1, false, false);
+        }
+    }
+    if (d->unanchored) {
+        dfa_closure(d, 0, false, false);
+    }
+    bool flushed = false;
+    dstate_t* t = dfa_state(d, &flushed);
+    if (!flushed) {
+        s->next[c] = t;
+    }
+    return t;
+}
+
+static void dfa_init(struct dfa* d, struct regex* re, struct reprog* prog,
+                     bool unanchored) {
+    *d = (struct dfa){0};
+    d->re = re;
+    d->prog = prog;
+    d->unanchored = unanchored;
+    d->tableCap = 1024;
+    d->table = (dstate_t**)calloc(d->tableCap, sizeof(dstate_t*));
+    d->stack = (int*)malloc((prog->n * 2 + 1) * sizeof(int));
+    d->mark = (unsigned*)calloc(prog->n, sizeof(unsigned));
+    d->set = (int*)malloc(prog->n * sizeof(int));
+    if (d->table == NULL || d->stack == NULL || d->mark == NULL ||
+        d->set == NULL) {
+        crash("malloc");
+    }
+}
+
+static void dfa_free(struct dfa* d) {
+    if (d->table != NULL) {
+        dfa_flush(d);
+    }
+    free(d->table);
+    free(d->stack);
+    free(d->mark);
+    free(d->set);
+}
+
+// Matching state for re. Each thread matching re needs its own.
+void rematch_init(struct rematch* m, struct regex* re) {
+    m->re = re;
+    dfa_init(&m->fwd, re, &re->fwd, false);
+    dfa_init(&m->rev, re, &re->rev, true);
+    m->s = NULL;
+    m->len = 0;
+    m->starts = NULL;
+    m->startsCap = 0;
+}
+
+void rematch_free(struct rematch* m) {
+    dfa_free(&m->fwd);
+    dfa_free(&m->rev);
+    free(m->starts);
+    m->starts = NULL;
+}
+
+// Get ready to match in the line s[0..len), which has to stay put until the
+// next regex_line. Returns false when nothing in it can match.
+bool regex_line(struct rematch* m, const char* s, int len) {
+    m->s = s;
+    m->len = len;
+    if (m->startsCap < len + 1) {
+        m->startsCap = MAX(len + 1, m->startsCap * 2);
+        m->starts = (unsigned char*)realloc(m->starts, m->startsCap);
+        if (m->starts == NULL) {
+            crash("realloc");
+        }
+    }
+
+    struct regex* re = m->re;
+    if (re->prefixLen > 0 &&
+        search_find(s, len, re->prefix, re->prefixLen) == NULL) {
+        memset(m->starts, 0, len + 1);
+        return false;
+    }
+
+    // the reversed pattern reads the line from its end, where a $ holds.
+    struct dfa* d = &m->rev;
+    dstate_t* st = dfa_start(d, true);
+    m->starts[len] = len == 0 ? dfa_empty_line(d) : st->match;
+    bool any = m->starts[len];
+    for (int i = len - 1; i >= 0; i--) {
+        st = dfa_step(d, st, s[i]);
+        m->starts[i] = st->match || (i == 0 && st->eolMatch);
+        any |= m->starts[i];
+    }
+    return any;
+}
+
+// Leftmost-longest match in the current line starting at or after from.
+bool regex_next(struct rematch* m, int from, int* start, int* end) {
+    if (from > m->len) {
+        return false;
+    }
+    unsigned char* at =
+        (unsigned char*)memchr(&m->starts[from], 1, m->len + 1 - from);
+    if (at == NULL) {
+        return false;
+    }
+
+    struct dfa* d = &m->fwd;
+    int i = at - m->starts;
+    *start = i;
+    if (m->len == 0) {
+        *end = 0;
+        return true;
+    }
+    dstate_t* st = dfa_start(d, i == 0);
+    *end = st->match ? i : -1;
+    while (i < m->len) {
+        st = dfa_step(d, st, m->s[i++]);
+        if (st->n == 0) {
+            break;
+        }
+        if (st->match) {
+            *end = i;
+        }
+    }
+    if (i == m->len && st->eolMatch) {
+        *end = i;
+    }
+    return *end >= 0;
+}
+
+/*** search ***/
+
+// Substring kernels. A position is a candidate when both the first and the
+// last byte of the pattern line up with it, which is checked a vector of
+// positions at a time; only candidates get a memcmp.
+
+static const char* find_scalar(const char* s, size_t len, const char* p,
+                               size_t m) {
+    if (m == 1) {
+        return (const char*)memchr(s, p[0], len);
+    }
+    return (const char*)memmem(s, len, p, m);
+}
+
+#if defined(__x86_64__)
+static const char* find_sse2(const char* s, size_t len, const char* p,
+                             size_t m) {
+    if (m < 2 || len < m) {
+        return find_scalar(s, len, p, m);
+    }
+    __m128i first = _mm_set1_epi8(p[0]);
+    __m128i last = _mm_set1_epi8(p[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0) {
+                return s + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(s + i, len - i, p, m);
+}
+
+__attribute__((target("avx2"))) static const char*
+find_avx2(const char* s, size_t len, const char* p, size_t m) {
+    if (m < 2 || len < m) {
+        return find_scalar(s, len, p, m);
+    }
+    __m256i first = _mm256_set1_epi8(p[0]);
+    __m256i last = _mm256_set1_epi8(p[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0) {
+                return s + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_sse2(s + i, len - i, p, m);
+}
+#endif
+
+static const char* (*search_kernel)(const char*, size_t, const char*,
+                                     size_t);
+
+// Use the widest kernel the CPU has. Done before any search thread starts.
+static void search_pick_kernel() {
+    if (search_kernel != NULL) {
+        return;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    search_kernel = __builtin_cpu_supports("avx2") ? find_avx2 : find_sse2;
+#else
+    search_kernel = find_scalar;
+#endif
+}
+
+// First occurrence of p[0..m) in s[0..len), or NULL.
+const char* search_find(const char* s, size_t len, const char* p, size_t m) {
+    search_pick_kernel();
+    return search_kernel(s, len, p, m);
+}
+
+static bool pos_before(struct searchpos a, struct searchpos b) {
+    return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+static void search_hit(struct searchjob* s, struct searchchunk* c, int y,
+                       int x) {
+    struct searchpos pos = {y, x};
+    c->count++;
+    if (c->first.y < 0) {
+        c->first = pos;
+    }
+    c->last = pos;
+    if (pos_before(pos, s->from)) {
+        c->nBelow++;
+        c->beforeLast = pos;
+    }
+    if (!pos_before(s->from, pos)) {
+        c->nUpTo++;
+    } else if (c->afterFirst.y < 0) {
+        c->afterFirst = pos;
+    }
+}
+
+static void search_row(struct searchjob* s, struct searchchunk* c,
+                       struct rematch* m, row_t* row, int y) {
+    if (!regex_line(m, row->chars, row->len)) {
+        return;
+    }
+    int from = 0;
+    int start, end;
+    while (regex_next(m, from, &start, &end)) {
+        search_hit(s, c, y, start);
+        from = MAX(end, start + 1);
+    }
+}
+
+// Scan rows[0..n), which start at row y and lie back to back in memory with
+// only line endings between them. The pattern never holds a line ending,
+// so the whole stretch goes through the kernel in one call. A regex with a
+// literal prefix only looks at the rows the kernel finds the prefix in.
+static void search_stretch(struct searchjob* s, struct searchchunk* c,
+                           struct rematch* m, row_t* rows, int n, int y) {
+    struct regex* re = s->re;
+    if (!re->literal && re->prefixLen == 0) {
+        for (int r = 0; r < n; r++) {
+            search_row(s, c, m, &rows[r], y + r);
+        }
+        return;
+    }
+
+    const char* p = rows[0].chars;
+    const char* end = rows[n - 1].chars + rows[n - 1].len;
+    const char* hit;
+    int r = 0;
+    while (p < end && (hit = search_kernel(p, end - p, re->prefix,
+                                           re->prefixLen)) != NULL) {
+        while (hit >= rows[r].chars + rows[r].len) {
+            r++;
+        }
+        if (re->literal) {
+            search_hit(s, c, y + r, hit - rows[r].chars);
+            p = hit + re->prefixLen;
+        } else {
+            search_row(s, c, m, &rows[r], y + r);
+            p = rows[r].chars + rows[r].len;
+        }
+    }
+}
+
+// next starts right behind end's line ending, as mapped rows do.
+static bool search_adjacent(const char* end, const char* next) {
+    return (next == end + 1 && end[0] == '\n') ||
+           (next == end + 2 && end[0] == '\r' && end[1] == '\n');
+}
+
+static void search_chunk(struct editor* ed, struct searchjob* s,
+                         struct searchchunk* c, struct rematch* m,
+                         struct abuf* tmp) {
+    struct gapline* g = &ed->gap;
+    int a = c->y;
+    int b = MIN(a + TVIM_SEARCH_CHUNK, s->nRows);
+    int run;
+    for (int y = a; y < b; y += run) {
+        row_t* rows = row_run(ed, y, &run);
+        run = MIN(run, b - y);
+        int r = 0;
+        while (r < run) {
+            if (g->active && g->y == y + r) {
+                // the row being typed on has a hole in it, scan it closed.
+                tmp->len = 0;
+                ab_append(tmp, g->buf, g->gapStart);
+                ab_append(tmp, &g->buf[g->gapEnd], g->cap - g->gapEnd);
+                row_t row = rows[r];
+                row.chars = tmp->buf;
+                row.len = tmp->len;
+                search_stretch(s, c, m, &row, 1, y + r);
+                r++;
+                continue;
+            }
+            int e = r + 1;
+            while (e < run && !(g->active && g->y == y + e) &&
+                   search_adjacent(rows[e - 1].chars + rows[e - 1].len,
+                                   rows[e].chars)) {
+                e++;
+            }
+            search_stretch(s, c, m, &rows[r], e - r, y + r);
+            r = e;
+        }
+    }
+}
+
+// The k-th chunk to scan, going out from the cursor in the search
+// direction and wrapping around.
+static int search_order(struct searchjob* s, int k) {
+    int cc = s->from.y / TVIM_SEARCH_CHUNK;
+    int n = s->nChunks;
+    return s->dir > 0 ? (cc + k) % n : ((cc - k) % n + n) % n;
+}
+
+// Search threads take chunks in search order and scan them under the read
+// side of the buffer lock. An edit between two chunks makes the job stale.
+static void* search_worker(void* arg) {
+    struct searchjob* s = (struct searchjob*)arg;
+    struct editor* ed = s->ed;
+    struct abuf tmp = ab_init();
+    struct rematch m;
+    rematch_init(&m, s->re);
+    while (!atomic_load(&s->cancel)) {
+        int k = atomic_fetch_add(&s->next, 1);
+        if (k >= s->nChunks) {
+            break;
+        }
+        struct searchchunk* c = &s->chunks[search_order(s, k)];
+
+        pthread_rwlock_rdlock(&ed->lock);
+        bool stale = ed->version != s->version;
+        if (!stale) {
+            search_chunk(ed, s, c, &m, &tmp);
+        }
+        pthread_rwlock_unlock(&ed->lock);
+        if (stale) {
+            atomic_store(&s->stale, true);
+            break;
+        }
+
+        pthread_mutex_lock(&s->mu);
+        c->done = true;
+        pthread_cond_broadcast(&s->cv);
+        pthread_mutex_unlock(&s->mu);
+    }
+    ab_free(&tmp);
+    rematch_free(&m);
+
+    pthread_mutex_lock(&s->mu);
+    bool last = --s->live == 0;
+    pthread_cond_broadcast(&s->cv);
+    pthread_mutex_unlock(&s->mu);
+    if (last) {
+        write(s->wake[1], "", 1);
+    }
+    return NULL;
+}
+
+// Where the search lands and which match that is, counting from the top.
+// False while a chunk that decides it is still being scanned. The index is
+// only right once every chunk is done.
+static bool search_answer(struct searchjob* s, bool* found,
+                          struct searchpos* pos, int* index) {
+    *found = false;
+    if (s->nChunks == 0) {
+        return true;
+    }
+    for (int k = 0; k <= s->nChunks; k++) {
+        int ch = search_order(s, k % s->nChunks);
+        struct searchchunk* c = &s->chunks[ch];
+        if (!c->done) {
+            return false;
+        }
+
+        // past the last chunk the search wraps back into the cursor's.
+        struct searchpos p = {-1, -1};
+        int rank = 0;
+        if (s->dir > 0 && k < s->nChunks && c->afterFirst.y >= 0) {
+            p = c->afterFirst;
+            rank = c->nUpTo + 1;
+        } else if (s->dir < 0 && k < s->nChunks && c->beforeLast.y >= 0) {
+            p = c->beforeLast;
+            rank = c->nBelow;
+        } else if (k > 0) {
+            p = s->dir > 0 ? c->first : c->last;
+            rank = s->dir > 0 ? 1 : c->count;
+        }
+        if (p.y < 0) {
+            continue;
+        }
+
+        *found = true;
+        *pos = p;
+        *index = rank;
+        for (int i = 0; i < ch; i++) {
+            *index += s->chunks[i].count;
+        }
+        return true;
+    }
+    return true;
+}
+
+static void search_ready(struct editor* ed, int fd);
+
+// Start scanning the buffer from the cursor on the search threads.
+static void search_launch(struct editor* ed, int dir) {
+    struct searchjob* s = &ed->search;
+    s->ed = ed;
+    s->dir = dir;
+    s->from = (struct searchpos){ed->cY, ed->cX};
+    s->nRows = ed->nRows;
+    s->version = ed->version;
+    s->nChunks = (s->nRows + TVIM_SEARCH_CHUNK - 1) / TVIM_SEARCH_CHUNK;
+    if (s->nChunks == 0) {
+        return;
+    }
+
+    s->chunks = (struct searchchunk*)realloc(
+        s->chunks, s->nChunks * sizeof(struct searchchunk));
+    if (s->chunks == NULL) {
+        crash("realloc");
+    }
+    for (int i = 0; i < s->nChunks; i++) {
+        struct searchpos none = {-1, -1};
+        s->chunks[i] = (struct searchchunk){0};
+        s->chunks[i].y = i * TVIM_SEARCH_CHUNK;
+        s->chunks[i].first = s->chunks[i].last = none;
+        s->chunks[i].afterFirst = s->chunks[i].beforeLast = none;
+    }
+
+    search_pick_kernel();
+    if (!s->piped) {
+        if (pipe2(s->wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+            crash("pipe2");
+        }
+        pthread_mutex_init(&s->mu, NULL);
+        pthread_cond_init(&s->cv, NULL);
+        s->piped = true;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    s->nThreads = MIN(MIN(MAX(cpus, 1), TVIM_SEARCH_THREADS), s->nChunks);
+    s->live = s->nThreads;
+    atomic_store(&s->next, 0);
+    atomic_store(&s->cancel, false);
+    atomic_store(&s->stale, false);
+    for (int i = 0; i < s->nThreads; i++) {
+        if (pthread_create(&s->threads[i], NULL, search_worker, s) != 0) {
+            crash("pthread_create");
+        }
+    }
+    s->running = true;
+    watch_add(ed, s->wake[0], search_ready);
+}
+
+// Let the threads go and wait for them, stopping them first when cancel.
+static void search_join(struct editor* ed, bool cancel) {
+    struct searchjob* s = &ed->search;
+    if (!s->running) {
+        return;
+    }
+    if (cancel) {
+        atomic_store(&s->cancel, true);
+    }
+    bool held = tvim_unlock(ed);
+    for (int i = 0; i < s->nThreads; i++) {
+        pthread_join(s->threads[i], NULL);
+    }
+    if (held) {
+        tvim_lock(ed);
+    }
+
+    char buf[16];
+    while (read(s->wake[0], buf, sizeof(buf)) > 0) {
+    }
+    watch_remove(ed, s->wake[0]);
+    s->running = false;
+}
+
+// Every chunk has been scanned: put the match count on the status bar, or
+// count again if the buffer changed underneath.
+static void search_ready(struct editor* ed, int fd) {
+    UNUSED(fd);
+    struct searchjob* s = &ed->search;
+    search_join(ed, false);
+    if (atomic_load(&s->stale)) {
+        s->landed = false;
+        search_launch(ed, s->dir);
+        return;
+    }
+
+    int total = 0;
+    for (int i = 0; i < s->nChunks; i++) {
+        total += s->chunks[i].count;
+    }
+    bool found;
+    struct searchpos pos;
+    int index;
+    search_answer(s, &found, &pos, &index);
+    if (s->landed && found) {
+        tvim_set_status(ed, "%s/%.*s [%d/%d]", s->wrapped ? "W " : "",
+                        s->patLen, s->pat, index, total);
+    } else if (total > 0) {
+        tvim_set_status(ed, "/%.*s [%d matches]", s->patLen, s->pat, total);
+    }
+}
+
+// Move to the next match of the last pattern, dir 1 forwards and -1
+// backwards, wrapping around the ends. Only the chunks up to the match are
+// waited for, the rest is counted in the background.
+void search_run(struct editor* ed, int dir) {
+    struct searchjob* s = &ed->search;
+    if (s->pat == NULL) {
+        tvim_set_status(ed, "no previous pattern");
+        return;
+    }
+    search_join(ed, true);
+    gap_flush(ed);
+    search_launch(ed, dir);
+
+    bool found = false;
+    struct searchpos pos;
+    int index;
+    if (s->running) {
+        bool held = tvim_unlock(ed);
+        pthread_mutex_lock(&s->mu);
+        while (!search_answer(s, &found, &pos, &index) && s->live > 0) {
+            pthread_cond_wait(&s->cv, &s->mu);
+        }
+        pthread_mutex_unlock(&s->mu);
+        if (held) {
+            tvim_lock(ed);
+        }
+    }
+
+    s->landed = found;
+    if (!found) {
+        tvim_set_status(ed, "Pattern not found: %.*s", s->patLen, s->pat);
+        return;
+    }
+    s->wrapped = dir > 0 ? !pos_before(s->from, pos)
+                         : !pos_before(pos, s->from);
+    ed->cY = pos.y;
+    ed->cX = pos.x;
+    tvim_set_status(ed, "%s/%.*s", s->wrapped ? "W " : "", s->patLen, s->pat);
+}
+
+// Make s, compiled to re, the pattern n and N look for.
+static void search_set(struct editor* ed, const char* s, int len,
+                       struct regex* re) {
+    struct searchjob* job = &ed->search;
+    search_join(ed, true);
+    regex_free(job->re);
+    job->re = re;
+    free(job->pat);
+    job->pat = (char*)malloc(len + 1);
+    if (job->pat == NULL) {
+        crash("malloc");
+    }
+    memcpy(job->pat, s, len);
+    job->pat[len] = '\0';
+    job->patLen = len;
+}
+
+// Search for the regex s[0..len) from the cursor, it becomes the pattern n
+// and N repeat.
+void search_start(struct editor* ed, const char* s, int len) {
+    const char* err;
+    struct regex* re = regex_compile(s, len, &err);
+    if (re == NULL) {
+        tvim_set_status(ed, "bad pattern: %s", err);
+        return;
+    }
+    search_set(ed, s, len, re);
+    search_run(ed, 1);
+}
+
+void search_free(struct editor* ed) {
+    struct searchjob* s = &ed->search;
+    search_join(ed, true);
+    free(s->pat);
+    s->pat = NULL;
+    regex_free(s->re);
+    s->re = NULL;
+    free(s->chunks);
+    s->chunks = NULL;
+    if (s->piped) {
+        close(s->wake[0]);
+        close(s->wake[1]);
+        pthread_mutex_destroy(&s->mu);
+        pthread_cond_destroy(&s->cv);
+        s->piped = false;
+    }
+}
+
+/*** substitute ***/
+
+// :s finds matches on up to TVIM_SEARCH_THREADS threads, a chunk of rows
+// at a time. Each thread builds every new row in one arena allocation and
+// only records it; the UI thread then swaps them all in at once.
+
+// Split rep into the bytes it inserts and where in them the match goes.
+// & stands for the match, \t for a tab and \ takes any other byte as is.
+static void subst_parse(struct substjob* j, const char* rep, int len) {
+    j->rep = (char*)malloc(len + 1);
+    j->amps = (int*)malloc((len + 1) * sizeof(int));
+    if (j->rep == NULL || j->amps == NULL) {
+        crash("malloc");
+    }
+    j->repLen = 0;
+    j->nAmps = 0;
+    for (int i = 0; i < len; i++) {
+        char c = rep[i];
+        if (c == '&') {
+            j->amps[j->nAmps++] = j->repLen;
+            continue;
+        }
+        if (c == '\\' && i + 1 < len) {
+            c = rep[++i];
+            if (c == 't') {
+                c = '\t';
+            }
+        }
+        j->rep[j->repLen++] = c;
+    }
+}
+
+static void subst_span(struct substthread* t, int start, int end) {
+    if (t->nSpans + 2 > t->spanCap) {
+        t->spanCap = MAX(64, t->spanCap * 2);
+        t->spans = (int*)realloc(t->spans, t->spanCap * sizeof(int));
+        if (t->spans == NULL) {
+            crash("realloc");
+        }
+    }
+    t->spans[t->nSpans++] = start;
+    t->spans[t->nSpans++] = end;
+}
+
+// Build the row's new text if the pattern matches it. Like vim, an empty
+// match right behind the previous match is not replaced.
+static void subst_row(struct substthread* t, struct substchunk* c,
+                      row_t* row, int y) {
+    struct substjob* j = t->job;
+    struct regex* re = j->re;
+    t->nSpans = 0;
+    int start, end;
+    size_t len = row->len;
+    if (re->literal && re->prefixLen > 0) {
+        // the kernel finds every match of a literal by itself.
+        const char* p = row->chars;
+        const char* e = row->chars + row->len;
+        const char* hit;
+        while (p < e && (hit = search_kernel(p, e - p, re->prefix,
+                                             re->prefixLen)) != NULL) {
+            start = hit - row->chars;
+            subst_span(t, start, start + re->prefixLen);
+            len += j->repLen + (size_t)(j->nAmps - 1) * re->prefixLen;
+            p = hit + re->prefixLen;
+            if (!j->global) {
+                break;
+            }
+        }
+    } else if (regex_line(&t->m, row->chars, row->len)) {
+        int from = 0;
+        int last = -1;
+        while (regex_next(&t->m, from, &start, &end)) {
+            from = MAX(end, start + 1);
+            if (end == start && start == last) {
+                continue;
+            }
+            subst_span(t, start, end);
+            len += j->repLen + (size_t)(j->nAmps - 1) * (end - start);
+            last = end;
+            if (!j->global) {
+                break;
+            }
+        }
+    }
+    if (t->nSpans == 0) {
+        return;
+    }
+    if (len > INT_MAX - 1) {
+        errno = EOVERFLOW;
+        crash("subst_row");
+    }
+
+    char* out = (char*)arena_alloc(&t->arena, len + 1);
+    char* o = out;
+    int at = 0;
+    for (int s = 0; s < t->nSpans; s += 2) {
+        start = t->spans[s];
+        end = t->spans[s + 1];
+        memcpy(o, &row->chars[at], start - at);
+        o += start - at;
+        int r = 0;
+        for (int a = 0; a < j->nAmps; a++) {
+            memcpy(o, &j->rep[r], j->amps[a] - r);
+            o += j->amps[a] - r;
+            memcpy(o, &row->chars[start], end - start);
+            o += end - start;
+            r = j->amps[a];
+        }
+        memcpy(o, &j->rep[r], j->repLen - r);
+        o += j->repLen - r;
+        at = end;
+    }
+    memcpy(o, &row->chars[at], row->len - at);
+    out[len] = '\0';
+
+    if (c->nEdits == c->editCap) {
+        c->editCap = MAX(16, c->editCap * 2);
+        c->edits = (struct substedit*)realloc(
+            c->edits, c->editCap * sizeof(struct substedit));
+        if (c->edits == NULL) {
+            crash("realloc");
+        }
+    }
+    c->edits[c->nEdits++] = (struct substedit){y, (int)len, out};
+    c->count += t->nSpans / 2;
+}
+
+// Rows [0..n) lie back to back in memory as in search_stretch. With a
+// literal prefix only the rows the kernel finds it in are matched.
+static void subst_stretch(struct substthread* t, struct substchunk* c,
+                          row_t* rows, int n, int y) {
+    struct regex* re = t->job->re;
+    if (re->prefixLen == 0) {
+        for (int r = 0; r < n; r++) {
+            subst_row(t, c, &rows[r], y + r);
+        }
+        return;
+    }
+
+    const char* p = rows[0].chars;
+    const char* end = rows[n - 1].chars + rows[n - 1].len;
+    const char* hit;
+    int r = 0;
+    while (p < end && (hit = search_kernel(p, end - p, re->prefix,
+                                           re->prefixLen)) != NULL) {
+        while (hit >= rows[r].chars + rows[r].len) {
+            r++;
+        }
+        subst_row(t, c, &rows[r], y + r);
+        p = rows[r].chars + rows[r].len;
+    }
+}
+
+static void* subst_worker(void* arg) {
+    struct substthread* t = (struct substthread*)arg;
+    struct substjob* j = t->job;
+    struct editor* ed = j->ed;
+    rematch_init(&t->m, j->re);
+    int k;
+    while ((k = atomic_fetch_add(&j->next, 1)) < j->nChunks) {
+        struct substchunk* c = &j->chunks[k];
+        int a = j->from + k * TVIM_SEARCH_CHUNK;
+        int b = MIN(a + TVIM_SEARCH_CHUNK, j->to);
+        int run;
+        for (int y = a; y < b; y += run) {
+            row_t* rows = row_run(ed, y, &run);
+            run = MIN(run, b - y);
+            int r = 0;
+            while (r < run) {
+                int e = r + 1;
+                while (e < run &&
+                       search_adjacent(rows[e - 1].chars + rows[e - 1].len,
+                                       rows[e].chars)) {
+                    e++;
+                }
+                subst_stretch(t, c, &rows[r], e - r, y + r);
+                r = e;
+            }
+        }
+    }
+    rematch_free(&t->m);
+    free(t->spans);
+    return NULL;
+}
+
+// Swap the rebuilt rows in, in row order, and hand their arenas over to
+// the buffer's. Returns the last row changed.
+static int subst_commit(struct editor* ed, struct substjob* j) {
+    row_t* rows = NULL;
+    int base = 0;
+    int run = 0;
+    int lastY = -1;
+    for (int k = 0; k < j->nChunks; k++) {
+        struct substchunk* c = &j->chunks[k];
+        for (int e = 0; e < c->nEdits; e++) {
+            struct substedit* se = &c->edits[e];
+            if (rows == NULL || se->y >= base + run) {
+                base = se->y;
+                rows = row_run(ed, base, &run);
+            }
+            row_t* row = &rows[se->y - base];
+            if (row->store == ROW_HEAP) {
+                free(row->chars);
+            }
+            if (se->len < TVIM_ROW_INLINE) {
+                memcpy(row->inl, se->chars, se->len + 1);
+                row->chars = row->inl;
+                row->store = ROW_INLINE;
+            } else {
+                row->chars = se->chars;
+                row->store = ROW_ARENA;
+            }
+            row->len = se->len;
+            row_update(ed, row);
+            syntax_edit(ed, se->y);
+            lastY = se->y;
+        }
+        free(c->edits);
+    }
+    for (int i = 0; i < j->nThreads; i++) {
+        arena_adopt(&ed->arena, &j->threads[i].arena);
+    }
+    return lastY;
+}
+
+// Replace matches of re in rows [from, to) with rep, every match in a row
+// when global and the first one otherwise. Returns how many were replaced
+// and sets *lines to how many rows changed. The cursor goes to the start
+// of the last changed row.
+int subst_rows(struct editor* ed, int from, int to, struct regex* re,
+               const char* rep, int repLen, bool global, int* lines) {
+    *lines = 0;
+    from = MAX(from, 0);
+    to = MIN(to, ed->nRows);
+    if (from >= to) {
+        return 0;
+    }
+    gap_flush(ed);
+    search_pick_kernel();
+
+    struct substjob j = {0};
+    j.ed = ed;
+    j.re = re;
+    j.global = global;
+    j.from = from;
+    j.to = to;
+    subst_parse(&j, rep, repLen);
+    j.nChunks = (to - from + TVIM_SEARCH_CHUNK - 1) / TVIM_SEARCH_CHUNK;
+    j.chunks = (struct substchunk*)calloc(j.nChunks, sizeof(struct substchunk));
+    if (j.chunks == NULL) {
+        crash("calloc");
+    }
+
+    // the UI thread works the chunks too.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    j.nThreads = MIN(MIN(MAX(cpus, 1), TVIM_SEARCH_THREADS), j.nChunks);
+    atomic_store(&j.next, 0);
+    for (int i = 0; i < j.nThreads; i++) {
+        j.threads[i].job = &j;
+    }
+    for (int i = 1; i < j.nThreads; i++) {
+        if (pthread_create(&j.threads[i].thread, NULL, subst_worker,
+                           &j.threads[i]) != 0) {
+            crash("pthread_create");
+        }
+    }
+    subst_worker(&j.threads[0]);
+    for (int i = 1; i < j.nThreads; i++) {
+        pthread_join(j.threads[i].thread, NULL);
+    }
+
+    int count = 0;
+    for (int k = 0; k < j.nChunks; k++) {
+        count += j.chunks[k].count;
+        *lines += j.chunks[k].nEdits;
+    }
+    int lastY = subst_commit(ed, &j);
+    if (lastY >= 0) {
+        ed->cY = lastY;
+        ed->cX = 0;
+        ed->unsaved++;
+    }
+    free(j.chunks);
+    free(j.rep);
+    free(j.amps);
+    return count;
+}
+
+// Run :[%]s/pattern/replacement/[g], the whole buffer with % and the
+// cursor's row otherwise. Any punctuation can stand in for the /s, an
+// empty pattern is the last search and the pattern becomes the one n and
+// N look for. A huge file only has a window in rows, so % is refused.
+void subst_command(struct editor* ed, const char* s, int len) {
+    int i = 0;
+    int from = ed->cY;
+    int to = ed->cY + 1;
+    if (i < len && s[i] == '%') {
+        if (ed->huge != NULL) {
+            tvim_set_status(ed, ":%%s only works on files that fit in memory");
+            return;
+        }
+        // the whole file, not the part loaded so far.
+        file_load_wait(ed);
+        from = 0;
+        to = ed->nRows;
+        i++;
+    }
+    if (i + 1 >= len || s[i] != 's' || !ispunct((unsigned char)s[i + 1]) ||
+        s[i + 1] == '\\') {
+        tvim_set_status(ed, "Not an editor command: %.*s", len, s);
+        return;
+    }
+    char delim = s[i + 1];
+    i += 2;
+
+    // the pattern and the replacement end at the next unescaped delimiter.
+    int pat = i;
+    while (i < len && s[i] != delim) {
+        i += s[i] == '\\' && i + 1 < len ? 2 : 1;
+    }
+    int patLen = i - pat;
+    int rep = MIN(i + 1, len);
+    i = rep;
+    while (i < len && s[i] != delim) {
+        i += s[i] == '\\' && i + 1 < len ? 2 : 1;
+    }
+    int repLen = i - rep;
+    bool global = false;
+    for (i++; i < len; i++) {
+        if (s[i] != 'g') {
+            tvim_set_status(ed, "Trailing characters: %.*s", len - i, &s[i]);
+            return;
+        }
+        global = true;
+    }
+
+    struct searchjob* job = &ed->search;
+    if (patLen == 0 && job->re == NULL) {
+        tvim_set_status(ed, "no previous pattern");
+        return;
+    }
+    if (patLen == 0) {
+        search_join(ed, true);
+    } else {
+        const char* err;
+        struct regex* re = regex_compile(&s[pat], patLen, &err);
+        if (re == NULL) {
+            tvim_set_status(ed, "bad pattern: %s", err);
+            return;
+        }
+        search_set(ed, &s[pat], patLen, re);
+    }
+
+    long long start = now_ns();
+    int lines;
+    int count =
+        subst_rows(ed, from, to, job->re, &s[rep], repLen, global, &lines);
+    double ms = (now_ns() - start) / 1e6;
+    if (count == 0) {
+        tvim_set_status(ed, "Pattern not found: %.*s", job->patLen, job->pat);
+    } else {
+        tvim_set_status(ed, "%d substitution%s on %d line%s in %.1fms", count,
+                        count == 1 ? "" : "s", lines, lines == 1 ? "" : "s",
+                        ms);
+    }
+}
+
+/*** syntax ***/
+
+// SGR each class is drawn with. Foreground colours only, so the last one
+// sent says all there is about the attribute in effect.
+static const char* const syntax_sgr[] = {
+    [HL_NORMAL] = "\x1b[m",    [HL_COMMENT] = "\x1b[36m",
+    [HL_KEYWORD] = "\x1b[33m", [HL_TYPE] = "\x1b[32m",
+    [HL_STRING] = "\x1b[35m",  [HL_NUMBER] = "\x1b[31m",
+    [HL_PREPROC] = "\x1b[34m", [HL_TIME] = "\x1b[34m",
+    [HL_ERROR] = "\x1b[91m",   [HL_WARN] = "\x1b[93m",
+    [HL_INFO] = "\x1b[92m",    [HL_DEBUG] = "\x1b[90m",
+};
+
+// C and C++ keywords, sorted for syntax_in().
+static const char* const syntax_cKeywords[] = {
+    "NULL", "_Alignas", "_Alignof", "_Atomic", "_Generic", "_Noreturn",
+    "_Static_assert", "_Thread_local", "alignas", "alignof", "and", "asm",
+    "auto", "break", "case", "catch", "class", "co_await", "co_return",
+    "co_yield", "const", "const_cast", "consteval", "constexpr", "constinit",
+    "continue", "decltype", "default", "delete", "do", "dynamic_cast", "else",
+    "enum", "explicit", "export", "extern", "false", "final", "for", "friend",
+    "goto", "if", "inline", "mutable", "namespace", "new", "noexcept", "not",
+    "nullptr", "operator", "or", "override", "private", "protected", "public",
+    "register", "reinterpret_cast", "requires", "restrict", "return", "sizeof",
+    "static", "static_assert", "static_cast", "struct", "switch", "template",
+    "this", "thread_local", "throw", "true", "try", "typedef", "typeid",
+    "typename", "union", "using", "virtual", "volatile", "while",
+};
+
+// Built-in and standard library types, sorted.
+static const char* const syntax_cTypes[] = {
+    "FILE", "_Bool", "_Complex", "bool", "char", "char16_t", "char32_t",
+    "char8_t", "double", "float", "int", "int16_t", "int32_t", "int64_t",
+    "int8_t", "intptr_t", "long", "off_t", "ptrdiff_t", "short", "signed",
+    "size_t", "ssize_t", "uint16_t", "uint32_t", "uint64_t", "uint8_t",
+    "uintptr_t", "unsigned", "void", "wchar_t",
+};
+
+// Log levels and what they are drawn as, matched in any case.
+static const struct {
+    const char* word;
+    int cls;
+} syntax_logLevels[] = {
+    {"CRIT", HL_ERROR},  {"CRITICAL", HL_ERROR}, {"DEBUG", HL_DEBUG},
+    {"ERR", HL_ERROR},   {"ERROR", HL_ERROR},    {"FATAL", HL_ERROR},
+    {"INFO", HL_INFO},   {"NOTICE", HL_INFO},    {"PANIC", HL_ERROR},
+    {"SEVERE", HL_ERROR}, {"TRACE", HL_DEBUG},   {"WARN", HL_WARN},
+    {"WARNING", HL_WARN},
+};
+
+static bool syntax_word(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// s[0..len) is one of the n sorted words.
+static bool syntax_in(const char* const* words, int n, const char* s,
+                      int len) {
+    int lo = 0;
+    int hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strncmp(words[mid], s, len);
+        if (c == 0 && words[mid][len] != '\0') {
+            c = 1;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else if (c > 0) {
+            hi = mid - 1;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void syntax_mark(unsigned char* hl, int from, int to, int cls) {
+    if (hl != NULL) {
+        memset(&hl[from], cls, to - from);
+    }
+}
+
+// Index just past the quote that closes a literal whose body starts at i,
+// or len with *open set when the line ends first.
+static int syntax_quote(const char* s, int len, int i, char q, bool* open) {
+    while (i < len && s[i] != q) {
+        i += s[i] == '\\' ? 2 : 1;
+    }
+    *open = i >= len;
+    return MIN(i + 1, len);
+}
+
+// Index just past the number starting at i: 0x1F, 1.5e-3f, 1'000.
+static int syntax_number(const char* s, int len, int i) {
+    i++;
+    while (i < len) {
+        char c = s[i];
+        if (c == '+' || c == '-') {
+            char e = s[i - 1];
+            if (e != 'e' && e != 'E' && e != 'p' && e != 'P') {
+                break;
+            }
+        } else if (!syntax_word(c) && c != '.' && c != '\'') {
+            break;
+        }
+        i++;
+    }
+    return i;
+}
+
+// C and C++: comments, string and char literals, numbers, keywords, types
+// and preprocessor directives. Only block comments and strings continued
+// with a backslash carry on to the next line.
+static int syntax_lex_c(const char* s, int len, int state, unsigned char* hl) {
+    syntax_mark(hl, 0, len, HL_NORMAL);
+    bool lineStart = true;
+    int i = 0;
+    while (i < len) {
+        int from = i;
+        char c = s[i];
+        if (state == CLEX_COMMENT) {
+            while (i < len &&
+                   !(s[i] == '*' && i + 1 < len && s[i + 1] == '/')) {
+                i++;
+            }
+            if (i < len) {
+                i += 2;
+                state = CLEX_NORMAL;
+            }
+            syntax_mark(hl, from, i, HL_COMMENT);
+        } else if (state == CLEX_STRING || c == '"' || c == '\'') {
+            bool open;
+            char q = state == CLEX_STRING ? '"' : c;
+            i = syntax_quote(s, len, state == CLEX_STRING ? i : i + 1, q,
+                             &open);
+            syntax_mark(hl, from, i, HL_STRING);
+            state = open && q == '"' && s[len - 1] == '\\' ? CLEX_STRING
+                                                           : CLEX_NORMAL;
+        } else if (c == '/' && i + 1 < len && s[i + 1] == '/') {
+            syntax_mark(hl, from, len, HL_COMMENT);
+            i = len;
+        } else if (c == '/' && i + 1 < len && s[i + 1] == '*') {
+            i += 2;
+            syntax_mark(hl, from, i, HL_COMMENT);
+            state = CLEX_COMMENT;
+        } else if (c == '#' && lineStart) {
+            i++;
+            while (i < len && (s[i] == ' ' || s[i] == '\t')) {
+                i++;
+            }
+            int word = i;
+            while (i < len && syntax_word(s[i])) {
+                i++;
+            }
+            syntax_mark(hl, from, i, HL_PREPROC);
+            if (i - word == 7 && strncmp(&s[word], "include", 7) == 0) {
+                while (i < len && (s[i] == ' ' || s[i] == '\t')) {
+                    i++;
+                }
+                if (i < len && s[i] == '<') {
+                    from = i;
+                    while (i < len && s[i] != '>') {
+                        i++;
+                    }
+                    i = MIN(i + 1, len);
+                    syntax_mark(hl, from, i, HL_STRING);
+                }
+            }
+        } else if ((isdigit((unsigned char)c) ||
+                    (c == '.' && i + 1 < len &&
+                     isdigit((unsigned char)s[i + 1]))) &&
+                   (i == 0 || !syntax_word(s[i - 1]))) {
+            i = syntax_number(s, len, i);
+            syntax_mark(hl, from, i, HL_NUMBER);
+        } else if (syntax_word(c)) {
+            while (i < len && syntax_word(s[i])) {
+                i++;
+            }
+            // only worth looking up when someone is going to see it.
+            if (hl != NULL) {
+                int n = i - from;
+                if (syntax_in(syntax_cKeywords,
+                              sizeof(syntax_cKeywords) / sizeof(char*),
+                              &s[from], n)) {
+                    syntax_mark(hl, from, i, HL_KEYWORD);
+                } else if (syntax_in(syntax_cTypes,
+                                     sizeof(syntax_cTypes) / sizeof(char*),
+                                     &s[from], n)) {
+                    syntax_mark(hl, from, i, HL_TYPE);
+                }
+            }
+        } else {
+            i++;
+        }
+        if (c != ' ' && c != '\t') {
+            lineStart = false;
+        }
+    }
+    return state;
+}
+
+// Logs: timestamps, levels, quoted strings and numbers. Every line stands
+// on its own.
+static int syntax_lex_log(const char* s, int len, int state,
+                          unsigned char* hl) {
+    UNUSED(state);
+    if (hl == NULL) {
+        return 0;
+    }
+    syntax_mark(hl, 0, len, HL_NORMAL);
+    int i = 0;
+    while (i < len) {
+        int from = i;
+        char c = s[i];
+        if (c == '"') {
+            bool open;
+            i = syntax_quote(s, len, i + 1, c, &open);
+            syntax_mark(hl, from, i, HL_STRING);
+        } else if (isdigit((unsigned char)c) &&
+                   (i == 0 || !syntax_word(s[i - 1]))) {
+            // a run of digits and separators with a ':' in it or a date's
+            // two '-' or '/' is a time, anything else a number.
+            int seps = 0;
+            int colons = 0;
+            int j = i;
+            int end = i;
+            while (j < len) {
+                if (isdigit((unsigned char)s[j])) {
+                    end = ++j;
+                } else if (s[j] == ':' || s[j] == '-' || s[j] == '/' ||
+                           s[j] == '.' || s[j] == ',' || s[j] == 'T') {
+                    colons += s[j] == ':';
+                    seps += s[j] == '-' || s[j] == '/';
+                    j++;
+                } else {
+                    break;
+                }
+            }
+            if (colons > 0 || seps >= 2) {
+                i = end;
+                if (i < len && s[i] == 'Z') {
+                    i++;
+                }
+                syntax_mark(hl, from, i, HL_TIME);
+            } else {
+                i = syntax_number(s, len, i);
+                syntax_mark(hl, from, i, HL_NUMBER);
+            }
+        } else if (syntax_word(c)) {
+            while (i < len && syntax_word(s[i])) {
+                i++;
+            }
+            int n = i - from;
+            for (size_t k = 0;
+                 k < sizeof(syntax_logLevels) / sizeof(syntax_logLevels[0]);
+                 k++) {
+                if ((int)strlen(syntax_logLevels[k].word) == n &&
+                    strncasecmp(syntax_logLevels[k].word, &s[from], n) == 0) {
+                    syntax_mark(hl, from, i, syntax_logLevels[k].cls);
+                    break;
+                }
+            }
+        } else {
+            i++;
+        }
+    }
+    return 0;
+}
+
+static const char* const syntax_cExts[] = {
+    ".c", ".h", ".cc", ".cpp", ".cxx", ".c++", ".hh", ".hpp", ".hxx", ".inl",
+    NULL,
+};
+
+static const char* const syntax_logExts[] = {".log", NULL};
+
+static const struct syntax syntax_langs[] = {
+    {"c", syntax_cExts, syntax_lex_c},
+    {"log", syntax_logExts, syntax_lex_log},
+};
+
+// Pick the language from the file name, rotated logs (app.log.1) included.
+void syntax_select(struct editor* ed, const char* filename) {
+    struct highlight* h = &ed->hl;
+    h->syn = NULL;
+    h->valid = 0;
+    h->dirty = 0;
+    h->known = 0;
+
+    size_t len = strlen(filename);
+    for (size_t k = 0; k < sizeof(syntax_langs) / sizeof(syntax_langs[0]);
+         k++) {
+        for (const char* const* e = syntax_langs[k].exts; *e != NULL; e++) {
+            size_t n = strlen(*e);
+            if (len > n && strcmp(&filename[len - n], *e) == 0) {
+                h->syn = &syntax_langs[k];
+                return;
+            }
+        }
+    }
+    if (strstr(filename, ".log.") != NULL) {
+        h->syn = &syntax_langs[1];
+    }
+}
+
+// Row y changed, so its end state and maybe the ones after it have to be
+// found again.
+void syntax_edit(struct editor* ed, int y) {
+    struct highlight* h = &ed->hl;
+    if (y >= h->known) {
+        return;
+    }
+    // with nothing in doubt, only this row is.
+    if (h->valid == h->dirty) {
+        h->dirty = y + 1;
+    } else {
+        h->dirty = MAX(h->dirty, y + 1);
+    }
+    h->valid = MIN(h->valid, y);
+}
+
+// A row was inserted at `at`. It ends where the row before it ended, the
+// state the row after it was lexed from, until it is lexed itself.
+void syntax_insert(struct editor* ed, int at, row_t* row) {
+    struct highlight* h = &ed->hl;
+    row->hl = 0;
+    if (at >= h->known) {
+        return;
+    }
+    if (at > 0) {
+        row->hl = row_at(ed, at - 1)->hl;
+    }
+    h->known++;
+    if (at < h->dirty) {
+        h->dirty++;
+    }
+    if (at < h->valid) {
+        h->valid++;
+    }
+    syntax_edit(ed, at);
+}
+
+// The row at `at` was deleted, the one after it starts somewhere else now.
+void syntax_delete(struct editor* ed, int at) {
+    struct highlight* h = &ed->hl;
+    if (at >= h->known) {
+        return;
+    }
+    h->known--;
+    if (at < h->dirty) {
+        h->dirty--;
+    }
+    if (at < h->valid) {
+        h->valid--;
+    }
+    syntax_edit(ed, at);
+}
+
+// Chars of row y. The row being typed on is put back together first.
+static const char* syntax_chars(struct editor* ed, int y, row_t* row) {
+    struct gapline* g = &ed->gap;
+    if (!g->active || g->y != y) {
+        return row->chars;
+    }
+    struct abuf* t = &ed->hl.text;
+    if (t->buf == NULL) {
+        *t = ab_init();
+    }
+    t->len = 0;
+    ab_append(t, g->buf, g->gapStart);
+    ab_append(t, &g->buf[g->gapEnd], g->cap - g->gapEnd);
+    return t->buf;
+}
+
+// Row k, the first one not known to be right, ends in state end. If that
+// is not where it ended before, the row after it starts somewhere new and
+// is in doubt too.
+static void syntax_known(struct editor* ed, int k, row_t* row, int end) {
+    struct highlight* h = &ed->hl;
+    bool same = k + 1 >= h->dirty && k < h->known && row->hl == end;
+    row->hl = end;
+    h->valid = same ? h->known : k + 1;
+    h->known = MAX(h->known, h->valid);
+    h->dirty = same ? h->known : MIN(MAX(h->dirty, k + 2), h->known);
+}
+
+// State row y starts in, lexing the rows before it that are in doubt.
+static int syntax_state(struct editor* ed, int y) {
+    struct highlight* h = &ed->hl;
+    while (h->valid < y) {
+        int k = h->valid;
+        int state = k == 0 ? 0 : row_at(ed, k - 1)->hl;
+        int run;
+        row_t* rows = row_run(ed, k, &run);
+        for (int i = 0; i < run && h->valid == k + i && k + i < y; i++) {
+            state = h->syn->lex(syntax_chars(ed, k + i, &rows[i]), rows[i].len,
+                                state, NULL);
+            syntax_known(ed, k + i, &rows[i], state);
+        }
+    }
+    return y == 0 ? 0 : row_at(ed, y - 1)->hl;
+}
+
+// Classes of the chars of row y out to render column colEnd, NULL when
+// the buffer is not highlighted. Valid until the next call.
+unsigned char* syntax_row(struct editor* ed, int y, int colEnd) {
+    struct highlight* h = &ed->hl;
+    if (h->syn == NULL) {
+        return NULL;
+    }
+    int state = syntax_state(ed, y);
+    row_t* row = row_at(ed, y);
+    const char* s = syntax_chars(ed, y, row);
+
+    // the visible part and the rest of the word it ends in, which can
+    // decide what the word is.
+    int stop = row->len;
+    if (s == row->chars) {
+        stop = row_rX_to_cX(ed, row, colEnd);
+        while (stop < row->len && syntax_word(s[stop])) {
+            stop++;
+        }
+    }
+    if (stop >= h->classCap) {
+        h->classCap = MAX(stop + 1, h->classCap * 2);
+        h->classes = (unsigned char*)realloc(h->classes, h->classCap);
+        if (h->classes == NULL) {
+            crash("realloc");
+        }
+    }
+    int end = h->syn->lex(s, stop, state, h->classes);
+    if (h->valid == y) {
+        if (stop < row->len) {
+            end = h->syn->lex(s, row->len, state, NULL);
+        }
+        syntax_known(ed, y, row, end);
+    }
+    return h->classes;
+}
+
+// Switch the attribute *cur to the one for cls, unless it already is.
+void syntax_put(struct abuf* ab, int* cur, int cls) {
+    if (*cur != cls) {
+        ab_append(ab, syntax_sgr[cls], strlen(syntax_sgr[cls]));
+        *cur = cls;
+    }
+}
+
+void syntax_free(struct editor* ed) {
+    struct highlight* h = &ed->hl;
+    free(h->classes);
+    h->classes = NULL;
+    h->classCap = 0;
+    ab_free(&h->text);
+    h->text.buf = NULL;
+}
+
+/*** output ***/
+
+void tvim_scroll(struct editor* ed) {
+    struct gapline* g = &ed->gap;
+    if (g->active && g->y != ed->cY) {
+        gap_flush(ed);
+    }
+
+    ed->rX = 0;
+    if (g->active) {
+        gap_move(ed, ed->cX);
+        ed->rX = g->rX;
+    } else if (ed->cY < ed->nRows) {
+        ed->rX =
+            row_cX_to_rX(ed, row_at(ed, ed->cY), ed->cX);
+    }
+
+    if (ed->cY < ed->rowOff) {
+        ed->rowOff = ed->cY;
+    }
+    if (ed->cY >= ed->rowOff + ed->screenRows) {
+        ed->rowOff = ed->cY - ed->screenRows + 1;
+    }
+    if (ed->rX < ed->colOff) {
+        ed->colOff = ed->rX;
+    }
+    if (ed->rX >= ed->colOff + ed->screenCols) {
+        ed->colOff = ed->rX - ed->screenCols + 1;
+    }
+}
+
+// Byte index of the start of the char before the cursor (dir -1) or of the
+// one after it (dir 1) on the cursor row.
+static int cursor_step(struct editor* ed, row_t* row, int dir) {
+    struct gapline* g = &ed->gap;
+    int cX = ed->cX;
+    if (g->active && g->y == ed->cY) {
+        // either side of the gap is contiguous once it sits at the cursor.
+        gap_move(ed, cX);
+        return dir < 0 ? utf8_prev(g->buf, cX)
+                       : cX + utf8_next(&g->buf[g->gapEnd], row->len - cX);
+    }
+    return dir < 0 ? utf8_prev(row->chars, cX)
+                   : cX + utf8_next(&row->chars[cX], row->len - cX);
+}
+
+void tvim_move_cursor(struct editor* ed, int key) {
+    row_t* row = (ed->cY >= ed->nRows) ? NULL : row_at(ed, ed->cY);
+
+    switch (key) {
+    case h:
+    case ARROW_LEFT:
+        if (ed->cX != 0) {
+            ed->cX = cursor_step(ed, row, -1);
+        } else if (ed->cY > 0) {
+            ed->cY--;
+            ed->cX = row_at(ed, ed->cY)->len;
+        }
+        break;
+    case l:
+    case ARROW_RIGHT:
+        if (row && ed->cX < row->len) {
+            ed->cX = cursor_step(ed, row, 1);
+        } else if (row && ed->cX == row->len) {
+            if (ed->cY < ed->nRows) {
+                ed->cY++;
+            }
+            ed->cX = 0;
+        }
+        break;
+    case k:
+    case ARROW_UP:
+    case j:
+    case ARROW_DOWN: {
+        // stay in the same screen column rather than at the same char.
+        int rX = 0;
+        if (row != NULL) {
+            gap_flush(ed);
+            rX = row_cX_to_rX(ed, row, ed->cX);
+        }
+        if ((key == k || key == ARROW_UP) && ed->cY != 0) {
+            ed->cY--;
+        } else if ((key == j || key == ARROW_DOWN) &&
+                   ed->cY < ed->nRows) {
+            ed->cY++;
+        }
+        if (ed->cY < ed->nRows) {
+            ed->cX = row_rX_to_cX(ed, row_at(ed, ed->cY), rX);
+        }
+        break;
+    }
+    }
+
+    row = (ed->cY >= ed->nRows) ? NULL : row_at(ed, ed->cY);
+    int rowlen = row ? row->len : 0;
+    if (ed->cX > rowlen) {
+        ed->cX = rowlen;
+    }
+}
+
+// Put the cursor at the start of line n, counting from 1; n < 0 is the
+// last line.
+void tvim_goto_line(struct editor* ed, long long n) {
+    long long y = n < 0 ? -1 : MAX(n - 1, 0);
+    if (ed->huge != NULL) {
+        if (!huge_goto(ed, y)) {
+            return;
+        }
+    } else {
+        ed->cY = y < 0 ? ed->nRows - 1 : MIN(y, ed->nRows - 1);
+        ed->cY = MAX(ed->cY, 0);
+    }
+    ed->cX = 0;
+}
+
+void tvim_draw_rows(struct editor* ed, struct abuf* ab) {
+    struct abuf line = ab_init();
+    int y;
+    for (y = 0; y < ed->screenRows; y++) {
+        line.len = 0;
+        int filrow_t = y + ed->rowOff;
+        if (filrow_t >= ed->nRows) {
+            if (ed->nRows == 0 && y == ed->screenRows / 3) {
+                char welcome[80];
+                int welcomelen =
+                    snprintf(welcome, sizeof(welcome),
+                             "Kilo editor -- version %s", TVIM_VERSION);
+                if (welcomelen > ed->screenCols)
+                    welcomelen = ed->screenCols;
+                int padding = (ed->screenCols - welcomelen) / 2;
+                if (padding) {
+                    ab_append(&line, "~", 1);
+                    padding--;
+                }
+                while (padding--)
+                    ab_append(&line, " ", 1);
+                ab_append(&line, welcome, welcomelen);
+            } else {
+                ab_append(&line, "~", 1);
+            }
+        } else {
+            unsigned char* hl =
+                syntax_row(ed, filrow_t, ed->colOff + ed->screenCols);
+            if (ed->gap.active && filrow_t == ed->gap.y) {
+                gap_draw(ed, &line, ed->colOff, ed->screenCols, hl);
+            } else {
+                row_draw(ed, &line, row_at(ed, filrow_t), ed->colOff,
+                         ed->screenCols, hl);
+            }
+        }
+
+        frame_put(ed, ab, y, &line, NULL);
+    }
+    ab_free(&line);
+}
+
+void tvim_set_status(struct editor* ed, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(ed->statusMsg, sizeof(ed->statusMsg), fmt, ap);
+    va_end(ap);
+}
+
+void tvim_draw_status(struct editor* ed, struct abuf* ab) {
+    struct abuf line = ab_init();
+    int width = ed->screenCols;
+    switch (ed->tvimMode) {
+    case (NORMAL):
+        ab_append(&line, "Normal", 6);
+        break;
+    case (VISUAL):
+        ab_append(&line, "Visual", 6);
+        break;
+    case (INSERT):
+        ab_append(&line, "Insert", 6);
+        break;
+    case (COMMAND):
+        draw_text(&line, ed->cmd.buf, ed->cmd.len, 0, 0, 0,
+                  width, NULL, NULL);
+        break;
+    default:
+        break;
+    }
+    // columns, which the command line and the message can have fewer of
+    // than bytes.
+    int len = MIN(utf8_cols(line.buf, line.len), width);
+
+    // output of the previous refresh against a full redraw of it, after how
+    // much of the file is in while it loads.
+    char stats[80];
+    int statsLen = 0;
+    if (ed->load.running) {
+        statsLen = snprintf(stats, sizeof(stats), "loading %d%%  ",
+                            (int)((ed->load.at - ed->map) * 100 / ed->mapLen));
+    }
+    if (ed->stream.active) {
+        statsLen = snprintf(stats, sizeof(stats), "reading %zuMB  ",
+                            ed->stream.bytes >> 20);
+    }
+    struct hugefile* h = ed->huge;
+    if (h != NULL && h->running) {
+        statsLen = snprintf(stats, sizeof(stats), "indexing %d%%  ",
+                            (int)(atomic_load(&h->scanned) * 100 / h->size));
+    }
+    if (h != NULL) {
+        long long n = huge_lines(ed);
+        statsLen += snprintf(stats + statsLen, sizeof(stats) - statsLen,
+                             n < 0 ? "line %lld  " : "line %lld/%lld  ",
+                             h->winFrom + ed->cY + 1, n);
+    }
+    statsLen += snprintf(stats + statsLen, sizeof(stats) - statsLen, "%dB/%dB",
+                         ed->frame.sent, ed->frame.full);
+    int msgLen = strlen(ed->statusMsg);
+    int room = width - statsLen - len - 3;
+    if (msgLen > 0 && room > 0 && ed->tvimMode != COMMAND) {
+        ab_append(&line, "  ", 2);
+        int col = draw_text(&line, ed->statusMsg, msgLen, 0, 0, 0, room,
+                            NULL, NULL);
+        len += 2 + MIN(col, room);
+    }
+    while (len < width - statsLen) {
+        ab_append(&line, " ", 1);
+        len++;
+    }
+    if (len + statsLen <= width) {
+        ab_append(&line, stats, statsLen);
+        len += statsLen;
+    }
+    while (len < width) {
+        ab_append(&line, " ", 1);
+        len++;
+    }
+
+    frame_put(ed, ab, ed->screenRows, &line, "\x1b[7m");
+    ab_free(&line);
+}
+
+// Append what the terminal has to be sent to show the editor as it is now
+// to ab, which starts out empty.
+void tvim_draw(struct editor* ed, struct abuf* ab) {
+    tvim_scroll(ed);
+
+    struct frame* f = &ed->frame;
+    ab_append(ab, "\x1b[?25l", 6);
+
+    if (f->nLines != ed->screenRows + 1) {
+        frame_free(ed);
+        f->nLines = ed->screenRows + 1;
+        f->lines = (struct abuf*)malloc(sizeof(struct abuf) * f->nLines);
+        if (f->lines == NULL) {
+            crash("malloc");
+        }
+        for (int y = 0; y < f->nLines; y++) {
+            f->lines[y] = ab_init();
+        }
+    }
+    if (!f->valid) {
+        ab_append(ab, "\x1b[2J", 4);
+        for (int y = 0; y < f->nLines; y++) {
+            f->lines[y].len = 0;
+        }
+        f->valid = true;
+        f->rowOff = ed->rowOff;
+    }
+    frame_scroll(ed, ab, ed->rowOff);
+
+    // cursor hide/show and placement, which a full redraw sends as well.
+    f->cost = 3 + 6 + 6;
+    tvim_draw_rows(ed, ab);
+    tvim_draw_status(ed, ab);
+
+    char buf[32];
+    if (ed->tvimMode == COMMAND) {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", ed->screenRows + 1,
+                 MIN(utf8_cols(ed->cmd.buf, ed->cmd.len),
+                     ed->screenCols - 1) +
+                     1);
+    } else {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+                 (ed->cY - ed->rowOff) + 1,
+                 (ed->rX - ed->colOff) + 1);
+    }
+    ab_append(ab, buf, strlen(buf));
+    f->cost += strlen(buf);
+
+    ab_append(ab, "\x1b[?25h", 6);
+
+    f->sent = ab->len;
+    f->full = f->cost;
+}
+
+void tvim_new_line(struct editor* ed) {
+    gap_flush(ed);
+    int line = ed->cY;
+    if (ed->cX == 0) {
+        row_insert(ed, ed->cY, "", 0);
+    } else {
+        row_t* curRow = row_at(ed, line);
+        row_insert(ed, ed->cY + 1, &curRow->chars[ed->cX],
+                   curRow->len - ed->cX);
+        row_t* row = row_at(ed, ed->cY);
+        row_own(ed, row);
+        row->len = ed->cX;
+        row->chars[row->len] = '\0';
+        row_update(ed, row);
+        syntax_edit(ed, line);
+    }
+    ed->cY++;
+    ed->cX = 0;
+
+    return;
+}
+
+// Insert a block of text at the cursor in one pass, breaking it into rows
+// at \r, \n and \r\n. Pastes go through here rather than a
+// tvim_write_char per byte.
+void tvim_insert_text(struct editor* ed, char* s, size_t len) {
+    gap_flush(ed);
+    if (ed->cY == ed->nRows) {
+        row_append(ed, "", 0);
+    }
+
+    row_t* row = row_at(ed, ed->cY);
+    int at = MIN(ed->cX, row->len);
+    char* end = s + len;
+
+    char* eol = s;
+    while (eol < end && *eol != '\r' && *eol != '\n') {
+        eol++;
+    }
+
+    if (eol == end) {
+        row_reserve(row, row->len + len + 1);
+        memmove(&row->chars[at + len], &row->chars[at], row->len - at + 1);
+        memcpy(&row->chars[at], s, len);
+        row->len += len;
+        row_update(ed, row);
+        syntax_edit(ed, ed->cY);
+        ed->cX = at + len;
+        ed->unsaved++;
+        return;
+    }
+
+    // the rest of the cursor line ends up behind the last pasted line.
+    int tailLen = row->len - at;
+    char* tail = (char*)malloc(tailLen + 1);
+    if (tail == NULL) {
+        crash("malloc");
+    }
+    memcpy(tail, &row->chars[at], tailLen);
+
+    // the old chars are carried over before the row is cut at `at`.
+    int first = eol - s;
+    row_reserve(row, MAX(row->len, at + first) + 1);
+    memcpy(&row->chars[at], s, first);
+    row->len = at + first;
+    row->chars[row->len] = '\0';
+    row_update(ed, row);
+    syntax_edit(ed, ed->cY);
+
+    int y = ed->cY;
+    while (eol < end) {
+        bool crlf = eol[0] == '\r' && eol + 1 < end && eol[1] == '\n';
+        s = eol + (crlf ? 2 : 1);
+        eol = s;
+        while (eol < end && *eol != '\r' && *eol != '\n') {
+            eol++;
+        }
+        row_insert(ed, ++y, s, eol - s);
+    }
+
+    row = row_at(ed, y);
+    ed->cY = y;
+    ed->cX = row->len;
+    row_join(ed, row, tail, tailLen);
+    syntax_edit(ed, y);
+    free(tail);
+}
+
+void tvim_write_char(struct editor* ed, char c) {
+    if (ed->cY == ed->nRows) {
+        row_append(ed, "", 0);
+    }
+
+    row_t* curRow = row_at(ed, ed->cY);
+
+    int loc = ed->cX;
+    if (loc < 0 || loc > curRow->len) {
+        loc = curRow->len;
+    }
+
+    gap_begin(ed, ed->cY);
+    gap_move(ed, loc);
+    gap_insert(ed, c);
+    ed->cX = loc + 1;
+
+    return;
+}
+
+void tvim_delete_char(struct editor* ed) {
+    row_t* curRow = row_at(ed, ed->cY);
+    int loc = ed->cX - 1;
+
+    if (ed->cY == ed->nRows) {
+        return;
+    }
+    if (ed->cY == 0 && ed->cX == 0) {
+        return;
+    }
+
+    if (ed->cX <= 0) {
+        gap_flush(ed);
+        ed->cX = row_at(ed, ed->cY - 1)->len;
+
+        row_join(ed, row_at(ed, ed->cY - 1), curRow->chars,
+                 curRow->len);
+        syntax_edit(ed, ed->cY - 1);
+
+        row_delete(ed, ed->cY);
+
+        ed->cY--;
+        ed->unsaved += 1;
+    } else {
+
+        if (loc >= curRow->len) {
+            loc = curRow->len - 1;
+        }
+
+        // the whole char before the cursor, marks on it included.
+        struct gapline* g = &ed->gap;
+        gap_begin(ed, ed->cY);
+        gap_move(ed, loc + 1);
+        loc = utf8_prev(g->buf, g->gapStart);
+        while (g->gapStart > loc) {
+            gap_delete(ed);
+        }
+        ed->cX = loc;
+
+        ed->unsaved += 1;
+    }
+
+    return;
+}
+
+/*** keys ***/
+
+void tvim_process_normal(struct editor* ed, int c) {
+    switch (c) {
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case l:
+    case k:
+    case j:
+    case h:
+        tvim_move_cursor(ed, c);
+        break;
+    case o:
+        // on the line past the end there is no line to open below.
+        ed->cY = MIN(ed->cY + 1, ed->nRows);
+        row_insert(ed, ed->cY, "", 0);
+        ed->cX = 0;
+        ed->tvimMode = INSERT;
+        break;
+
+    case 'O':
+        row_insert(ed, ed->cY, "", 0);
+        ed->cX = 0;
+        ed->tvimMode = INSERT;
+        break;
+    case DELETE_KEY:
+        tvim_move_cursor(ed, ARROW_RIGHT);
+        tvim_delete_char(ed);
+        ed->tvimMode = NORMAL;
+        break;
+    case v:
+        ed->tvimMode = VISUAL;
+        break;
+    case i:
+        ed->tvimMode = INSERT;
+        break;
+    case ':':
+    case '/': {
+        if (ed->cmd.buf == NULL) {
+            ed->cmd = ab_init();
+        }
+        char ch = c;
+        ed->cmd.len = 0;
+        ab_append(&ed->cmd, &ch, 1);
+        ed->tvimMode = COMMAND;
+        break;
+    }
+    case 'n':
+        search_run(ed, 1);
+        break;
+    case 'N':
+        search_run(ed, -1);
+        break;
+    case 'G':
+        tvim_goto_line(ed, -1);
+        break;
+    case ESCAPE:
+        break;
+    case CTRL_KEY('q'):
+        ed->quit = true;
+        break;
+    case CTRL_KEY('s'):
+        file_save_async(ed);
+        break;
+    case PASTE:
+        tvim_insert_text(ed, ed->paste.buf, ed->paste.len);
+        break;
+    default:
+        break;
+    }
+}
+
+void tvim_process_visual(struct editor* ed, int c) {
+    switch (c) {
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+        tvim_move_cursor(ed, c);
+        break;
+    case DELETE_KEY:
+        tvim_move_cursor(ed, ARROW_RIGHT);
+        tvim_delete_char(ed);
+        ed->tvimMode = NORMAL;
+        break;
+    case ESCAPE:
+        ed->tvimMode = NORMAL;
+        break;
+    case CTRL_KEY('q'):
+        ed->quit = true;
+        break;
+    default:
+        break;
+    }
+}
+
+void tvim_process_insert(struct editor* ed, int c) {
+    switch (c) {
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+        tvim_move_cursor(ed, c);
+        break;
+    case DELETE_KEY:
+        tvim_move_cursor(ed, ARROW_RIGHT);
+        tvim_delete_char(ed);
+        ed->tvimMode = NORMAL;
+        break;
+    case BACKSPACE:
+        tvim_delete_char(ed);
+        break;
+    case ENTER:
+        tvim_new_line(ed);
+        break;
+    case PASTE:
+        tvim_insert_text(ed, ed->paste.buf, ed->paste.len);
+        break;
+    case CTRL_KEY('l'):
+    case ESCAPE:
+        ed->tvimMode = NORMAL;
+        break;
+    case CTRL_KEY('q'):
+        ed->quit = true;
+        break;
+    default:
+        tvim_write_char(ed, c);
+        break;
+    }
+
+    return;
+}
+
+// Whether s is all digits, a line number for ':'.
+static bool tvim_line_number(const char* s, int len, long long* line) {
+    *line = 0;
+    for (int k = 0; k < len; k++) {
+        if (!isdigit((unsigned char)s[k])) {
+            return false;
+        }
+        *line = MIN(*line * 10 + (s[k] - '0'), LLONG_MAX / 10);
+    }
+    return true;
+}
+
+// Run the ex command typed after ':'.
+static void tvim_exec(struct editor* ed, const char* s, int len) {
+    long long line;
+    if (len == 1 && s[0] == 'w') {
+        file_save_async(ed);
+    } else if (len > 2 && s[0] == 'w' && s[1] == ' ') {
+        // the file goes by the new name from now on.
+        free(ed->filename);
+        ed->filename = strndup(&s[2], len - 2);
+        if (ed->filename == NULL) {
+            crash("strndup");
+        }
+        syntax_select(ed, ed->filename);
+        // whatever came of a damaged file can go to another one, and a
+        // followed file is left behind.
+        ed->unzip.err = NULL;
+        follow_free(ed);
+        ed->codec = codec_for_name(ed->filename);
+        file_save_async(ed);
+    } else if (len == 1 && s[0] == 'q') {
+        ed->quit = true;
+    } else if ((len == 2 && memcmp(s, "wq", 2) == 0) ||
+               (len == 1 && s[0] == 'x')) {
+        // a file with nowhere to go is not dropped.
+        if (file_save(ed) == 0) {
+            ed->quit = true;
+        }
+    } else if (len >= 5 && memcmp(s, "stats", 5) == 0 &&
+               (len == 5 || s[5] == ' ')) {
+        stats_command(ed, &s[5], len - 5);
+    } else if (len > 0 && tvim_line_number(s, len, &line)) {
+        tvim_goto_line(ed, line);
+    } else if (len > 0 && (s[0] == 's' || s[0] == '%')) {
+        subst_command(ed, s, len);
+    } else if (len > 0) {
+        tvim_set_status(ed, "Not an editor command: %.*s", len, s);
+    }
+}
+
+void tvim_process_command(struct editor* ed, int c) {
+    struct abuf* cmd = &ed->cmd;
+    switch (c) {
+    case ESCAPE:
+        cmd->len = 0;
+        ed->tvimMode = NORMAL;
+        break;
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+        cmd->len = utf8_prev(cmd->buf, cmd->len);
+        if (cmd->len == 0) {
+            ed->tvimMode = NORMAL;
+        }
+        break;
+    case ENTER:
+        ed->tvimMode = NORMAL;
+        if (cmd->buf[0] == '/' && cmd->len > 1) {
+            search_start(ed, &cmd->buf[1], cmd->len - 1);
+        } else if (cmd->buf[0] == '/') {
+            search_run(ed, 1);
+        } else {
+            tvim_exec(ed, &cmd->buf[1], cmd->len - 1);
+        }
+        cmd->len = 0;
+        break;
+    case PASTE:
+        // a line's worth of it, the command line has no line endings.
+        for (int n = 0; n < ed->paste.len; n++) {
+            char ch = ed->paste.buf[n];
+            if (ch == '\r' || ch == '\n') {
+                break;
+            }
+            if (ch != '\0') {
+                ab_append(cmd, &ch, 1);
+            }
+        }
+        break;
+    default:
+        if (c == '\t' || (c >= ' ' && c < ARROW_LEFT)) {
+            char ch = c;
+            ab_append(cmd, &ch, 1);
+        }
+        break;
+    }
+}
+
+void tvim_process_key(struct editor* ed, int c) {
+    long long start = stats_start();
+    switch (ed->tvimMode) {
+    case INSERT:
+        tvim_process_insert(ed, c);
+        break;
+    case NORMAL:
+        tvim_process_normal(ed, c);
+        break;
+    case VISUAL:
+        tvim_process_visual(ed, c);
+        break;
+    case COMMAND:
+        tvim_process_command(ed, c);
+        break;
+    default:
+        break;
+    }
+
+    if (c == PASTE) {
+        ed->paste.len = 0;
+    }
+    huge_follow(ed);
+    stats_stop(STAT_KEY, start);
+}
+
+/*** locking ***/
+
+// Give up the buffer lock, returning whether the UI thread was holding it.
+bool tvim_unlock(struct editor* ed) {
+    if (!ed->locked) {
+        return false;
+    }
+    ed->locked = false;
+    pthread_rwlock_unlock(&ed->lock);
+    return true;
+}
+
+void tvim_lock(struct editor* ed) {
+    pthread_rwlock_wrlock(&ed->lock);
+    ed->locked = true;
+}
+
+void watch_add(struct editor* ed, int fd,
+               void (*ready)(struct editor* ed, int fd)) {
+    if (ed->nWatches == TVIM_MAX_WATCHES) {
+        crash("watch_add");
+    }
+    ed->watches[ed->nWatches++] = (struct watch){fd, ready};
+}
+
+void watch_remove(struct editor* ed, int fd) {
+    for (int i = 0; i < ed->nWatches; i++) {
+        if (ed->watches[i].fd == fd) {
+            ed->watches[i] = ed->watches[--ed->nWatches];
+            return;
+        }
+    }
+}
+
+// Call the handler of every watch poll() found ready. Returns whether any
+// ran.
+bool watch_dispatch(struct editor* ed, struct pollfd* pfd, int nfds) {
+    bool ran = false;
+    // handlers can add and remove watches, so look each one up again.
+    for (int i = 0; i < nfds; i++) {
+        if (pfd[i].revents == 0) {
+            continue;
+        }
+        for (int w = 0; w < ed->nWatches; w++) {
+            if (ed->watches[w].fd == pfd[i].fd) {
+                ed->watches[w].ready(ed, pfd[i].fd);
+                ran = true;
+                break;
+            }
+        }
+    }
+    return ran;
+}
+
+/*** editor ***/
+
+// An empty editor with a view of screenRows text rows and screenCols
+// columns, open a file into it with file_open().
+struct editor* editor_new(int screenRows, int screenCols) {
+    struct editor* ed = (struct editor*)calloc(1, sizeof(struct editor));
+    if (ed == NULL) {
+        crash("calloc");
+    }
+    ed->screenRows = screenRows;
+    ed->screenCols = screenCols;
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    ed->hugeSize = pages > 0 && pageSize > 0
+                       ? (size_t)pages * pageSize / TVIM_HUGE_RAM_SHARE
+                       : SIZE_MAX;
+    ed->follow.max = TVIM_FOLLOW_LINES;
+
+    // writers first, or search threads taking turns could keep keys waiting.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ed->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return ed;
+}
+
+void editor_free(struct editor* ed) {
+    load_cancel(ed);
+    if (ed->stream.active) {
+        stream_finish(ed);
+    }
+    // the save thread may still be writing out of the rows and the mapping.
+    if (ed->save.running) {
+        pthread_join(ed->save.thread, NULL);
+        ed->save.running = false;
+    }
+    free(ed->save.path);
+    free(ed->save.spans);
+    arena_release(&ed->save.copies);
+    search_free(ed);
+    syntax_free(ed);
+    ab_free(&ed->cmd);
+    free(ed->filename);
+    ab_free(&ed->paste);
+    free(ed->gap.marks);
+    rows_free(ed);
+    huge_free(ed);
+    follow_free(ed);
+    arena_release(&ed->arena);
+    rcache_free(ed);
+    frame_free(ed);
+    if (ed->map != NULL) {
+        munmap(ed->map, ed->mapLen);
+    }
+    pthread_rwlock_destroy(&ed->lock);
+    free(ed);
+}
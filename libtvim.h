@@ -0,0 +1,943 @@
+#ifndef LIBTVIM_H
+#define LIBTVIM_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*** Defines ***/
+#define TVIM_VERSION "0.0.1"
+#define TVIM_TAB_STOP 4
+// rows per leaf and children per inner node of the row tree.
+#define TVIM_ROW_FANOUT 64
+// bytes of line storage kept inside row_t itself, '\0' included.
+#define TVIM_ROW_INLINE 13
+// size of the chunks the line arena grabs from malloc.
+#define TVIM_ARENA_CHUNK (1 << 20)
+// bytes of column index kept around for rows that are off screen.
+#define TVIM_RENDER_BUDGET (4 << 20)
+// bytes between the checkpoints of a row's column index.
+#define TVIM_WIDTH_STEP 64
+// line spans handed to a single writev when saving.
+#define TVIM_SAVE_IOV 1024
+// most bytes a save writes between progress updates.
+#define TVIM_SAVE_CHUNK (4 << 20)
+// files up to this many bytes are split into rows on the calling thread.
+#define TVIM_LOAD_SYNC (256 << 10)
+// lines the load thread hands over to the main loop at a time.
+#define TVIM_LOAD_BATCH 8192
+// files over this share of RAM open windowed, see editor.hugeSize.
+#define TVIM_HUGE_RAM_SHARE 4
+// bytes of a huge file mapped at a time, a multiple of the page size.
+#define TVIM_HUGE_CHUNK (4 << 20)
+// chunks of a huge file kept mapped.
+#define TVIM_HUGE_CHUNKS 16
+// lines of a huge file kept as rows around the cursor.
+#define TVIM_HUGE_WINDOW 4096
+// most lines between the offsets the index of a huge file keeps.
+#define TVIM_HUGE_STRIDE 4096
+// bytes of a huge file an index thread counts the lines of at a time.
+#define TVIM_INDEX_PIECE (64 << 20)
+// lines a followed file keeps, see followjob.max.
+#define TVIM_FOLLOW_LINES 100000
+// bytes of a followed file or a stream read at a time.
+#define TVIM_READ_CHUNK (64 << 10)
+// most bytes of a stream read before the main loop gets to keys again.
+#define TVIM_STREAM_READ (1 << 20)
+// bytes a compressed file is decompressed ahead of the line parser.
+#define TVIM_UNZIP_PIPE (1 << 20)
+// compression levels a save of a .gz or .zst file uses.
+#define TVIM_GZIP_LEVEL 6
+#define TVIM_ZSTD_LEVEL 3
+// rows a search or substitute thread scans at a time.
+#define TVIM_SEARCH_CHUNK 16384
+// most threads a search, substitute or line index runs on.
+#define TVIM_SEARCH_THREADS 8
+// most instructions a compiled regex can take.
+#define TVIM_REGEX_INSTS 20000
+// DFA states a regex matcher keeps before it starts over.
+#define TVIM_REGEX_STATES 1024
+// descriptors tvim_run can watch besides stdin.
+#define TVIM_MAX_WATCHES 8
+// histogram buckets of the stats, four for each power of two.
+#define TVIM_STATS_BUCKETS 248
+
+/*** Macros ***/
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+#define UNUSED(x) (void)x
+
+#define CTRL_KEY(k) ((k) & 0x1F)
+
+#define return_defer(value) \
+    do {                    \
+        result = (value);   \
+        goto defer;         \
+    } while (0)
+
+/*** Data types and Data def ***/
+
+enum mode {
+    NORMAL = 0,
+    VISUAL,
+    INSERT,
+    COMMAND,
+};
+
+enum key {
+    BACKSPACE = 127,
+    i = 'i',
+    ESCAPE = 27, 
+    ENTER = '\r',
+    l = 'l',
+    k = 'k',
+    j = 'j',
+    h = 'h',
+    v = 'v',
+    o = 'o',
+    O = 'O',
+    ARROW_LEFT = 1000,
+    ARROW_RIGHT,
+    ARROW_UP,
+    ARROW_DOWN,
+    DELETE_KEY,
+    PASTE, // a bracketed paste has been read into editor.paste
+    // could add page up/down. I don't want to, so I will not :)
+    // could add home + end keys. but guess what? I don't use those so I will not.
+};
+
+// Bump allocator for line storage. Allocations are never freed one by one,
+// arena_release() drops every chunk at once.
+typedef struct arenachunk {
+    struct arenachunk* next;
+    size_t used;
+    size_t cap;
+    char data[];
+} arenachunk_t;
+
+struct arena {
+    arenachunk_t* head;
+};
+
+// Where a row's chars live. Only ROW_HEAP chars are malloc'd per row.
+enum rowstore {
+    ROW_HEAP = 0,
+    ROW_INLINE, // in row_t.inl
+    ROW_ARENA,  // in editor.arena, writable but cannot grow
+    ROW_MAPPED, // in editor.map, read only
+};
+
+enum renderstate {
+    RENDER_STALE = 0, // not built since the row last changed
+    RENDER_SHARED,    // ASCII without tabs, a byte is a column
+    RENDER_CACHED,    // in the render cache, unless it was evicted since
+};
+
+// One cached column index, see row_render(). gen changes whenever the slot
+// is dropped so rows holding an old (slot, gen) pair can tell their index
+// is gone.
+typedef struct {
+    int* cols;
+    unsigned gen;
+    int size;
+    int prev, next;
+} rslot_t;
+
+// LRU of row column indexes bounded by TVIM_RENDER_BUDGET bytes. Only rows
+// that were on screen or under the cursor have one. Rows move around the
+// row tree so the cache never points back at them.
+struct rendercache {
+    rslot_t* slots;
+    int cap;
+    int head, tail; // most and least recently used
+    int freeSlot;
+    size_t bytes;
+};
+
+// A byte before the gap that is not a one-column char of its own, a tab
+// or part of a UTF-8 sequence: its index in the line and the render column
+// right after its char. Edits at the gap never move these.
+struct gapmark {
+    int idx;
+    int endCol;
+};
+
+// The row being typed on. Its heap chars become a gap buffer with the gap
+// at the edit point, so inserting and deleting there is O(1). row->len is
+// kept current but row->chars is only valid again after gap_flush(), which
+// runs when the cursor leaves the row and before anything else touches
+// it. rX is the render column at the gap; with the stack of marks before
+// the gap it lets the visible part of the row be drawn without walking the
+// whole line.
+struct gapline {
+    bool active;
+    int y;
+    char* buf;
+    int cap;
+    int gapStart;
+    int gapEnd;
+    int rX;
+    struct gapmark* marks;
+    int nMarks;
+    int markCap;
+};
+
+struct abuf {
+    char* buf;
+    int len;
+    int capacity;
+};
+
+// What the terminal is showing, one line per screen row plus the status
+// bar, so a refresh only has to send what changed.
+struct frame {
+    struct abuf* lines;
+    int nLines;
+    bool valid;
+    int rowOff; // editor.rowOff the shadow was drawn at
+    int sent;   // bytes written by the last refresh
+    int full;   // bytes the last refresh would have taken redrawing everything
+    int cost;   // full for the refresh in progress
+};
+
+typedef struct {
+    int len;
+    int rlen; // render columns, valid once row_render() has run
+    char* chars;
+    // render cache slot holding the tab-expanded row, see enum renderstate.
+    int rslot;
+    unsigned rgen;
+    // enum rowstore for chars. row_own()/row_reserve() move chars somewhere
+    // writable before the row is edited.
+    unsigned store : 7;
+    unsigned cr : 1; // the line ends in \r\n, and is saved that way
+    unsigned char rstate;
+    unsigned char hl; // lexer state at the end of the row, see struct highlight
+    char inl[TVIM_ROW_INLINE];
+} row_t;
+
+// Counted B+ tree holding the rows in order. Every node knows how many rows
+// live below it so a line number can be found, inserted or deleted in
+// O(log n) without moving the rest of the buffer.
+typedef struct rownode {
+    bool leaf;
+    int n;     // rows (leaf) or children (inner) in use
+    int count; // rows in this subtree
+    union {
+        row_t rows[TVIM_ROW_FANOUT];
+        struct rownode* child[TVIM_ROW_FANOUT];
+    };
+} rownode_t;
+
+struct editor;
+
+// A descriptor the client polls for the editor, ready is called on the UI
+// thread once it is readable.
+struct watch {
+    int fd;
+    void (*ready)(struct editor* ed, int fd);
+};
+
+// How the opened file is compressed. A save compresses it the same way.
+enum codec {
+    CODEC_NONE = 0,
+    CODEC_GZIP,
+    CODEC_ZSTD, // only with TVIM_ZSTD, else the file opens as it is
+};
+
+// A save running on its own thread. The snapshot is the list of spans to
+// write, borrowing chars that stay put and copying the rest into copies.
+struct savejob {
+    char* path;
+    struct iovec* spans;
+    int nSpans;
+    int spanCap;
+    struct arena copies;
+    char* copyAt;
+    size_t copyLeft;
+    size_t total;
+    long long nRows; // -1 when not known
+    int unsaved; // edits the snapshot covers
+    // huge files: spans with a NULL base are copied from src, the n-th of
+    // them from srcOffs[n].
+    int src;
+    size_t* srcOffs;
+    int nSrc;
+    int srcCap;
+    int err;     // errno of a failed save
+    enum codec codec;
+
+    pthread_t thread;
+    int wake[2]; // save thread -> main loop
+    bool running;
+    bool again; // asked to save again while running
+    atomic_size_t done;
+    atomic_bool finished;
+    long long started; // stats_start() when the snapshot was taken
+};
+
+// Ends of the next lines of the file, found by the load thread.
+struct loadbatch {
+    int n;
+    char* ends[TVIM_LOAD_BATCH]; // the '\n' or the end of the mapping
+};
+
+struct loadjob {
+    char* at;   // start of the next line to add
+    char* scan; // where the load thread starts, past the first screen
+    char* end;
+    pthread_t thread;
+    int wake[2]; // load thread -> main loop, one struct loadbatch* at a time
+    bool running;
+    atomic_bool cancel;
+    long long started; // stats_start() in file_open
+};
+
+// A file read as it grows, like tail -f. inotify wakes the main loop when
+// the file is written, truncated or replaced, and only the bytes past off
+// are read, onto the end of the rows.
+struct followjob {
+    bool active;
+    int fd;        // the file read from, the old one until a new one shows up
+    dev_t dev;     // of fd
+    ino_t ino;
+    off_t off;     // read up to here
+    int inotify;
+    int wdFile;    // the file at fd
+    int wdDir;     // its directory, for a new file under the name
+    bool partial;  // the last row has no '\n' yet
+    int max;       // rows kept, the oldest are dropped past it
+    int wake[2];   // poked while there is more to read than one go takes
+};
+
+// Lines coming in on a pipe, read by the main loop as they arrive. Nothing
+// is seeked, a line split over two reads is put together on its row.
+struct streamjob {
+    bool active;
+    int fd;
+    bool partial;      // the last row has no '\n' yet
+    char* buf;         // arena space the next read goes into
+    size_t left;       // bytes of it
+    size_t bytes;      // read so far
+    long long started; // stats_start() in file_stream
+};
+
+// A compressed file decompressed on a thread of its own into a pipe, which
+// the main loop streams the lines from, see struct streamjob. The pipe is
+// the bounded queue between the two: a full one holds the thread up.
+struct unzipjob {
+    enum codec codec;
+    int src; // the compressed file
+    int out; // write end of the pipe
+    pthread_t thread;
+    bool running;
+    const char* err; // why decompressing stopped early, NULL if it did not
+    const char* note; // what was skipped in a file that still came out whole
+};
+
+// A part of a huge file that is mapped, see huge_chunk.
+struct hugechunk {
+    size_t off;
+    size_t len;
+    char* map; // NULL while the slot is free
+    unsigned long used; // hugefile.tick when last looked at
+};
+
+// Lines that replace count lines of a huge file from line `from` on. Made
+// out of the rows of an edited window when it moves.
+struct hugepatch {
+    long long from;
+    long long count;
+    size_t fromOff; // bytes of the lines replaced
+    size_t toOff;
+    char* text; // the new lines as saved, each with its own line ending
+    size_t len;
+    long long nLines;
+};
+
+// Line `line` of a huge file starts at byte off.
+struct hugemark {
+    long long line;
+    size_t off;
+};
+
+// Lines an index thread counted in TVIM_INDEX_PIECE bytes of a huge file,
+// with marks numbered from the start of the piece.
+struct hugepiece {
+    struct hugemark* marks;
+    int nMarks;
+    int markCap;
+    long long lines; // '\n' in the piece, -1 if it could not be read
+    char last;       // its last byte
+    bool done;       // guarded by hugefile.mu
+};
+
+// Start of the sidecar file a huge file's index is kept in between runs.
+// The index is only used while the file has the same size, mtime and inode.
+struct hugeindex {
+    char magic[8];
+    unsigned long long size;
+    unsigned long long dev;
+    unsigned long long ino;
+    long long mtimeSec;
+    long long mtimeNsec;
+    long long stride;
+    long long lines;
+    long long nMarks; // struct hugemarks that follow
+};
+
+// A file too big to have a row per line. Only a window of lines around the
+// cursor are rows, read out of the file through a few mapped chunks, and
+// edits live in patches until a save streams the file out with them.
+struct hugefile {
+    int fd;
+    size_t size;
+    struct hugechunk chunks[TVIM_HUGE_CHUNKS];
+    unsigned long tick;
+
+    // a mark at most every TVIM_HUGE_STRIDE lines, by line. The index
+    // thread adds them as the pieces before them are done, pieces are
+    // counted on up to TVIM_SEARCH_THREADS workers.
+    struct hugemark* marks;
+    atomic_llong nMarks;
+    atomic_size_t scanned;
+    atomic_llong lines; // in the file, once indexed is set
+    atomic_bool indexed;
+    atomic_bool finished; // the index thread is done, indexed or not
+    atomic_bool cancel;
+    pthread_t thread;
+    bool running;
+    int wake[2]; // index thread -> main loop
+    struct hugepiece* pieces;
+    int nPieces;
+    atomic_int nextPiece;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    // the sidecar and what it has to match.
+    char* sidecar;
+    struct hugeindex key;
+
+    // sorted by from, never overlapping.
+    struct hugepatch* patches;
+    int nPatches;
+    int patchCap;
+
+    // the rows are lines winFrom on of the edited file. They stand for lines
+    // origFrom to origTo of the file with patches patchFrom to patchTo put in.
+    long long winFrom;
+    long long origFrom;
+    long long origTo;
+    size_t fromOff;
+    size_t toOff;
+    int patchFrom;
+    int patchTo;
+    bool eof; // the window runs to the end of the file
+    unsigned version; // editor.version when the rows matched the patches
+};
+
+enum reop {
+    RE_BYTES, // read a byte in sets[x]
+    RE_SPLIT, // go on at x and at y
+    RE_JMP,   // go on at x
+    RE_BOL,   // only at the start of the line
+    RE_EOL,   // only at the end of the line
+    RE_MATCH,
+};
+
+struct reinst {
+    int op;
+    int x;
+    int y;
+};
+
+struct reprog {
+    struct reinst* inst;
+    int n;
+    int cap;
+};
+
+// A compiled pattern. Read only once compiled, threads share it.
+struct regex {
+    struct reprog fwd;
+    struct reprog rev; // the pattern backwards, finds where matches start
+    unsigned char (*sets)[32];
+    int nSets;
+    // what every match starts with, the whole pattern when literal.
+    char* prefix;
+    int prefixLen;
+    bool literal;
+    bool tooBig;
+};
+
+// A DFA state: the set of instructions it stands for and the states after
+// each byte, NULL until first needed.
+typedef struct dstate {
+    struct dstate* next[256];
+    struct dstate* chain;
+    unsigned hash;
+    bool match;
+    bool eolMatch; // matches if the line ends here
+    int n;
+    int pcs[];
+} dstate_t;
+
+struct dfa {
+    struct regex* re;
+    struct reprog* prog;
+    bool unanchored; // a match can start anywhere
+    dstate_t** table;
+    int tableCap;
+    int nStates;
+    dstate_t* start[2]; // at and away from the start of the line
+    int* stack;
+    unsigned* mark;
+    unsigned gen;
+    int* set;
+    int nSet;
+};
+
+// One thread's state for matching a regex line by line.
+struct rematch {
+    struct regex* re;
+    struct dfa fwd;
+    struct dfa rev;
+    const char* s;
+    int len;
+    unsigned char* starts; // where matches start in s, len + 1 of them
+    int startsCap;
+};
+
+struct searchpos {
+    int y;
+    int x;
+};
+
+// What a search thread found in the TVIM_SEARCH_CHUNK rows from y, with
+// positions relative to where the search started. y is -1 for none.
+struct searchchunk {
+    int y;
+    int count;
+    int nBelow; // matches before the start
+    int nUpTo;  // matches before or at the start
+    struct searchpos first;
+    struct searchpos last;
+    struct searchpos afterFirst; // first match after the start
+    struct searchpos beforeLast; // last match before the start
+    bool done;
+};
+
+// The last search pattern and the threads scanning the buffer for it.
+struct searchjob {
+    struct editor* ed;
+    char* pat;
+    int patLen;
+    struct regex* re;
+    int dir; // 1 forwards, -1 backwards
+    struct searchpos from;
+    bool landed;  // the cursor was moved to a match
+    bool wrapped; // ... past the end of the buffer
+    int nRows;
+    unsigned version;
+    struct searchchunk* chunks;
+    int nChunks;
+
+    pthread_t threads[TVIM_SEARCH_THREADS];
+    int nThreads;
+    bool running;
+    atomic_int next; // next chunk to hand out, in search order
+    atomic_bool cancel;
+    atomic_bool stale; // the buffer changed during the scan
+    pthread_mutex_t mu; // guards live and chunks[].done
+    pthread_cond_t cv;
+    int live;
+    int wake[2]; // last thread out -> main loop
+    bool piped;
+};
+
+// A row :s rewrote. chars is in the arena of the thread that built it.
+struct substedit {
+    int y;
+    int len;
+    char* chars;
+};
+
+// Rows a substitute thread rewrote in one TVIM_SEARCH_CHUNK of rows.
+struct substchunk {
+    struct substedit* edits;
+    int nEdits;
+    int editCap;
+    int count; // matches replaced
+};
+
+struct substjob;
+
+// A substitute thread, building new rows in its own arena.
+struct substthread {
+    struct substjob* job;
+    pthread_t thread;
+    struct arena arena;
+    struct rematch m;
+    int* spans; // start and end of each match in the row
+    int nSpans;
+    int spanCap;
+};
+
+// A :s over rows [from, to). The UI thread waits for it, so the rows hold
+// still without taking the buffer lock.
+struct substjob {
+    struct editor* ed;
+    struct regex* re;
+    bool global; // every match in a row, not just the first
+    char* rep;   // replacement text without the &s
+    int repLen;
+    int* amps; // where in rep the match goes
+    int nAmps;
+    int from;
+    int to;
+    struct substchunk* chunks;
+    int nChunks;
+    atomic_int next;
+    struct substthread threads[TVIM_SEARCH_THREADS];
+    int nThreads;
+};
+
+// What the highlighter makes of a char, see syntax_sgr.
+enum hlclass {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_KEYWORD,
+    HL_TYPE,
+    HL_STRING,
+    HL_NUMBER,
+    HL_PREPROC,
+    HL_TIME,  // log timestamps
+    HL_ERROR, // log levels
+    HL_WARN,
+    HL_INFO,
+    HL_DEBUG,
+};
+
+// Where the C lexer is when a line ends.
+enum clexstate {
+    CLEX_NORMAL = 0,
+    CLEX_COMMENT, // in a block comment
+    CLEX_STRING,  // in a string continued with a backslash
+};
+
+// A language the highlighter knows. lex classifies the chars of one line,
+// starting in state, into hl unless it is NULL, and returns the state the
+// next line starts in.
+struct syntax {
+    const char* name;
+    const char* const* exts; // file name endings, NULL terminated
+    int (*lex)(const char* s, int len, int state, unsigned char* hl);
+};
+
+// Highlighting of the buffer, kept as the lexer state at the end of each
+// row. Rows before valid have the right one. Rows from valid to dirty
+// changed and have to be lexed again. Rows from dirty to known were lexed
+// since they last changed, so once a row past dirty ends in the state it
+// ended in before, everything up to known is right again.
+struct highlight {
+    const struct syntax* syn; // NULL for plain text
+    int valid;
+    int dirty;
+    int known;
+    unsigned char* classes; // of the row being drawn
+    int classCap;
+    struct abuf text; // the gap row put back together
+};
+
+// What the stats time.
+enum stattimer {
+    STAT_READ = 0, // tvim_read_key
+    STAT_KEY,      // tvim_process_key
+    STAT_DRAW,     // tvim_refresh_screen
+    STAT_LOAD,     // file_open until every line is in
+    STAT_SAVE,     // from the snapshot until the file is written
+    STAT_TIMERS,
+};
+
+// Histogram of samples, ns or bytes. Values under 8 have a bucket each,
+// larger ones share four buckets for each power of two.
+struct stathist {
+    long long n;
+    long long total;
+    long long max;
+    long long buckets[TVIM_STATS_BUCKETS];
+};
+
+// Instrumentation for :stats. Nothing is collected while on is false, and
+// the malloc wrappers stay at one atomic load. Allocations are counted
+// from every thread, the rest only on the UI thread.
+struct stats {
+    atomic_bool on;
+    long long since; // when collecting started, in ns
+    long long until; // when it stopped, while on is false
+    char* dump;      // report written here on exit, from TVIM_STATS
+    struct stathist timers[STAT_TIMERS];
+    struct stathist frameBytes; // written to the terminal per frame
+    atomic_llong mallocs;       // calloc included
+    atomic_llong reallocs;
+    atomic_llong allocBytes;
+};
+
+// One buffer and the view of it. Everything the editor core does goes
+// through one of these; the stats are the only other state, shared by the
+// whole process.
+struct editor {
+    int cX, cY;
+    int rX;
+    int rowOff;
+    int colOff;
+    int screenRows; // text rows, the status bar is one more
+    int screenCols;
+    int nRows;
+    rownode_t* rows;
+    char* filename;
+
+    // backs row chars built in bulk, released by editor_free.
+    struct arena arena;
+    struct rendercache render;
+    struct frame frame;
+    struct gapline gap;
+    // text of the PASTE key, filled in by the client.
+    struct abuf paste;
+    // descriptors the client polls, see watch_dispatch.
+    struct watch watches[TVIM_MAX_WATCHES];
+    int nWatches;
+    struct loadjob load;
+    struct streamjob stream;
+    struct unzipjob unzip;
+    struct savejob save;
+    struct searchjob search;
+    struct highlight hl;
+    // text typed on the command line, ':' or '/' included.
+    struct abuf cmd;
+
+    // held by the UI thread except while it sleeps in poll(), search threads
+    // read the rows under the read side.
+    pthread_rwlock_t lock;
+    bool locked;
+    // bumped on every change to the rows.
+    unsigned version;
+
+    // read-only mapping of the opened file, rows borrow their chars from it.
+    char* map;
+    size_t mapLen;
+    // files over hugeSize bytes open windowed, see struct hugefile.
+    struct hugefile* huge;
+    size_t hugeSize;
+    struct followjob follow;
+    // the first line ended in \r\n, new rows do too.
+    bool crlf;
+    enum codec codec;
+
+    int unsaved;
+    // last message for the status bar, kept until the next one.
+    char statusMsg[80];
+
+    enum mode tvimMode;
+    // a key asked to quit, the client decides what that means.
+    bool quit;
+};
+
+extern struct stats tvimStats;
+
+/******* FUNCTIONS *******/
+
+/*** arena ***/
+
+void* arena_alloc(struct arena* a, size_t size); 
+void arena_adopt(struct arena* a, struct arena* from); 
+void arena_release(struct arena* a); 
+
+/*** render cache ***/
+
+void rcache_free(struct editor* ed);
+
+/*** row storage ***/
+
+row_t* row_at(struct editor* ed, int at); 
+row_t* row_run(struct editor* ed, int at, int* run); 
+void rows_free(struct editor* ed);
+
+/*** utf-8 ***/
+
+int utf8_width(unsigned cp); 
+int utf8_decode(const char* s, int len, unsigned* cp); 
+int utf8_next(const char* s, int len); 
+int utf8_prev(const char* s, int len); 
+int utf8_cols(const char* s, int len); 
+bool utf8_ascii(const char* s, size_t len); 
+
+/*** row operations ***/
+
+int row_cX_to_rX(struct editor* ed, row_t* row, int cX); 
+int row_rX_to_cX(struct editor* ed, row_t* row, int rX); 
+void row_update(struct editor* ed, row_t* row); 
+int* row_render(struct editor* ed, row_t* row); 
+void row_draw(struct editor* ed, struct abuf* ab, row_t* row, int colOff,
+              int width, const unsigned char* hl); 
+row_t* row_append(struct editor* ed, char* s, size_t len); 
+row_t* row_append_mapped(struct editor* ed, char* s, size_t len); 
+void row_own(struct editor* ed, row_t* row); 
+void row_reserve(row_t* row, size_t size); 
+void row_insert(struct editor* ed, int at, char* s, size_t len); 
+void row_free(struct editor* ed, row_t* row); 
+void row_delete(struct editor* ed, int at); 
+void row_join(struct editor* ed, row_t* row, char* s, int len);
+
+/*** gap buffer ***/
+
+void gap_begin(struct editor* ed, int y); 
+void gap_move(struct editor* ed, int at); 
+void gap_flush(struct editor* ed); 
+void gap_draw(struct editor* ed, struct abuf* ab, int colOff, int width,
+              const unsigned char* hl); 
+
+/*** char operations ***/
+void tvim_write_char(struct editor* ed, char c); 
+void tvim_delete_char(struct editor* ed); 
+void tvim_new_line(struct editor* ed); 
+void tvim_insert_text(struct editor* ed, char* s, size_t len);
+
+/*** file i/o ***/
+
+void file_open(struct editor* ed, const char* filename); 
+void file_get_lines(struct editor* ed, char* buf, size_t len);
+void file_load_wait(struct editor* ed); 
+void file_stream(struct editor* ed, int fd); 
+int file_save(struct editor* ed);
+void file_save_async(struct editor* ed);
+void file_save_wait(struct editor* ed);
+
+/*** follow ***/
+
+void follow_open(struct editor* ed, const char* filename); 
+void follow_free(struct editor* ed); 
+
+/*** huge files ***/
+
+void huge_open(struct editor* ed, int fd, const struct stat* st); 
+void huge_follow(struct editor* ed); 
+bool huge_goto(struct editor* ed, long long y); 
+void huge_wait(struct editor* ed); 
+void huge_snapshot(struct editor* ed, struct savejob* j); 
+void huge_free(struct editor* ed); 
+
+/*** regex ***/
+
+struct regex* regex_compile(const char* s, int len, const char** err); 
+void regex_free(struct regex* re); 
+void rematch_init(struct rematch* m, struct regex* re); 
+void rematch_free(struct rematch* m); 
+bool regex_line(struct rematch* m, const char* s, int len); 
+bool regex_next(struct rematch* m, int from, int* start, int* end); 
+
+/*** search ***/
+
+const char* search_find(const char* s, size_t len, const char* p, size_t m); 
+void search_start(struct editor* ed, const char* s, int len); 
+void search_run(struct editor* ed, int dir); 
+void search_free(struct editor* ed);
+
+/*** substitute ***/
+
+int subst_rows(struct editor* ed, int from, int to, struct regex* re,
+               const char* rep, int repLen, bool global, int* lines); 
+void subst_command(struct editor* ed, const char* s, int len);
+
+/*** syntax ***/
+
+void syntax_select(struct editor* ed, const char* filename); 
+void syntax_edit(struct editor* ed, int y); 
+void syntax_insert(struct editor* ed, int at, row_t* row); 
+void syntax_delete(struct editor* ed, int at); 
+unsigned char* syntax_row(struct editor* ed, int y, int colEnd); 
+void syntax_put(struct abuf* ab, int* cur, int cls); 
+void syntax_free(struct editor* ed);
+
+/*** fatal errors ***/
+
+void crash_set_hook(void (*hook)()); 
+void crash(const char* s);
+
+/*** stats ***/
+
+long long now_ns(); 
+void* stats_malloc(size_t size); 
+void* stats_calloc(size_t n, size_t size); 
+void* stats_realloc(void* p, size_t size); 
+void stats_enable(); 
+long long stats_start(); 
+void stats_stop(int timer, long long start); 
+void stats_frame(long long start, int bytes); 
+void stats_report(FILE* out); 
+void stats_command(struct editor* ed, const char* s, int len); 
+void stats_exit(); 
+
+/*** append buffer ***/
+
+struct abuf ab_init(); 
+void ab_append(struct abuf* ab, const char* s, int len); 
+void ab_free(struct abuf* ab); 
+
+/*** frame ***/
+
+void frame_put(struct editor* ed, struct abuf* ab, int y, struct abuf* line,
+               const char* sgr); 
+void frame_scroll(struct editor* ed, struct abuf* ab, int rowOff); 
+void frame_invalidate(struct editor* ed); 
+void frame_free(struct editor* ed);
+
+/*** output ***/
+
+void tvim_scroll(struct editor* ed); 
+
+void tvim_move_cursor(struct editor* ed, int key); 
+
+void tvim_goto_line(struct editor* ed, long long n); 
+
+void tvim_draw_rows(struct editor* ed, struct abuf* ab); 
+
+void tvim_set_status(struct editor* ed, const char* fmt, ...); 
+
+void tvim_draw_status(struct editor* ed, struct abuf* ab); 
+
+void tvim_draw(struct editor* ed, struct abuf* ab); 
+
+/*** keys ***/
+
+void tvim_process_normal(struct editor* ed, int c); 
+
+void tvim_process_visual(struct editor* ed, int c); 
+
+void tvim_process_insert(struct editor* ed, int c); 
+
+void tvim_process_command(struct editor* ed, int c); 
+
+void tvim_process_key(struct editor* ed, int c);
+
+/*** locking ***/
+
+bool tvim_unlock(struct editor* ed); 
+void tvim_lock(struct editor* ed); 
+void watch_add(struct editor* ed, int fd,
+               void (*ready)(struct editor* ed, int fd)); 
+void watch_remove(struct editor* ed, int fd); 
+bool watch_dispatch(struct editor* ed, struct pollfd* pfd, int nfds); 
+
+/*** editor ***/
+
+struct editor* editor_new(int screenRows, int screenCols); 
+void editor_free(struct editor* ed);
+
+#endif
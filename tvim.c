@@ -3,60 +3,56 @@
 #define _GNU_SOURCE
 
 /*** includes ***/
-#include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
-#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
-#include <sys/types.h>
-#include <termio.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "tvim.h"
 
 /*** data ***/
 
-struct editorConfig tvimConfig;
+struct terminal tvimTerm;
 
 /*** Exit ***/
 
-void free_tvim() {
-    if (tvimConfig.filename != NULL) {
-        free(tvimConfig.filename);
-        tvimConfig.filename = NULL;
-    }
-    if (tvimConfig.rows != NULL) {
-
-        for (int i = 0; i < tvimConfig.nRows; i++) {
-            if (tvimConfig.rows[i].chars != NULL) {
-                free(tvimConfig.rows[i].chars);
-                tvimConfig.rows[i].chars = NULL;
-            }
-            if (tvimConfig.rows[i].render != NULL) {
-                free(tvimConfig.rows[i].render);
-                tvimConfig.rows[i].render = NULL;
-            }
-        }
-        free(tvimConfig.rows);
-        tvimConfig.rows = NULL;
+// Put the screen back and write the stats before crash() reports.
+static void tvim_crashed() {
+    if (!tvimTerm.headless) {
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
     }
-    return;
+    stats_exit();
 }
 
-void crash(const char* s) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    free_tvim();
-    perror(s);
-    exit(99);
+void free_tvim() {
+    stats_exit();
+    if (tvimTerm.ed != NULL) {
+        editor_free(tvimTerm.ed);
+        tvimTerm.ed = NULL;
+    }
+    free(tvimTerm.input.buf);
+    tvimTerm.input.buf = NULL;
+    ab_free(&tvimTerm.screen);
+    tvimTerm.screen.buf = NULL;
+    return;
 }
 
 void clean_exit() {
+    struct editor* ed = tvimTerm.ed;
+    file_save_wait(ed);
+    if (ed->save.again) {
+        file_save(ed);
+    }
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
     free_tvim();
@@ -66,75 +62,56 @@ void clean_exit() {
 void usage_error() {
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
-    fprintf(stderr, "Usage: tvim file");
+    fprintf(stderr, "Usage: tvim file\n"
+                    "       tvim -f file\n"
+                    "       command | tvim -\n"
+                    "       tvim --replay keys file\n"
+                    "       tvim --bench results.json\n");
     exit(1);
 }
 
-/*** append buffer ***/
-
-struct abuf ab_init() {
-    // initial size 8, randomly selected can change.
-    int initial_capacity = 8;
-    struct abuf ab = {0};
-
-    // malloc() causes an error in realloc for ab_append? unsure why. calloc
-    // seems to fix this issue.
-
-    /*ab.buf = (char*)malloc(sizeof(char) * initial_capacity);*/
-    ab.buf = (char*)calloc(sizeof(char), sizeof(char) * initial_capacity);
-    ab.capacity = 8;
-    ab.len = 0;
-
-    return ab;
-}
-
-void ab_append(struct abuf* ab, const char* s, int len) {
-    // Realloc memory, keep increasing until enough memory allocated.
-    if (ab->len + len >= ab->capacity) {
-        int new_capacity = ab->capacity;
-        while (ab->len + len > new_capacity) {
-            new_capacity *= 2;
-        }
-        ab->buf = (char*)realloc(ab->buf, new_capacity * sizeof(char));
-        if (ab->buf == NULL) {
-            crash("Realloc");
-        }
-        ab->capacity = new_capacity;
-    }
-
-    // copy new string into buffer.
-    memcpy(&ab->buf[ab->len], s, len);
-    ab->len += len;
-}
-
-void ab_free(struct abuf* ab) {
-    if (ab->buf != NULL) {
-        free(ab->buf);
-    }
-}
-
 /*** terminal ***/
 
 void terminal_disable_raw_mode() {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &tvimConfig.og_termios) == -1)
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &tvimTerm.og_termios) == -1)
         crash("tcsetattr");
 }
 
 void terminal_enable_raw_mode() {
-    if (tcgetattr(STDIN_FILENO, &tvimConfig.og_termios) == -1)
+    if (tcgetattr(STDIN_FILENO, &tvimTerm.og_termios) == -1)
         crash("tcgetattr");
     atexit(terminal_disable_raw_mode);
 
-    struct termios raw = tvimConfig.og_termios;
+    struct termios raw = tvimTerm.og_termios;
     raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    // reads never block, tvim_run() polls for input instead.
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         crash("tcsetattr");
+
+    // ask for pastes to arrive wrapped in ESC[200~ ... ESC[201~.
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+// Move what is on stdin to another descriptor, returned, and put the
+// terminal back on stdin so keys come from it.
+int terminal_reattach_stdin() {
+    int fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1)
+        crash("fcntl");
+    int tty = open("/dev/tty", O_RDWR);
+    if (tty == -1)
+        crash("open /dev/tty");
+    if (dup2(tty, STDIN_FILENO) == -1)
+        crash("dup2");
+    close(tty);
+    return fd;
 }
 
 int terminal_get_cursor_position(int* rows, int* cols) {
@@ -146,7 +123,8 @@ int terminal_get_cursor_position(int* rows, int* cols) {
     }
 
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) != 1 || read(STDIN_FILENO, &buf[i], 1) != 1) {
             break;
         }
 
@@ -183,718 +161,741 @@ int terminal_get_window_size(int* rows, int* cols) {
     }
 }
 
-/*** row operations ***/
+/*** input ***/
 
-int row_cX_to_rX(row_t* row, int cX) {
-    int rX = 0;
-    int j;
-    for (j = 0; j < cX; j++) {
-        if (row->chars[j] == '\t')
-            rX += (TVIM_TAB_STOP - 1) - (rX % TVIM_TAB_STOP);
-        rX++;
+// Read everything the terminal has buffered into tvimTerm.input without
+// blocking. Returns the number of bytes read.
+int input_fill() {
+    struct input* in = &tvimTerm.input;
+    if (in->pos > 0) {
+        memmove(in->buf, &in->buf[in->pos], in->len - in->pos);
+        in->len -= in->pos;
+        in->pos = 0;
     }
-    return rX;
-}
 
-void row_update(row_t* row) {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->len; j++)
-        if (row->chars[j] == '\t')
-            tabs++;
-
-    if (row->render != NULL) {
-        free(row->render);
-    }
-    row->render = NULL;
-    row->render = (char*)malloc(sizeof(char) *
-                                (row->len + tabs * (TVIM_TAB_STOP - 1) + 1));
-    if (row->render == NULL) {
-        crash("malloc");
-    }
+    int total = 0;
+    while (1) {
+        if (in->capacity - in->len < 1024) {
+            in->capacity = in->capacity ? in->capacity * 2 : 4096;
+            in->buf = (char*)realloc(in->buf, in->capacity);
+            if (in->buf == NULL) {
+                crash("realloc");
+            }
+        }
 
-    int idx = 0;
-    for (j = 0; j < row->len; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TVIM_TAB_STOP != 0)
-                row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
+        int nread =
+            read(STDIN_FILENO, &in->buf[in->len], in->capacity - in->len);
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+            crash("Read");
+        }
+        if (nread <= 0) {
+            break;
         }
+        in->len += nread;
+        total += nread;
     }
-    row->render[idx] = '\0';
-    row->rlen = idx;
+    return total;
 }
 
-void row_append(char* s, size_t len) {
-    if (s == NULL) {
-        return;
-    }
-    if (tvimConfig.nRows == 0) {
-        tvimConfig.rows =
-            (row_t*)malloc(sizeof(row_t) * (tvimConfig.nRows + 1));
-    } else {
-        tvimConfig.rows = (row_t*)realloc(
-            tvimConfig.rows, sizeof(row_t) * (tvimConfig.nRows + 1));
+// Next byte of input. An escape sequence can be split across reads, so
+// when the buffer runs dry wait a little for the rest of it.
+static bool input_next(char* c) {
+    struct input* in = &tvimTerm.input;
+    if (in->pos == in->len) {
+        // a replayed script is all there is.
+        if (tvimTerm.headless) {
+            return false;
+        }
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, TVIM_ESC_TIMEOUT) != 1 || input_fill() == 0) {
+            return false;
+        }
     }
-
-    if (tvimConfig.rows == NULL) {
-        crash("malloc/realloc");
+    *c = in->buf[in->pos++];
+    return true;
+}
+
+// Move a bracketed paste from the input into ed->paste. Returns
+// PASTE once the closing ESC[201~ has been read, -1 while the rest of the
+// paste is still on its way.
+static int paste_collect() {
+    struct input* in = &tvimTerm.input;
+    struct editor* ed = tvimTerm.ed;
+    if (ed->paste.buf == NULL) {
+        ed->paste = ab_init();
+    }
+    tvimTerm.pasting = true;
+
+    char* start = &in->buf[in->pos];
+    int avail = in->len - in->pos;
+    char* end = (char*)memmem(start, avail, "\x1b[201~", 6);
+    if (end == NULL) {
+        // hold back what may be the first half of a split end marker.
+        int take = MAX(0, avail - 5);
+        ab_append(&ed->paste, start, take);
+        in->pos += take;
+        return -1;
     }
 
-    int at = tvimConfig.nRows;
-    tvimConfig.rows[at].len = len;
-    tvimConfig.rows[at].chars = (char*)malloc(len + 1);
-    memcpy(tvimConfig.rows[at].chars, s, len);
-    tvimConfig.rows[at].chars[len] = '\0';
-
-    tvimConfig.rows[at].rlen = 0;
-    tvimConfig.rows[at].render = NULL;
-    row_update(&tvimConfig.rows[at]);
-    tvimConfig.nRows++;
+    ab_append(&ed->paste, start, end - start);
+    in->pos += (end - start) + 6;
+    tvimTerm.pasting = false;
+    return PASTE;
 }
 
-void row_insert(int at, char* s, size_t len) {
-    if (at < 0 || at > tvimConfig.nRows)
-        return;
-
-    tvimConfig.rows = (row_t*)realloc(tvimConfig.rows,
-                                      sizeof(row_t) * (tvimConfig.nRows + 1));
-    if (tvimConfig.rows == NULL) {
-        crash("realloc");
+static int input_key() {
+    struct input* in = &tvimTerm.input;
+    if (tvimTerm.pasting) {
+        return paste_collect();
     }
-    memmove(&tvimConfig.rows[at + 1], &tvimConfig.rows[at],
-            sizeof(row_t) * (tvimConfig.nRows - at));
-
-    tvimConfig.rows[at].len = len;
-    tvimConfig.rows[at].chars = (char*)malloc(len + 1);
-    if (tvimConfig.rows[at].chars == NULL) {
-        crash("malloc");
+    if (in->pos == in->len) {
+        return -1;
     }
+    char c = in->buf[in->pos++];
 
-    memcpy(tvimConfig.rows[at].chars, s, len);
-    tvimConfig.rows[at].chars[len] = '\0';
-
-    tvimConfig.rows[at].rlen = 0;
-
-    tvimConfig.rows[at].render = NULL;
-
-    row_update(&tvimConfig.rows[at]);
+    if (c == '\x1b') {
+        char seq[3];
 
-    tvimConfig.nRows++;
-    tvimConfig.unsaved++;
-}
+        if (!input_next(&seq[0]))
+            return '\x1b';
+        // a plain escape followed by more typing, leave that for the next
+        // key.
+        if (seq[0] != '[') {
+            in->pos--;
+            return '\x1b';
+        }
+        if (!input_next(&seq[1]))
+            return '\x1b';
 
-void row_free(row_t* row) {
-    if (row->chars != NULL) {
-        free(row->chars);
-        row->chars = NULL;
-    }
+        if (isdigit(seq[1])) {
+            // ESC [ <number> ~
+            int param = seq[1] - '0';
+            do {
+                if (!input_next(&seq[2])) {
+                    return '\x1b';
+                }
+                if (isdigit(seq[2])) {
+                    param = param * 10 + (seq[2] - '0');
+                }
+            } while (isdigit(seq[2]) && param < 1000);
+
+            if (seq[2] == '~') {
+                switch (param) {
+                case 3:
+                    return DELETE_KEY;
+                case 200:
+                    return paste_collect();
+                }
+            }
+        } else {
+            switch (seq[1]) {
+            case 'A':
+                return ARROW_UP;
+                break;
+            case 'B':
+                return ARROW_DOWN;
+                break;
+            case 'C':
+                return ARROW_RIGHT;
+                break;
+            case 'D':
+                return ARROW_LEFT;
+            }
+        }
 
-    if (row->render != NULL) {
-        free(row->render);
-        row->render = NULL;
+        return '\x1b';
+    } else {
+        // bytes of UTF-8 text come through as 128..255.
+        return (unsigned char)c;
     }
-
-    // cannot free row since it is part of an array. Duh (I think)
-    /*if (row != NULL) {*/
-    /*    free(row);*/
-    /*    row = NULL;*/
-    /*}*/
-
-    return;
 }
 
-void row_delete(int at) {
-    if (at < 0 || at >= tvimConfig.nRows) {
-        return;
+// Next key from the input already read, -1 once it is used up.
+int tvim_read_key() {
+    long long start = stats_start();
+    int c = input_key();
+    if (c != -1) {
+        stats_stop(STAT_READ, start);
     }
-
-    row_free(&tvimConfig.rows[at]);
-
-    size_t size = sizeof(row_t) * (tvimConfig.nRows - at - 1);
-    memmove(&tvimConfig.rows[at], &tvimConfig.rows[at + 1], size);
-    tvimConfig.nRows--;
-    tvimConfig.unsaved++;
-
-    return;
+    return c;
 }
 
-void row_join(row_t* row, char* s, int len) {
-    row->chars = realloc(row->chars, row->len + len + 1);
-    memcpy(&row->chars[row->len], s, len);
-    row->len += len;
-    row->chars[row->len] = '\0';
-    row_update(row);
-    tvimConfig.unsaved++;
+/*** output ***/
 
-    return;
+void tvim_refresh_screen() {
+    long long start = stats_start();
+    struct abuf ab = ab_init();
+    tvim_draw(tvimTerm.ed, &ab);
+    if (tvimTerm.headless) {
+        ab_free(&tvimTerm.screen);
+        tvimTerm.screen = ab;
+    } else {
+        write(STDOUT_FILENO, ab.buf, ab.len);
+        ab_free(&ab);
+    }
+    stats_frame(start, tvimTerm.ed->frame.sent);
 }
 
-/*** file i/o ***/
+/*** main loop ***/
 
-void file_get_lines(FILE* fp) {
-    bool result = true;
+static long long now_us() {
+    return now_ns() / 1000;
+}
 
-    int nChars = 0;
-    char c;
-    while ((c = fgetc(fp)) != EOF) {
-        if (ferror(fp)) {
-            return_defer(false);
-        }
+// Sleep in poll() until there is input or a watched descriptor is ready,
+// run every key that arrived through tvim_process_key and redraw once for
+// the whole batch, at most once per frameInterval. Nothing runs while the
+// user is idle.
+void tvim_run() {
+    struct editor* ed = tvimTerm.ed;
+    bool dirty = true;
+    long long lastFrame = 0;
 
-        if (c == '\n' || c == '\r') {
-            char* cRow = (char*)malloc((sizeof(char) * nChars) + 1);
-            if (cRow == NULL) {
-                printf("malloc\n");
-                return_defer(false);
-            }
-
-            if (fseek(fp, -(nChars + 1), SEEK_CUR) < 0) {
-                printf("fseek");
-                return_defer(false);
+    tvim_lock(ed);
+    while (1) {
+        int timeout = -1;
+        if (dirty) {
+            long long wait = lastFrame + tvimTerm.frameInterval - now_us();
+            if (wait <= 0) {
+                tvim_refresh_screen();
+                lastFrame = now_us();
+                dirty = false;
+            } else {
+                timeout = (wait + 999) / 1000;
             }
-
-            fread(cRow, (nChars + 1) * sizeof(char), 1, fp);
-
-            cRow[nChars] = '\0';
-            row_append(cRow, nChars);
-            free(cRow);
-            cRow = NULL;
-            nChars = 0;
-            continue;
         }
 
-        nChars++;
-    }
-
-    if (nChars != 0) {
-        char* cRow = (char*)malloc((sizeof(char) * nChars) + 1);
-        if (cRow == NULL) {
-            return_defer(false);
+        struct pollfd pfd[1 + TVIM_MAX_WATCHES];
+        int nfds = 1 + ed->nWatches;
+        pfd[0] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+        for (int i = 0; i < ed->nWatches; i++) {
+            pfd[i + 1] = (struct pollfd){ed->watches[i].fd, POLLIN, 0};
         }
-
-        if (fseek(fp, -(nChars), SEEK_CUR) < 0) {
-            return_defer(false);
+        tvim_unlock(ed);
+        int ready = poll(pfd, nfds, timeout);
+        tvim_lock(ed);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            crash("poll");
         }
 
-        if (fread(cRow, nChars * sizeof(char), 1, fp) != 1) {
-            return_defer(false);
+        if (watch_dispatch(ed, &pfd[1], nfds - 1)) {
+            dirty = true;
         }
 
-        cRow[nChars + 1] = '\0';
-        row_append(cRow, nChars);
-        free(cRow);
-        cRow = NULL;
-    }
-
-    return_defer(true);
-
-defer:
-    if (fp) {
-        fclose(fp);
-    }
-    if (!result) {
-        crash("file error");
+        if (pfd[0].revents & POLLIN) {
+            input_fill();
+            int c;
+            while ((c = tvim_read_key()) != -1) {
+                tvim_process_key(ed, c);
+                if (ed->quit) {
+                    clean_exit();
+                }
+            }
+            dirty = true;
+        } else if (pfd[0].revents & (POLLHUP | POLLERR)) {
+            clean_exit();
+        }
     }
 }
 
-void file_open(char* filename) {
-    tvimConfig.filename = strdup(filename);
-
-    FILE* fp = fopen(filename, "r");
-    if (!fp)
-        crash("fopen");
-    file_get_lines(fp);
-}
-
-void file_save() {
+/*** replay ***/
 
-    FILE* fp = fopen(tvimConfig.filename, "r+");
-    for (int i = 0; i < tvimConfig.nRows; i++) {
-        // + 2 to include /n and /0
-        char* row = (char*)malloc(sizeof(char) * tvimConfig.rows[i].len + 2);
-        memcpy(row, tvimConfig.rows[i].chars, tvimConfig.rows[i].len);
-        row[tvimConfig.rows[i].len] = '\n';
+static const char* const replay_ops[OP_COUNT] = {
+    [OP_FIRST] = "first",   [OP_LOAD] = "load",     [OP_INSERT] = "insert",
+    [OP_NEWLINE] = "newline", [OP_DELETE] = "delete", [OP_MOVE] = "move",
+    [OP_SCROLL] = "scroll", [OP_SAVE] = "save",     [OP_WRITE] = "write",
+    [OP_OTHER] = "other",
+};
 
-        fwrite(row, tvimConfig.rows[i].len + 1, 1, fp);
-
-        free(row);
-    }
-
-    if (fp) {
-        fclose(fp);
+static void latency_add(struct latency* l, long long ns) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 256;
+        l->ns = (long long*)realloc(l->ns, sizeof(long long) * l->cap);
+        if (l->ns == NULL) {
+            crash("realloc");
+        }
     }
+    l->ns[l->n++] = ns;
 }
 
-/*** output ***/
+static int latency_cmp(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
 
-void tvim_scroll() {
-    tvimConfig.rX = 0;
-    if (tvimConfig.cY < tvimConfig.nRows) {
-        tvimConfig.rX =
-            row_cX_to_rX(&tvimConfig.rows[tvimConfig.cY], tvimConfig.cX);
-    }
+// pct-th percentile by nearest rank, of samples sorted already.
+static long long latency_pct(struct latency* l, int pct) {
+    int rank = (int)(((long long)l->n * pct + 99) / 100);
+    return l->ns[MAX(rank, 1) - 1];
+}
 
-    if (tvimConfig.cY < tvimConfig.rowOff) {
-        tvimConfig.rowOff = tvimConfig.cY;
-    }
-    if (tvimConfig.cY >= tvimConfig.rowOff + tvimConfig.screenRows) {
-        tvimConfig.rowOff = tvimConfig.cY - tvimConfig.screenRows + 1;
-    }
-    if (tvimConfig.rX < tvimConfig.colOff) {
-        tvimConfig.colOff = tvimConfig.rX;
-    }
-    if (tvimConfig.rX >= tvimConfig.colOff + tvimConfig.screenCols) {
-        tvimConfig.colOff = tvimConfig.rX - tvimConfig.screenCols + 1;
+static void latency_free(struct latency* lat) {
+    for (int op = 0; op < OP_COUNT; op++) {
+        free(lat[op].ns);
+        lat[op] = (struct latency){0};
     }
 }
 
-void tvim_move_cursor(int key) {
-    row_t* row = (tvimConfig.cY >= tvimConfig.nRows)
-                     ? NULL
-                     : &tvimConfig.rows[tvimConfig.cY];
+// The command line holds :cmd, for the command c is about to run.
+static bool replay_command(struct editor* ed, int c, const char* cmd) {
+    int len = strlen(cmd);
+    return ed->tvimMode == COMMAND && c == ENTER && ed->cmd.len == len &&
+           memcmp(ed->cmd.buf, cmd, len) == 0;
+}
 
-    switch (key) {
-    case h:
-    case ARROW_LEFT:
-        if (tvimConfig.cX != 0) {
-            tvimConfig.cX--;
-        } else if (tvimConfig.cY > 0) {
-            tvimConfig.cY--;
-            tvimConfig.cX = tvimConfig.rows[tvimConfig.cY].len;
+// What c is about to do in the mode tvim is in.
+static int replay_op(struct editor* ed, int c) {
+    if (c == ARROW_UP || c == ARROW_DOWN || c == ARROW_LEFT ||
+        c == ARROW_RIGHT) {
+        return OP_MOVE;
+    }
+    switch (ed->tvimMode) {
+    case NORMAL:
+        if (c == h || c == j || c == k || c == l) {
+            return OP_MOVE;
         }
-        break;
-    case l:
-    case ARROW_RIGHT:
-        if (row && tvimConfig.cX < row->len) {
-            tvimConfig.cX++;
-        } else if (row && tvimConfig.cX == row->len) {
-            if (tvimConfig.cY < tvimConfig.nRows) {
-                tvimConfig.cY++;
-            }
-            tvimConfig.cX = 0;
+        if (c == DELETE_KEY) {
+            return OP_DELETE;
         }
-        break;
-    case k:
-    case ARROW_UP:
-        if (tvimConfig.cY != 0) {
-            tvimConfig.cY--;
+        return c == CTRL_KEY('s') ? OP_SAVE : OP_OTHER;
+    case INSERT:
+        if (c == ENTER) {
+            return OP_NEWLINE;
         }
-        break;
-    case j:
-    case ARROW_DOWN:
-        if (tvimConfig.cY < tvimConfig.nRows) {
-            tvimConfig.cY++;
+        if (c == BACKSPACE || c == DELETE_KEY) {
+            return OP_DELETE;
         }
-        break;
-    }
-
-    row = (tvimConfig.cY >= tvimConfig.nRows) ? NULL
-                                              : &tvimConfig.rows[tvimConfig.cY];
-    int rowlen = row ? row->len : 0;
-    if (tvimConfig.cX > rowlen) {
-        tvimConfig.cX = rowlen;
-    }
-}
-
-void tvim_draw_rows(struct abuf* ab) {
-    int y;
-    for (y = 0; y < tvimConfig.screenRows; y++) {
-        int filrow_t = y + tvimConfig.rowOff;
-        if (filrow_t >= tvimConfig.nRows) {
-            if (tvimConfig.nRows == 0 && y == tvimConfig.screenRows / 3) {
-                char welcome[80];
-                int welcomelen =
-                    snprintf(welcome, sizeof(welcome),
-                             "Kilo editor -- version %s", TVIM_VERSION);
-                if (welcomelen > tvimConfig.screenCols)
-                    welcomelen = tvimConfig.screenCols;
-                int padding = (tvimConfig.screenCols - welcomelen) / 2;
-                if (padding) {
-                    ab_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    ab_append(ab, " ", 1);
-                ab_append(ab, welcome, welcomelen);
-            } else {
-                ab_append(ab, "~", 1);
-            }
-        } else {
-            int len = tvimConfig.rows[filrow_t].rlen - tvimConfig.colOff;
-            if (len < 0)
-                len = 0;
-            if (len > tvimConfig.screenCols)
-                len = tvimConfig.screenCols;
-            ab_append(ab, &tvimConfig.rows[filrow_t].render[tvimConfig.colOff],
-                      len);
+        if (c == ESCAPE || c == CTRL_KEY('l')) {
+            return OP_OTHER;
         }
-
-        ab_append(ab, "\x1b[K", 3);
-        ab_append(ab, "\r\n", 2);
-    }
-}
-
-void tvim_draw_status(struct abuf* ab) {
-    ab_append(ab, "\x1b[7m", 4);
-    int len = 0;
-    switch (tvimConfig.tvimMode) {
-    case (NORMAL):
-        ab_append(ab, "Normal", 6);
-        len += 6;
-        break;
-    case (VISUAL):
-        ab_append(ab, "Visual", 6);
-        len += 6;
-        break;
-    case (INSERT):
-        ab_append(ab, "Insert", 6);
-        len += 6;
-        break;
-    case (COMMAND):
-        ab_append(ab, ": ", 2);
-        len += 2;
-        break;
+        return OP_INSERT;
+    case VISUAL:
+        return c == DELETE_KEY ? OP_DELETE : OP_OTHER;
+    case COMMAND:
+        return replay_command(ed, c, ":w") ? OP_SAVE : OP_OTHER;
     default:
-        break;
+        return OP_OTHER;
     }
-    while (len < tvimConfig.screenCols) {
-        ab_append(ab, " ", 1);
-        len++;
-    }
-    ab_append(ab, "\x1b[m", 3);
 }
 
-void tvim_refresh_screen() {
-    tvim_scroll();
-
-    struct abuf ab = ab_init();
+// Hand over whatever the save and search threads finished in the
+// meantime, as the main loop would between keys.
+static void replay_watches(struct editor* ed) {
+    struct pollfd pfd[TVIM_MAX_WATCHES];
+    int nfds = ed->nWatches;
+    for (int i = 0; i < nfds; i++) {
+        pfd[i] = (struct pollfd){ed->watches[i].fd, POLLIN, 0};
+    }
+    tvim_unlock(ed);
+    int ready = poll(pfd, nfds, 0);
+    tvim_lock(ed);
+    if (ready > 0) {
+        watch_dispatch(ed, pfd, nfds);
+    }
+}
 
-    ab_append(&ab, "\x1b[?25l", 6);
-    ab_append(&ab, "\x1b[H", 3);
+// Run keys through tvim_process_key one at a time, redrawing after each
+// as the main loop does for a key typed on its own, and add the time each
+// took to lat. A save also adds the time until the file was written to
+// OP_WRITE, waiting for it before the next key. A key that quits ends the
+// replay, so there is still a report.
+void replay_keys(struct editor* ed, const char* keys, int len,
+                 struct latency* lat) {
+    struct input* in = &tvimTerm.input;
+    free(in->buf);
+    in->buf = (char*)malloc(MAX(len, 1));
+    if (in->buf == NULL) {
+        crash("malloc");
+    }
+    memcpy(in->buf, keys, len);
+    in->len = len;
+    in->capacity = MAX(len, 1);
+    in->pos = 0;
 
-    tvim_draw_rows(&ab);
-    tvim_draw_status(&ab);
+    tvim_lock(ed);
+    int c;
+    while ((c = tvim_read_key()) != -1) {
+        int op = replay_op(ed, c);
+        int rowOff = ed->rowOff;
+        int colOff = ed->colOff;
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-             (tvimConfig.cY - tvimConfig.rowOff) + 1,
-             (tvimConfig.rX - tvimConfig.colOff) + 1);
-    ab_append(&ab, buf, strlen(buf));
-
-    ab_append(&ab, "\x1b[?25h", 6);
+        long long start = now_ns();
+        tvim_process_key(ed, c);
+        tvim_refresh_screen();
+        long long end = now_ns();
+        if (ed->quit) {
+            break;
+        }
 
-    write(STDOUT_FILENO, ab.buf, ab.len);
-    ab_free(&ab);
+        if (op == OP_MOVE &&
+            (rowOff != ed->rowOff || colOff != ed->colOff)) {
+            op = OP_SCROLL;
+        }
+        latency_add(&lat[op], end - start);
+        if (op == OP_SAVE) {
+            file_save_wait(ed);
+            latency_add(&lat[OP_WRITE], now_ns() - start);
+        }
+        replay_watches(ed);
+    }
+    file_save_wait(ed);
+    tvim_unlock(ed);
+}
+
+// Open filename and draw the first screen, timed as OP_FIRST, and wait for
+// the rest of the file or the index of a huge one, timed from the start as
+// OP_LOAD.
+static void replay_load(struct editor* ed, const char* filename,
+                        struct latency* lat) {
+    long long start = now_ns();
+    file_open(ed, filename);
+    tvim_refresh_screen();
+    latency_add(&lat[OP_FIRST], now_ns() - start);
+    file_load_wait(ed);
+    huge_wait(ed);
+    latency_add(&lat[OP_LOAD], now_ns() - start);
+}
+
+static void replay_json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(out, "\\%c", *s);
+        } else if ((unsigned char)*s < ' ') {
+            fprintf(out, "\\u%04x", *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
 }
 
-void tvim_new_line() {
-    int line = tvimConfig.cY;
-    if (tvimConfig.cX == 0) {
-        row_insert(tvimConfig.cY, "", 0);
-    } else {
-        row_t* curRow = &tvimConfig.rows[line];
-        row_insert(tvimConfig.cY + 1, &curRow->chars[tvimConfig.cX],
-                   curRow->len - tvimConfig.cX);
-        row_t* row = &tvimConfig.rows[tvimConfig.cY];
-        row->len = tvimConfig.cX;
-        row->chars[row->len] = '\0';
-        row->render = NULL;
-        row->rlen = 0;
-        row_update(row);
-    }
-    tvimConfig.cY++;
-    tvimConfig.cX = 0;
+// A JSON object per line for each kind of operation in lat: how many there
+// were and the median, 99th percentile and slowest time in us.
+static void replay_report(FILE* out, const char* corpus,
+                          struct latency* lat) {
+    for (int op = 0; op < OP_COUNT; op++) {
+        struct latency* l = &lat[op];
+        if (l->n == 0) {
+            continue;
+        }
+        qsort(l->ns, l->n, sizeof(long long), latency_cmp);
+        fprintf(out, "{\"corpus\":");
+        replay_json_string(out, corpus);
+        fprintf(out,
+                ",\"op\":\"%s\",\"n\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+                "\"max_us\":%.1f}\n",
+                replay_ops[op], l->n, latency_pct(l, 50) / 1e3,
+                latency_pct(l, 99) / 1e3, l->ns[l->n - 1] / 1e3);
+    }
+}
+
+// tvim --replay: open filename without a terminal, replay the keys saved
+// in the keys file at it and report the latencies on stdout. The keys edit
+// and save the file just as they did when they were recorded.
+int replay_run(const char* keys, const char* filename) {
+    int fd = open(keys, O_RDONLY);
+    if (fd == -1) {
+        crash("open");
+    }
+    struct abuf script = ab_init();
+    char buf[4096];
+    int nread;
+    while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+        ab_append(&script, buf, nread);
+    }
+    if (nread == -1) {
+        crash("read");
+    }
+    close(fd);
 
-    return;
+    struct latency lat[OP_COUNT] = {0};
+    tvimTerm.headless = true;
+    tvim_init();
+    replay_load(tvimTerm.ed, filename, lat);
+    replay_keys(tvimTerm.ed, script.buf, script.len, lat);
+    replay_report(stdout, filename, lat);
+
+    latency_free(lat);
+    ab_free(&script);
+    free_tvim();
+    return 0;
 }
 
-void tvim_write_char(char c) {
-    if (tvimConfig.cY == tvimConfig.nRows) {
-        row_append("", 0);
+/*** bench ***/
+
+static void bench_code(struct abuf* ab, int i) {
+    static const char* const lines[] = {
+        "#include <stdio.h>",
+        "",
+        "/* helper %d, kept for the callers in module %d",
+        " * that still want the old behaviour. */",
+        "static int helper_%d(const char* s, int n) {",
+        "    int total = 0; // running sum for %d",
+        "    for (int i = 0; i < n; i++) {",
+        "        total += s[i] * %d;",
+        "    }",
+        "    printf(\"helper %%d: %%d\\n\", %d, total);",
+        "    return total;",
+        "}",
+    };
+    char line[128];
+    int n = sizeof(lines) / sizeof(lines[0]);
+    ab_append(ab, line, snprintf(line, sizeof(line), lines[i % n], i, i / n));
+}
+
+static void bench_log(struct abuf* ab, int i) {
+    static const char* const levels[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+    unsigned r = (unsigned)i * 2654435761u;
+    char line[192];
+    ab_append(ab, line,
+              snprintf(line, sizeof(line),
+                       "2026-10-16 %02d:%02d:%02d.%03d %-5s [worker-%u] "
+                       "request %d took %u ms status=%u "
+                       "path=\"/api/v1/items/%u\"",
+                       i / 360000 % 24, i / 6000 % 60, i / 100 % 60,
+                       i % 100 * 10, levels[r >> 30], r % 16, i, r % 997,
+                       r % 7 == 0 ? 500 : 200, r % 100000));
+}
+
+static void bench_utf8(struct abuf* ab, int i) {
+    char line[192];
+    ab_append(ab, line,
+              snprintf(line, sizeof(line),
+                       "%d\tnaïve café über straße — 中文字符测试 %d "
+                       "e\xCC\x81 😀 καλημέρα κόσμε",
+                       i, i * 7));
+}
+
+// a 2000 column line of words.
+static void bench_wide(struct abuf* ab, int i) {
+    char word[16];
+    for (int col = 0; col < 2000;) {
+        int n = snprintf(word, sizeof(word), "w%d ", (i + col) % 1000);
+        ab_append(ab, word, n);
+        col += n;
+    }
+}
+
+static const struct benchcorpus bench_corpora[] = {
+    {"code.c", bench_code, TVIM_BENCH_LINES},
+    {"app.log", bench_log, TVIM_BENCH_LINES},
+    {"utf8.txt", bench_utf8, TVIM_BENCH_LINES},
+    {"wide.txt", bench_wide, TVIM_BENCH_LINES / 100},
+};
+
+// The session replayed at every corpus: scroll down a long way, type a
+// few lines into the middle of a row, take most of it back, save a few
+// times and scroll back up.
+static void bench_script(struct abuf* ab) {
+    const char* text = "the quick brown fox jumps over the lazy dog ";
+    for (int n = 0; n < 2000; n++) {
+        ab_append(ab, "\x1b[B", 3);
+    }
+    for (int n = 0; n < 40; n++) {
+        ab_append(ab, "l", 1);
+    }
+    ab_append(ab, "i", 1);
+    for (int n = 0; n < 2400; n++) {
+        ab_append(ab, n % 60 == 59 ? "\r" : &text[n % strlen(text)], 1);
+    }
+    for (int n = 0; n < 600; n++) {
+        ab_append(ab, "\x7f", 1);
+    }
+    ab_append(ab, "\x1b", 1);
+    for (int n = 0; n < 10; n++) {
+        ab_append(ab, "\x13ix\x1b", 4);
+    }
+    for (int n = 0; n < 1000; n++) {
+        ab_append(ab, "\x1b[A", 3);
+    }
+}
+
+static void bench_write(const char* path, const struct benchcorpus* c) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        crash("fopen");
     }
+    struct abuf line = ab_init();
+    for (int i = 0; i < c->lines; i++) {
+        line.len = 0;
+        c->line(&line, i);
+        ab_append(&line, "\n", 1);
+        fwrite(line.buf, 1, line.len, f);
+    }
+    ab_free(&line);
+    if (fclose(f) != 0) {
+        crash("fclose");
+    }
+}
+
+// Load path in a headless tvim of its own, replay script at it unless it
+// is NULL and add the samples the child sends back to lat.
+static void bench_fork(const char* path, struct abuf* script,
+                       struct latency* lat) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        crash("pipe");
+    }
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        crash("fork");
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        struct latency mine[OP_COUNT] = {0};
+        tvimTerm.headless = true;
+        tvim_init();
+        replay_load(tvimTerm.ed, path, mine);
+        if (script != NULL) {
+            replay_keys(tvimTerm.ed, script->buf, script->len, mine);
+        }
 
-    row_t* curRow = &tvimConfig.rows[tvimConfig.cY];
+        // (op, ns) pairs.
+        struct abuf out = ab_init();
+        for (long long op = 0; op < OP_COUNT; op++) {
+            for (int n = 0; n < mine[op].n; n++) {
+                long long sample[2] = {op, mine[op].ns[n]};
+                ab_append(&out, (char*)sample, sizeof(sample));
+            }
+        }
+        for (int done = 0, w; done < out.len; done += w) {
+            w = write(fds[1], &out.buf[done], out.len - done);
+            if (w == -1) {
+                crash("write");
+            }
+        }
+        free_tvim();
+        exit(0);
+    }
 
-    int loc = tvimConfig.cX;
-    if (loc < 0 || loc > curRow->len) {
-        loc = curRow->len;
+    close(fds[1]);
+    struct abuf in = ab_init();
+    char buf[4096];
+    int nread;
+    while ((nread = read(fds[0], buf, sizeof(buf))) > 0) {
+        ab_append(&in, buf, nread);
     }
+    close(fds[0]);
 
-    if (curRow->chars == NULL) {
-        crash("Chars is null for some reason");
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        crash("waitpid");
     }
-    curRow->chars = (char*)realloc(curRow->chars, curRow->len + 2);
-    if (curRow->chars == NULL) {
-        crash("realloc");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "tvim: bench run on %s failed\n", path);
+        exit(1);
     }
-    if (memmove(&curRow->chars[loc + 1], &curRow->chars[loc],
-                curRow->len - tvimConfig.cX + 1) == NULL) {
-        crash("memmove");
+    for (int at = 0; at + 2 * (int)sizeof(long long) <= in.len;
+         at += 2 * sizeof(long long)) {
+        long long sample[2];
+        memcpy(sample, &in.buf[at], sizeof(sample));
+        latency_add(&lat[sample[0]], sample[1]);
     }
-
-    curRow->len += 1;
-    curRow->chars[loc] = c;
-    tvimConfig.cX++;
-    curRow->rlen = 0;
-    curRow->render = NULL;
-    row_update(curRow);
-
-    return;
+    ab_free(&in);
 }
 
-void tvim_delete_char() {
-    row_t* curRow = &tvimConfig.rows[tvimConfig.cY];
-    int loc = tvimConfig.cX - 1;
-
-    if (tvimConfig.cY == tvimConfig.nRows) {
-        return;
+// tvim --bench: generate each corpus in a scratch directory, time
+// TVIM_BENCH_LOADS fresh loads of it, the last one followed by the
+// bench_script session, and write replay_report lines to results as well
+// as stdout.
+int bench_run(const char* results) {
+    FILE* out = fopen(results, "w");
+    if (out == NULL) {
+        crash("fopen");
     }
-    if (tvimConfig.cY == 0 && tvimConfig.cX == 0) {
-        return;
+    char dir[] = "/tmp/tvim-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        crash("mkdtemp");
     }
+    struct abuf script = ab_init();
+    bench_script(&script);
 
-    if (tvimConfig.cX <= 0) {
-        tvimConfig.cX = tvimConfig.rows[tvimConfig.cY - 1].len;
-
-        row_join(&tvimConfig.rows[tvimConfig.cY - 1], curRow->chars,
-                 curRow->len);
-
-        row_delete(tvimConfig.cY);
-
-        tvimConfig.cY--;
-        tvimConfig.unsaved += 1;
-    } else {
+    int nCorpora = sizeof(bench_corpora) / sizeof(bench_corpora[0]);
+    for (int c = 0; c < nCorpora; c++) {
+        const struct benchcorpus* corpus = &bench_corpora[c];
+        char path[sizeof(dir) + 64];
+        snprintf(path, sizeof(path), "%s/%s", dir, corpus->name);
+        bench_write(path, corpus);
 
-        if (loc > curRow->len) {
-            loc = curRow->len;
+        struct latency lat[OP_COUNT] = {0};
+        for (int run = 0; run < TVIM_BENCH_LOADS; run++) {
+            bench_fork(path, run == TVIM_BENCH_LOADS - 1 ? &script : NULL,
+                       lat);
         }
-
-        memmove(&curRow->chars[loc], &curRow->chars[loc + 1],
-                curRow->len - loc);
-
-        curRow->len--;
-        curRow->chars[curRow->len] = '\0';
-        tvimConfig.cX--;
-
-        row_update(curRow);
-        tvimConfig.unsaved += 1;
+        replay_report(out, corpus->name, lat);
+        replay_report(stdout, corpus->name, lat);
+        latency_free(lat);
+        unlink(path);
     }
 
-    return;
+    ab_free(&script);
+    rmdir(dir);
+    if (fclose(out) != 0) {
+        crash("fclose");
+    }
+    return 0;
 }
 
-/*** input ***/
+/*** init ***/
 
-int tvim_read_key() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) {
-            crash("Read");
-        }
+void tvim_init() {
+    int fps = TVIM_MAX_FPS;
+    char* env = getenv("TVIM_FPS");
+    if (env != NULL && atoi(env) > 0) {
+        fps = atoi(env);
     }
+    tvimTerm.frameInterval = 1000000 / fps;
+    crash_set_hook(tvim_crashed);
 
-    if (c == '\x1b') {
-        char seq[3];
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
-            return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
-            return '\x1b';
-
-        if (seq[0] == '[') {
-            if (isdigit(seq[1])) {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-                    return '\x1b';
-                }
-
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                    case '3':
-                        return DELETE_KEY;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                case 'A':
-                    return ARROW_UP;
-                    break;
-                case 'B':
-                    return ARROW_DOWN;
-                    break;
-                case 'C':
-                    return ARROW_RIGHT;
-                    break;
-                case 'D':
-                    return ARROW_LEFT;
-                }
-            }
-        }
-
-        return '\x1b';
-    } else {
-        return c;
-    }
-}
-
-void tvim_process_normal(int c) {
-    switch (c) {
-    case ARROW_UP:
-    case ARROW_DOWN:
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-    case l:
-    case k:
-    case j:
-    case h:
-        tvim_move_cursor(c);
-        break;
-    case o:
-        row_insert(tvimConfig.cY + 1, "", 0);
-        tvimConfig.cY += 1;
-        tvimConfig.cX = 0;
-        tvimConfig.tvimMode = INSERT;
-        break;
-
-    case 'O':
-        row_insert(tvimConfig.cY, "", 0);
-        tvimConfig.cX = 0;
-        tvimConfig.tvimMode = INSERT;
-        break;
-    case DELETE_KEY:
-        tvim_move_cursor(ARROW_RIGHT);
-        tvim_delete_char();
-        tvimConfig.tvimMode = NORMAL;
-        break;
-    case v:
-        tvimConfig.tvimMode = VISUAL;
-        break;
-    case i:
-        tvimConfig.tvimMode = INSERT;
-        break;
-    case ESCAPE:
-        break;
-    case CTRL_KEY('q'):
-        clean_exit();
-        break;
-    case CTRL_KEY('s'):
-        file_save();
-        break;
-    default:
-        break;
-    }
-}
-
-void tvim_process_visual(int c) {
-    switch (c) {
-    case ARROW_UP:
-    case ARROW_DOWN:
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-        tvim_move_cursor(c);
-        break;
-    case DELETE_KEY:
-        tvim_move_cursor(ARROW_RIGHT);
-        tvim_delete_char();
-        tvimConfig.tvimMode = NORMAL;
-        break;
-    case ESCAPE:
-        tvimConfig.tvimMode = NORMAL;
-        break;
-    case CTRL_KEY('q'):
-        clean_exit();
-        break;
-    default:
-        break;
-    }
-}
-
-void tvim_process_insert(int c) {
-    switch (c) {
-    case ARROW_UP:
-    case ARROW_DOWN:
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-        tvim_move_cursor(c);
-        break;
-    case DELETE_KEY:
-        tvim_move_cursor(ARROW_RIGHT);
-        tvim_delete_char();
-        tvimConfig.tvimMode = NORMAL;
-        break;
-    case BACKSPACE:
-        tvim_delete_char();
-        break;
-    case ENTER:
-        tvim_new_line();
-        break;
-    case CTRL_KEY('l'):
-    case ESCAPE:
-        tvimConfig.tvimMode = NORMAL;
-        break;
-    case CTRL_KEY('q'):
-        clean_exit();
-        break;
-    default:
-        tvim_write_char(c);
-        break;
+    // TVIM_STATS=file collects stats from the start and writes them to
+    // file on exit.
+    env = getenv("TVIM_STATS");
+    if (env != NULL && env[0] != '\0') {
+        tvimStats.dump = strdup(env);
+        stats_enable();
     }
 
-    return;
-}
-
-void tvim_process_command(int c) {
-    UNUSED(c);
-    return;
-}
+    int rows = TVIM_BENCH_ROWS;
+    int cols = TVIM_BENCH_COLS;
+    if (!tvimTerm.headless && terminal_get_window_size(&rows, &cols) == -1)
+        crash("terminal_get_window_size");
+    tvimTerm.ed = editor_new(rows - 1, cols);
 
-void tvim_process_key(int c) {
-    switch (tvimConfig.tvimMode) {
-    case INSERT:
-        tvim_process_insert(c);
-        break;
-    case NORMAL:
-        tvim_process_normal(c);
-        break;
-    case VISUAL:
-        tvim_process_visual(c);
-        break;
-    case COMMAND:
-        tvim_process_command(c);
-        break;
-    default:
-        break;
+    // TVIM_HUGE=bytes opens files bigger than that windowed, see
+    // struct hugefile.
+    env = getenv("TVIM_HUGE");
+    if (env != NULL && env[0] != '\0') {
+        tvimTerm.ed->hugeSize = strtoull(env, NULL, 10);
+    }
+    // TVIM_FOLLOW=lines is how many lines tvim -f keeps.
+    env = getenv("TVIM_FOLLOW");
+    if (env != NULL && atoi(env) > 0) {
+        tvimTerm.ed->follow.max = atoi(env);
     }
-}
-
-/*** init ***/
-
-void tvim_init() {
-    tvimConfig.cX = 0;
-    tvimConfig.cY = 0;
-    tvimConfig.rX = 0;
-    tvimConfig.rowOff = 0;
-    tvimConfig.colOff = 0;
-    tvimConfig.nRows = 0;
-    tvimConfig.rows = NULL;
-    tvimConfig.filename = NULL;
-
-    if (terminal_get_window_size(&tvimConfig.screenRows,
-                                 &tvimConfig.screenCols) == -1)
-        crash("terminal_get_window_size");
-    tvimConfig.screenRows -= 1;
 }
 
 /*** command line ***/
 
 int command_valid(int argc, char** argv) {
-    (void)argv;
     if (argc < 2) {
         return 0;
     }
+    if (strcmp(argv[1], "--replay") == 0) {
+        return argc == 4;
+    }
+    if (strcmp(argv[1], "--bench") == 0) {
+        return argc == 3;
+    }
+    if (strcmp(argv[1], "-f") == 0) {
+        return argc == 3;
+    }
     return 1;
 }
 
@@ -902,16 +903,27 @@ int main(int argc, char** argv) {
     if (!command_valid(argc, argv)) {
         usage_error();
     }
+    if (strcmp(argv[1], "--replay") == 0) {
+        return replay_run(argv[2], argv[3]);
+    }
+    if (strcmp(argv[1], "--bench") == 0) {
+        return bench_run(argv[2]);
+    }
+    // the text comes in on stdin and the keys from the terminal.
+    int in = -1;
+    if (strcmp(argv[1], "-") == 0) {
+        in = terminal_reattach_stdin();
+    }
     terminal_enable_raw_mode();
     tvim_init();
-    file_open(argv[1]);
-    int i = 0;
-    while (1) {
-        tvim_refresh_screen();
-        int c = tvim_read_key();
-        i++;
-        tvim_process_key(c);
+    if (in != -1) {
+        file_stream(tvimTerm.ed, in);
+    } else if (strcmp(argv[1], "-f") == 0) {
+        follow_open(tvimTerm.ed, argv[2]);
+    } else {
+        file_open(tvimTerm.ed, argv[1]);
     }
+    tvim_run();
     free_tvim();
     return 0;
 }
@@ -1,88 +1,73 @@
 #ifndef TVIM_H
 #define TVIM_H
 
-#include <stddef.h>
 #include <termios.h>
-#include <stdlib.h>
-#include <stdio.h>
 
-/*** Defines ***/
-#define TVIM_VERSION "0.0.1"
-#define TVIM_TAB_STOP 4
-
-/*** Macros ***/
-#define MAX(x, y) (((x) > (y)) ? (x) : (y))
-#define MIN(x, y) (((x) < (y)) ? (x) : (y))
-
-#define UNUSED(x) (void)x
-
-#define CTRL_KEY(k) ((k) & 0x1F)
+#include "libtvim.h"
 
-#define return_defer(value) \
-    do {                    \
-        result = (value);   \
-        goto defer;         \
-    } while (0)
+/*** Defines ***/
+// most redraws per second, the TVIM_FPS environment variable overrides it.
+#define TVIM_MAX_FPS 120
+// how long to wait for the rest of an escape sequence, in ms.
+#define TVIM_ESC_TIMEOUT 25
+// screen size of a headless replay.
+#define TVIM_BENCH_ROWS 50
+#define TVIM_BENCH_COLS 160
+// lines in each corpus make bench generates.
+#define TVIM_BENCH_LINES 200000
+// times make bench loads each corpus in a fresh process.
+#define TVIM_BENCH_LOADS 5
 
 /*** Data types and Data def ***/
 
-enum mode {
-    NORMAL = 0,
-    VISUAL,
-    INSERT,
-    COMMAND,
+// Bytes read from the terminal that have not been turned into keys yet.
+struct input {
+    char* buf;
+    int len;
+    int pos;
+    int capacity;
 };
 
-enum key {
-    BACKSPACE = 127,
-    i = 'i',
-    ESCAPE = 27, 
-    ENTER = '\r',
-    l = 'l',
-    k = 'k',
-    j = 'j',
-    h = 'h',
-    v = 'v',
-    o = 'o',
-    O = 'O',
-    ARROW_LEFT = 1000,
-    ARROW_RIGHT,
-    ARROW_UP,
-    ARROW_DOWN,
-    DELETE_KEY,
-    // could add page up/down. I don't want to, so I will not :)
-    // could add home + end keys. but guess what? I don't use those so I will not.
+// The terminal front end, a client of one editor.
+struct terminal {
+    struct editor* ed;
+    struct input input;
+    bool pasting; // reading a bracketed paste into ed->paste
+    int frameInterval; // minimum time between redraws, in us
+    struct termios og_termios;
+
+    // no terminal, frames are drawn into screen. See replay_run.
+    bool headless;
+    struct abuf screen; // the last frame drawn headless
 };
 
-struct abuf {
-    char* buf;
-    int len;
-    int capacity;
+// What a key did, for the latency report of a replay.
+enum replayop {
+    OP_FIRST = 0, // opening the file and drawing the first screen
+    OP_LOAD,      // ... until every line is in
+    OP_INSERT,
+    OP_NEWLINE,
+    OP_DELETE,
+    OP_MOVE,
+    OP_SCROLL, // a move that scrolled the screen
+    OP_SAVE,
+    OP_WRITE, // from a save key until the file is written
+    OP_OTHER,
+    OP_COUNT,
 };
 
-typedef struct {
-    int len;
-    int rlen;
-    char* chars;
-    char* render;
-} row_t;
-
-struct editorConfig {
-    int cX, cY;
-    int rX;
-    int rowOff;
-    int colOff;
-    int screenRows;
-    int screenCols;
-    int nRows;
-    row_t* rows;
-    char* filename;
-
-    int unsaved;
-
-    enum mode tvimMode;
+// Times one kind of operation took, in ns.
+struct latency {
+    long long* ns;
+    int n;
+    int cap;
+};
 
-    struct termios og_termios;
+// A file make bench generates, line writes line i of it into ab.
+struct benchcorpus {
+    const char* name;
+    void (*line)(struct abuf* ab, int i);
+    int lines;
 };
 
 
@@ -90,7 +75,7 @@ struct editorConfig {
 
 /*** Exit ***/
 
-void crash(const char* s);
+void free_tvim(); 
 void clean_exit();
 void usage_error(); 
 
@@ -98,60 +83,33 @@ void usage_error();
 
 void terminal_disable_raw_mode();
 void terminal_enable_raw_mode();
+int terminal_reattach_stdin();
 int terminal_get_cursor_position(int* rows, int* cols);
 int terminal_get_window_size(int* rows, int* cols); 
 
-/*** row operations ***/
-
-int row_cX_to_rX(row_t* row, int cX); 
-void row_update(row_t* row); 
-void row_append(char* s, size_t len); 
-void row_insert(int at, char* s, size_t len); 
-void row_free(row_t* row); 
-void row_delete(int at); 
-void row_join(row_t* row, char* s, int len); 
-
-/*** char operations ***/
-void tvim_write_char(char c); 
-void tvim_delete_char(); 
-void tvim_new_line(); 
-
-/*** file i/o ***/
-
-void file_open(char* filename); 
-void file_get_rows(FILE* fp);
+/*** input ***/
 
-/*** append buffer ***/
+int tvim_read_key(); 
 
-struct abuf ab_init(); 
-void ab_append(struct abuf* ab, const char* s, int len); 
-void ab_free(struct abuf* ab); 
+int input_fill(); 
 
 /*** output ***/
 
-void tvim_scroll(); 
-
-void tvim_move_cursor(int key); 
-
-void tvim_draw_rows(struct abuf* ab); 
-
-void tvim_draw_status(struct abuf* ab); 
-
 void tvim_refresh_screen(); 
 
-/*** input ***/
+/*** main loop ***/
 
-int tvim_read_key(); 
-
-void tvim_process_normal(int c); 
+void tvim_run(); 
 
-void tvim_process_visual(int c); 
+/*** replay ***/
 
-void tvim_process_insert(int c); 
+void replay_keys(struct editor* ed, const char* keys, int len,
+                 struct latency* lat); 
+int replay_run(const char* keys, const char* filename); 
 
-void tvim_process_command(int c); 
+/*** bench ***/
 
-void tvim_process_key(int c); 
+int bench_run(const char* results); 
 
 /*** init ***/
 
@@ -163,5 +121,4 @@ int command_valid(int argc, char** argv);
 
 int main(int argc, char** argv); 
 
-
 #endif